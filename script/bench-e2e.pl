@@ -0,0 +1,97 @@
+#! perl
+
+use v5.10.1;
+
+use strict;
+use warnings FATAL => 'all';
+
+use Getopt::Long;
+use IO::Socket::INET;
+use POSIX qw(WNOHANG);
+use Time::HiRes qw(time sleep);
+
+# polls mongodb-stats against mongodb-standin serving a given number of
+# databases and reports the poll wall times: of the process and the
+# .99.3 and .99.5 values mongodb-stats measured itself
+
+my %opts = (
+    "stats"               => "./mongodb-stats",
+    "standin"             => "./mongodb-standin",
+    "port"                => 27018,
+    "polls"               => 5,
+    "dbstats-concurrency" => 4,
+);
+my (@databases, @latency);
+GetOptions( \%opts, "stats=s", "standin=s", "port=i", "polls=i", "dbstats-concurrency=i",
+	    "databases=i" => \@databases, "latency=s" => \@latency ) or die "Cannot parse options";
+@databases or @databases = ( 1, 100, 5000 );
+
+-x $opts{"stats"} or die "Can't execute '" . $opts{"stats"} . "'";
+-x $opts{"standin"} or die "Can't execute '" . $opts{"standin"} . "'";
+
+sub median
+{
+    my @v = sort { $a <=> $b } @_;
+    @v or return 0;
+    return $v[ int( $#v / 2 ) ];
+}
+
+sub ms
+{
+    my ($ns) = @_;
+    return sprintf( "%.1f", $ns / 1e6 );
+}
+
+sub start_standin
+{
+    my ($databases) = @_;
+
+    my $pid = fork() // die "Can't fork: $!";
+    unless($pid)
+    {
+	exec( $opts{"standin"}, "--port", $opts{"port"}, "--databases", $databases, map { ( "--latency", $_ ) } @latency )
+	    or die "Can't exec '" . $opts{"standin"} . "': $!";
+    }
+
+    # synthesising thousands of databases takes a moment
+    for( 1 .. 600 )
+    {
+	IO::Socket::INET->new( PeerAddr => "127.0.0.1", PeerPort => $opts{"port"}, Proto => "tcp" ) and return $pid;
+	waitpid( $pid, WNOHANG ) == $pid and die "mongodb-standin exited: $?";
+	sleep(0.1);
+    }
+
+    kill( "TERM", $pid );
+    die "mongodb-standin does not listen on port " . $opts{"port"};
+}
+
+my @phases = qw(connect auth listDatabases dbstats serverStatus replSetGetStatus extraction);
+
+printf( "%9s %10s %10s %s\n", "databases", "process", "poll", join( " ", map { sprintf( "%10s", $_ ) } @phases ) );
+for my $databases (@databases)
+{
+    my $pid = start_standin($databases);
+    my (@process, @poll, %phase);
+
+    for( 1 .. $opts{"polls"} )
+    {
+	my $start = time();
+	my $out = qx{$opts{"stats"} --dsn 127.0.0.1:$opts{"port"} --dbstats-concurrency $opts{"dbstats-concurrency"}};
+	push( @process, ( time() - $start ) * 1e9 );
+	$? == 0 or die "mongodb-stats failed: $?";
+
+	$out =~ m/\[ "\.99\.3", \d+, (\d+) \]/ and push( @poll, $1 );
+	while( $out =~ m/\[ "\.99\.5\.1\.2\.(\d+)", \d+, (\d+) \]/g )
+	{
+	    push( @{ $phase{ $phases[ $1 - 1 ] // "other" } }, $2 );
+	}
+    }
+
+    kill( "TERM", $pid );
+    waitpid( $pid, 0 );
+
+    printf( "%9d %10s %10s %s\n", $databases, ms( median(@process) ), ms( median(@poll) ),
+	    join( " ", map { sprintf( "%10s", ms( median( @{ $phase{$_} // [] } ) ) ) } @phases ) );
+}
+
+print "median wall times in ms over " . $opts{"polls"} . " polls\n";
@@ -0,0 +1,270 @@
+#! perl
+
+use v5.10.1;
+
+use strict;
+use warnings FATAL => 'all';
+
+use Getopt::Long;
+use IO::Uncompress::Unzip qw(unzip $UnzipError);
+
+# MIB type => [ conversion, ASN.1/SMI type ]
+my %value_types = (
+    "STR"         => [ "MIB_STR",    "ASN_OCTET_STR" ],
+    "INT"         => [ "MIB_INT",    "ASN_INTEGER" ],
+    "UINT"        => [ "MIB_UINT",   "SMI_UINTEGER" ],
+    "UINT64"      => [ "MIB_UINT64", "SMI_COUNTER64" ],
+    "STR (FLOAT)" => [ "MIB_DOUBLE", "ASN_OCTET_STR" ],
+);
+
+sub xml_text
+{
+    my ($content) = @_;
+    defined($content) or return "";
+
+    my $text = join( "\n", $content =~ m{<text:p>(.*?)</text:p>}gs );
+    $text =~ s/<[^>]+>//g;
+    $text =~ s/&lt;/</g;
+    $text =~ s/&gt;/>/g;
+    $text =~ s/&quot;/"/g;
+    $text =~ s/&apos;/'/g;
+    $text =~ s/&amp;/&/g;
+
+    return $text;
+}
+
+sub read_mib
+{
+    my ($ods) = @_;
+    my $xml;
+
+    unzip( $ods => \$xml, Name => "content.xml" ) or die "Can't read content.xml from '$ods': $UnzipError";
+    $xml =~ m{<table:table [^>]*>(.*?)</table:table>}s or die "No table in '$ods'";
+    my $table = $1;
+
+    my (@rows, %col);
+    while( $table =~ m{<table:table-row[^>]*>(.*?)</table:table-row>}gs )
+    {
+	my $row = $1;
+	my @cells;
+	while( $row =~ m{<table:table-cell([^>]*?)(?:/>|>(.*?)</table:table-cell>)}gs )
+	{
+	    my ($attrs, $content) = ($1, $2);
+	    my $repeat = $attrs =~ m/table:number-columns-repeated="(\d+)"/ ? $1 : 1;
+	    push( @cells, (xml_text($content)) x $repeat );
+	}
+
+	if( !%col )
+	{
+	    defined($cells[0]) and $cells[0] eq "NAME" or next;
+	    @col{@cells} = (0 .. $#cells);
+	    defined($col{$_}) or die "Column $_ missing in '$ods'" for qw(NAME OID TYPE BSON);
+	    next;
+	}
+
+	my %r = map { $_ => $cells[$col{$_}] // "" } qw(NAME OID TYPE BSON);
+	$r{OID} ne "" and push( @rows, \%r );
+    }
+
+    @rows or die "No MIB rows found in '$ods'";
+    return @rows;
+}
+
+sub enum_name
+{
+    my ($path) = @_;
+    my @segs = split( m{[:/]}, $path );
+    my %special = ( "." => "DOT", "*" => "ANY", "[]" => "ROW" );
+
+    my @names;
+    for my $seg (@segs)
+    {
+	( my $name = $special{$seg} // uc($seg) ) =~ s/[^A-Za-z0-9]/_/g;
+	push( @names, $name );
+    }
+
+    return join( "_", @names );
+}
+
+sub build_trees
+{
+    my @rows = @_;
+    my @entries = map { $_->{OID} } grep { $_->{TYPE} =~ m/^ENTR/ } @rows;
+    my (%trees, @commands);
+
+    for my $r (@rows)
+    {
+	$r->{BSON} ne "" or next;
+	my $types = $value_types{$r->{TYPE}} or die "Unknown type '$r->{TYPE}' of $r->{NAME}";
+
+	# values inside a table entry are relative to the entry
+	my $oid = $r->{OID};
+	my ($entry) = sort { length($b) <=> length($a) } grep { index( $oid, "$_." ) == 0 } @entries;
+	$entry and $oid = substr( $oid, length($entry) );
+
+	for my $source ( split( " ", $r->{BSON} ) )
+	{
+	    my ($cmd, $path) = $source =~ m/^(\w+):(.+)$/ or die "Malformed BSON '$source' of $r->{NAME}";
+	    $trees{$cmd} or push( @commands, $cmd );
+	    my $node = $trees{$cmd} //= { path => $cmd, children => {}, order => [], emits => [] };
+	    for my $seg ( split( "/", $path ) )
+	    {
+		unless( $node->{children}{$seg} )
+		{
+		    push( @{$node->{order}}, $seg );
+		    $node->{children}{$seg} = { path => $node->{path} . ( $node->{path} eq $cmd ? ":" : "/" ) . $seg,
+						children => {}, order => [], emits => [] };
+		}
+		$node = $node->{children}{$seg};
+	    }
+	    push( @{$node->{emits}}, [ @$types, $oid, $r->{NAME} ] );
+	}
+    }
+
+    return (\%trees, \@commands);
+}
+
+my (@levels, @fields, @emits, @slots, @hooks, @level_enums);
+
+sub perfect_hash
+{
+    my ($names) = @_;
+    my $size = 1;
+    $size <<= 1 while( $size < scalar(@$names) );
+
+    for(;; $size <<= 1 )
+    {
+	SEED: for my $seed (0 .. 9999)
+	{
+	    my @table = (0) x $size;
+	    for my $i (0 .. $#$names)
+	    {
+		my $h = 2166136261 ^ $seed;
+		for my $c ( unpack( "C*", $names->[$i] ) )
+		{
+		    $h = ( ( $h ^ $c ) * 16777619 ) % 4294967296;
+		}
+		my $slot = $h & ( $size - 1 );
+		$table[$slot] and next SEED;
+		$table[$slot] = $i + 1;
+	    }
+
+	    return ($seed, \@table);
+	}
+    }
+}
+
+sub is_table
+{
+    my ($node) = @_;
+    return $node->{children}{"[]"} || $node->{children}{"*"};
+}
+
+sub gen_level
+{
+    my ($node) = @_;
+    my $level = scalar(@levels);
+    push( @levels, undef );
+    push( @level_enums, [ "MIB_LEVEL_" . enum_name($node->{path}), $level ] );
+
+    my @level_fields;
+    for my $seg ( @{$node->{order}} )
+    {
+	my $child = $node->{children}{$seg};
+	$seg ne "[]" and $seg ne "*" or die "$node->{path}: table entries need a named parent";
+
+	if( !@{$child->{order}} )
+	{
+	    push( @level_fields, { name => $seg, kind => "MIB_ITEM", level => "MIB_NO_LEVEL", hook => "MIB_NO_HOOK",
+				   first_emit => scalar(@emits), n_emits => scalar(@{$child->{emits}}) } );
+	    push( @emits, @{$child->{emits}} );
+	}
+	elsif( is_table($child) )
+	{
+	    my $hook = "MIB_HOOK_" . enum_name($child->{path});
+	    push( @hooks, $hook );
+	    push( @level_fields, { name => $seg, kind => "MIB_TABLE", level => "MIB_NO_LEVEL", hook => $hook,
+				   first_emit => 0, n_emits => 0 } );
+	    # entry levels are used by the extractor bound to the hook
+	    @{$child->{children}{$_}{order}} and gen_level( $child->{children}{$_} ) for @{$child->{order}};
+	}
+	else
+	{
+	    push( @level_fields, { name => $seg, kind => "MIB_STRUCT", level => gen_level($child), hook => "MIB_NO_HOOK",
+				   first_emit => 0, n_emits => 0 } );
+	}
+    }
+
+    my ($seed, $table) = perfect_hash( [ map { $_->{name} } @level_fields ] );
+    $levels[$level] = { path => $node->{path}, seed => $seed, first_field => scalar(@fields), n_fields => scalar(@level_fields),
+			first_slot => scalar(@slots), slot_mask => scalar(@$table) - 1 };
+    push( @slots, map { $_ ? $_ + scalar(@fields) : 0 } @$table );
+    push( @fields, @level_fields );
+
+    return $level;
+}
+
+sub c_string
+{
+    my ($s) = @_;
+    $s =~ s/(["\\])/\\$1/g;
+    return "\"$s\"";
+}
+
+sub gen_cpp
+{
+    my ($ods) = @_;
+    my $cpp_src = <<EOH;
+/* generated by mib2extractors.pl from $ods - do not edit */
+
+#include "watch/asn1.h"
+#include "watch/mib.h"
+
+enum MibLevelId
+{
+EOH
+
+    $cpp_src .= "    $_->[0] = $_->[1],\n" for @level_enums;
+    $cpp_src .= "    MIB_LEVEL_COUNT = " . scalar(@levels) . "\n};\n\nenum MibHookId\n{\n";
+    $cpp_src .= "    $_,\n" for @hooks;
+    $cpp_src .= "    MIB_HOOK_COUNT\n};\n\nstatic MibEmit const mib_emits[] =\n{\n";
+    for my $e (@emits)
+    {
+	my @arcs = grep { $_ ne "" } split( /\./, $e->[2] );
+	@arcs <= 8 or die "$e->[3]: more than MIB_MAX_ARCS arcs";
+	$cpp_src .= sprintf( "    { %s, %s, %d, { %s } }, /* %s */\n", $e->[0], $e->[1], scalar(@arcs), join( ", ", @arcs ), $e->[3] );
+    }
+    @emits or $cpp_src .= "    { MIB_STR, ASN_NULL, 0, { 0 } }\n";
+    $cpp_src .= "};\n\nstatic MibField const mib_fields[] =\n{\n";
+    for my $f (@fields)
+    {
+	$cpp_src .= sprintf( "    { %s, %s, %s, %s, %d, %d },\n", c_string($f->{name}), $f->{kind}, $f->{level}, $f->{hook},
+			     $f->{first_emit}, $f->{n_emits} );
+    }
+    $cpp_src .= "};\n\nstatic unsigned short const mib_slots[] =\n{\n";
+    for( my $i = 0; $i < @slots; $i += 16 )
+    {
+	my $last = $i + 15 < $#slots ? $i + 15 : $#slots;
+	$cpp_src .= "    " . join( ", ", @slots[$i .. $last] ) . ",\n";
+    }
+    $cpp_src .= "};\n\nstatic MibLevel const mib_levels[] =\n{\n";
+    for my $l (@levels)
+    {
+	$cpp_src .= sprintf( "    { %s, %uU, %d, %d, %d, %d },\n", c_string($l->{path}), $l->{seed}, $l->{first_field}, $l->{n_fields},
+			     $l->{first_slot}, $l->{slot_mask} );
+    }
+    $cpp_src .= "};\n";
+
+    return $cpp_src;
+}
+
+my %opts;
+GetOptions( \%opts, "ods=s" ) or die "Cannot parse options";
+
+$opts{"ods"} or die "Missing --ods";
+-r $opts{"ods"} or die "Can't read '" . $opts{"ods"} . "': $!";
+
+my ($trees, $commands) = build_trees( read_mib( $opts{"ods"} ) );
+gen_level( $trees->{$_} ) for @$commands;
+
+print gen_cpp( $opts{"ods"} );
@@ -0,0 +1,440 @@
+#ifndef __AGENTX_H_INCLUDED__
+#define __AGENTX_H_INCLUDED__
+
+/*
+ * AgentX (RFC 2741) PDUs as far as mongodb-stats --agentx and the master
+ * agent stand-in need them: the header, object identifiers, octet
+ * strings and integers of the payload. PDUs are written in network byte
+ * order with NETWORK_BYTE_ORDER set, read in the order their flags say.
+ *
+ * Only this header is needed, it does not depend on the mongo driver.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define AGENTX_VERSION 1
+#define AGENTX_HEADER_SIZE 20
+#define AGENTX_MAX_SUBIDS 128
+#define AGENTX_MAX_PAYLOAD (1024 * 1024)
+#define AGENTX_DEFAULT_SOCKET "/var/agentx/master"
+
+enum AgentXPduType
+{
+    AGENTX_OPEN_PDU = 1,
+    AGENTX_CLOSE_PDU,
+    AGENTX_REGISTER_PDU,
+    AGENTX_UNREGISTER_PDU,
+    AGENTX_GET_PDU,
+    AGENTX_GETNEXT_PDU,
+    AGENTX_GETBULK_PDU,
+    AGENTX_TESTSET_PDU,
+    AGENTX_COMMITSET_PDU,
+    AGENTX_UNDOSET_PDU,
+    AGENTX_CLEANUPSET_PDU,
+    AGENTX_NOTIFY_PDU,
+    AGENTX_PING_PDU,
+    AGENTX_INDEXALLOCATE_PDU,
+    AGENTX_INDEXDEALLOCATE_PDU,
+    AGENTX_ADDAGENTCAPS_PDU,
+    AGENTX_REMOVEAGENTCAPS_PDU,
+    AGENTX_RESPONSE_PDU
+};
+
+enum AgentXFlags
+{
+    AGENTX_INSTANCE_REGISTRATION = 0x01,
+    AGENTX_NEW_INDEX = 0x02,
+    AGENTX_ANY_INDEX = 0x04,
+    AGENTX_NON_DEFAULT_CONTEXT = 0x08,
+    AGENTX_NETWORK_BYTE_ORDER = 0x10
+};
+
+enum AgentXVarBindType
+{
+    AGENTX_INTEGER = 2,
+    AGENTX_OCTET_STRING = 4,
+    AGENTX_NULL = 5,
+    AGENTX_OBJECT_IDENTIFIER = 6,
+    AGENTX_IPADDRESS = 64,
+    AGENTX_COUNTER32 = 65,
+    AGENTX_GAUGE32 = 66,
+    AGENTX_TIMETICKS = 67,
+    AGENTX_OPAQUE = 68,
+    AGENTX_COUNTER64 = 70,
+    AGENTX_NOSUCHOBJECT = 128,
+    AGENTX_NOSUCHINSTANCE = 129,
+    AGENTX_ENDOFMIBVIEW = 130
+};
+
+enum AgentXError
+{
+    AGENTX_NOERROR = 0,
+    AGENTX_GENERR = 5,
+    AGENTX_NOTWRITABLE = 17,
+    AGENTX_OPENFAILED = 256,
+    AGENTX_NOTOPEN = 257,
+    AGENTX_UNSUPPORTEDCONTEXT = 262,
+    AGENTX_DUPLICATEREGISTRATION = 263,
+    AGENTX_PARSEERROR = 266,
+    AGENTX_REQUESTDENIED = 267,
+    AGENTX_PROCESSINGERROR = 268
+};
+
+enum AgentXCloseReason
+{
+    AGENTX_REASON_OTHER = 1,
+    AGENTX_REASON_PARSEERROR,
+    AGENTX_REASON_PROTOCOLERROR,
+    AGENTX_REASON_TIMEOUTS,
+    AGENTX_REASON_SHUTDOWN,
+    AGENTX_REASON_BYMANAGER
+};
+
+/* full object identifier, include is the flag of a search range start */
+struct AgentXOid
+{
+    AgentXOid()
+	: n_subid(0)
+	, include(false)
+    {}
+
+    unsigned subids[AGENTX_MAX_SUBIDS];
+    unsigned n_subid;
+    bool include;
+};
+
+/* dotted OID, "." or "" is the null OID */
+inline AgentXOid
+agentx_parse_oid(std::string const &dotted)
+{
+    AgentXOid oid;
+    char const *p = dotted.c_str();
+    if( "." == dotted )
+	return oid;
+
+    while( '.' == *p )
+    {
+	char *end;
+	unsigned long subid = strtoul( ++p, &end, 10 );
+	if( ( end == p ) || ( oid.n_subid >= AGENTX_MAX_SUBIDS ) )
+	    throw std::invalid_argument( "malformed oid: " + dotted );
+	oid.subids[oid.n_subid++] = subid;
+	p = end;
+    }
+
+    if( *p )
+	throw std::invalid_argument( "malformed oid: " + dotted );
+
+    return oid;
+}
+
+inline std::string
+agentx_oid_str(AgentXOid const &oid)
+{
+    std::string s;
+    for( unsigned i = 0; i < oid.n_subid; ++i )
+    {
+	char buf[12];
+	s.append( buf, snprintf( buf, sizeof(buf), ".%u", oid.subids[i] ) );
+    }
+    return s;
+}
+
+/* SNMP lexicographic order */
+inline int
+agentx_compare(AgentXOid const &a, AgentXOid const &b)
+{
+    for( unsigned i = 0; ( i < a.n_subid ) && ( i < b.n_subid ); ++i )
+    {
+	if( a.subids[i] != b.subids[i] )
+	    return a.subids[i] < b.subids[i] ? -1 : 1;
+    }
+
+    return a.n_subid == b.n_subid ? 0 : ( a.n_subid < b.n_subid ? -1 : 1 );
+}
+
+struct AgentXHeader
+{
+    unsigned type;
+    unsigned flags;
+    uint32_t session_id;
+    uint32_t transaction_id;
+    uint32_t packet_id;
+    uint32_t payload_length;
+};
+
+/* builds one PDU, begin() starts the next one in the same buffer */
+class AgentXPduWriter
+{
+public:
+    AgentXPduWriter()
+	: m_buf()
+    {}
+
+    void begin(unsigned type, unsigned flags, uint32_t session_id, uint32_t transaction_id, uint32_t packet_id)
+    {
+	m_buf.clear();
+	put_u8(AGENTX_VERSION);
+	put_u8(type);
+	put_u8( flags | AGENTX_NETWORK_BYTE_ORDER );
+	put_u8(0);
+	put_u32(session_id);
+	put_u32(transaction_id);
+	put_u32(packet_id);
+	put_u32(0);             // payload length, see end()
+    }
+
+    void put_u8(unsigned v)
+    {
+	m_buf += static_cast<char>( v & 0xFF );
+    }
+
+    void put_u16(unsigned v)
+    {
+	put_u8( v >> 8 );
+	put_u8(v);
+    }
+
+    void put_u32(uint32_t v)
+    {
+	put_u16( v >> 16 );
+	put_u16(v);
+    }
+
+    void put_u64(uint64_t v)
+    {
+	put_u32( static_cast<uint32_t>( v >> 32 ) );
+	put_u32( static_cast<uint32_t>(v) );
+    }
+
+    /* 1.3.6.1.X goes out as prefix X */
+    void put_oid(AgentXOid const &oid)
+    {
+	unsigned prefix = 0, skip = 0;
+	if( ( oid.n_subid > 5 ) && ( 1 == oid.subids[0] ) && ( 3 == oid.subids[1] ) && ( 6 == oid.subids[2] ) &&
+	    ( 1 == oid.subids[3] ) && ( oid.subids[4] > 0 ) && ( oid.subids[4] < 256 ) )
+	{
+	    prefix = oid.subids[4];
+	    skip = 5;
+	}
+
+	put_u8( oid.n_subid - skip );
+	put_u8(prefix);
+	put_u8( oid.include ? 1 : 0 );
+	put_u8(0);
+	for( unsigned i = skip; i < oid.n_subid; ++i )
+	    put_u32( oid.subids[i] );
+    }
+
+    void put_octets(char const *p, size_t len)
+    {
+	put_u32(len);
+	m_buf.append( p, len );
+	m_buf.append( ( 4 - len % 4 ) % 4, '\0' );
+    }
+
+    void put_varbind_header(unsigned type, AgentXOid const &name)
+    {
+	put_u16(type);
+	put_u16(0);
+	put_oid(name);
+    }
+
+    /* the PDU with its payload length filled in */
+    std::string const & end()
+    {
+	uint32_t const len = m_buf.size() - AGENTX_HEADER_SIZE;
+	for( unsigned i = 0; i < 4; ++i )
+	    m_buf[16 + i] = static_cast<char>( ( len >> ( ( 3 - i ) * 8 ) ) & 0xFF );
+	return m_buf;
+    }
+
+protected:
+    std::string m_buf;
+};
+
+/* reads a payload, every get fails once the payload is exhausted */
+class AgentXPduReader
+{
+public:
+    AgentXPduReader(char const *p, size_t len, unsigned flags)
+	: m_p(reinterpret_cast<unsigned char const *>(p))
+	, m_end(reinterpret_cast<unsigned char const *>(p) + len)
+	, m_network_order( 0 != ( flags & AGENTX_NETWORK_BYTE_ORDER ) )
+    {}
+
+    bool at_end() const { return m_p == m_end; }
+
+    bool get_u8(unsigned &v)
+    {
+	if( m_end - m_p < 1 )
+	    return false;
+	v = *m_p++;
+	return true;
+    }
+
+    bool get_u16(unsigned &v)
+    {
+	if( m_end - m_p < 2 )
+	    return false;
+	v = m_network_order ? ( m_p[0] << 8 ) | m_p[1] : ( m_p[1] << 8 ) | m_p[0];
+	m_p += 2;
+	return true;
+    }
+
+    bool get_u32(uint32_t &v)
+    {
+	if( m_end - m_p < 4 )
+	    return false;
+	v = 0;
+	for( unsigned i = 0; i < 4; ++i )
+	    v |= static_cast<uint32_t>( m_p[i] ) << ( ( m_network_order ? 3 - i : i ) * 8 );
+	m_p += 4;
+	return true;
+    }
+
+    bool get_u64(uint64_t &v)
+    {
+	uint32_t first, second;
+	if( !get_u32(first) || !get_u32(second) )
+	    return false;
+	v = m_network_order ? ( static_cast<uint64_t>(first) << 32 ) | second : ( static_cast<uint64_t>(second) << 32 ) | first;
+	return true;
+    }
+
+    bool get_oid(AgentXOid &oid)
+    {
+	unsigned n_subid, prefix, include, reserved;
+	if( !get_u8(n_subid) || !get_u8(prefix) || !get_u8(include) || !get_u8(reserved) )
+	    return false;
+	if( n_subid + ( prefix ? 5 : 0 ) > AGENTX_MAX_SUBIDS )
+	    return false;
+
+	oid.n_subid = 0;
+	oid.include = 0 != include;
+	if( prefix )
+	{
+	    unsigned const internet[] = { 1, 3, 6, 1 };
+	    std::copy( internet, internet + 4, oid.subids );
+	    oid.subids[4] = prefix;
+	    oid.n_subid = 5;
+	}
+
+	for( unsigned i = 0; i < n_subid; ++i )
+	{
+	    uint32_t subid;
+	    if( !get_u32(subid) )
+		return false;
+	    oid.subids[oid.n_subid++] = subid;
+	}
+
+	return true;
+    }
+
+    bool get_octets(std::string &s)
+    {
+	uint32_t len;
+	if( !get_u32(len) || ( len > static_cast<size_t>( m_end - m_p ) ) )
+	    return false;
+	s.assign( reinterpret_cast<char const *>(m_p), len );
+	size_t const padded = len + ( 4 - len % 4 ) % 4;
+	if( padded > static_cast<size_t>( m_end - m_p ) )
+	    return false;
+	m_p += padded;
+	return true;
+    }
+
+protected:
+    unsigned char const *m_p;
+    unsigned char const *m_end;
+    bool const m_network_order;
+};
+
+inline bool
+agentx_read_all(int fd, char *p, size_t left)
+{
+    while( left )
+    {
+	ssize_t n = read( fd, p, left );
+	if( n < 0 )
+	{
+	    if( EINTR == errno )
+		continue;
+	    return false;
+	}
+	if( 0 == n )
+	    return false;
+	p += n;
+	left -= n;
+    }
+
+    return true;
+}
+
+/* one PDU, false when the peer hung up or sent garbage */
+inline bool
+agentx_read_pdu(int fd, AgentXHeader &h, std::string &payload)
+{
+    char buf[AGENTX_HEADER_SIZE];
+    if( !agentx_read_all( fd, buf, sizeof(buf) ) || ( AGENTX_VERSION != static_cast<unsigned char>(buf[0]) ) )
+	return false;
+
+    h.type = static_cast<unsigned char>(buf[1]);
+    h.flags = static_cast<unsigned char>(buf[2]);
+    AgentXPduReader r( buf + 4, sizeof(buf) - 4, h.flags );
+    r.get_u32(h.session_id);
+    r.get_u32(h.transaction_id);
+    r.get_u32(h.packet_id);
+    r.get_u32(h.payload_length);
+    if( ( h.payload_length > AGENTX_MAX_PAYLOAD ) || ( h.payload_length % 4 ) )
+	return false;
+
+    payload.resize(h.payload_length);
+    return !h.payload_length || agentx_read_all( fd, &payload[0], payload.size() );
+}
+
+/* a peer gone away must not raise SIGPIPE */
+inline bool
+agentx_write_pdu(int fd, std::string const &pdu)
+{
+    char const *p = pdu.data();
+    size_t left = pdu.size();
+    while( left )
+    {
+	ssize_t n = send( fd, p, left, MSG_NOSIGNAL );
+	if( n < 0 )
+	{
+	    if( EINTR == errno )
+		continue;
+	    return false;
+	}
+	p += n;
+	left -= n;
+    }
+
+    return true;
+}
+
+inline bool
+agentx_socket_address(std::string const &path, struct sockaddr_un &addr)
+{
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    if( path.size() >= sizeof(addr.sun_path) )
+	return false;
+    memcpy( addr.sun_path, path.c_str(), path.size() + 1 );
+    return true;
+}
+
+#endif /*?__AGENTX_H_INCLUDED__*/
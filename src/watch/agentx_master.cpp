@@ -0,0 +1,373 @@
+/*
+ * Stand-in for an AgentX master agent (RFC 2741) to try mongodb-stats
+ * --agentx without snmpd: listens on a Unix socket, takes the session
+ * and registration of one subagent and sends it GET, GETNEXT and GETBULK
+ * requests, the varbinds are printed as rows like the JSON dump. Walks
+ * can be repeated to time the subagent.
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "agentx.h"
+
+using namespace std;
+using namespace boost::program_options;
+
+class MasterSession
+{
+public:
+    MasterSession(int fd)
+	: m_fd(fd)
+	, m_session_id(1)
+	, m_packet_id(0)
+	, m_subtree()
+	, m_out()
+	, m_payload()
+    {}
+
+    /* Open and Register of the subagent */
+    void accept_subagent()
+    {
+	AgentXHeader h;
+	if( !agentx_read_pdu( m_fd, h, m_payload ) || ( AGENTX_OPEN_PDU != h.type ) )
+	    throw runtime_error( "subagent sent no Open-PDU" );
+
+	AgentXPduReader open( m_payload.data(), m_payload.size(), h.flags );
+	unsigned timeout, reserved;
+	AgentXOid id;
+	string descr;
+	if( !open.get_u8(timeout) || !open.get_u8(reserved) || !open.get_u16(reserved) || !open.get_oid(id) || !open.get_octets(descr) )
+	    throw runtime_error( "malformed Open-PDU" );
+	respond(h, m_session_id);
+	cerr << "session " << m_session_id << " opened by '" << descr << "'" << endl;
+
+	if( !agentx_read_pdu( m_fd, h, m_payload ) || ( AGENTX_REGISTER_PDU != h.type ) || ( m_session_id != h.session_id ) )
+	    throw runtime_error( "subagent sent no Register-PDU" );
+
+	AgentXPduReader reg( m_payload.data(), m_payload.size(), h.flags );
+	unsigned priority, range_subid;
+	string context;
+	if( ( ( h.flags & AGENTX_NON_DEFAULT_CONTEXT ) && !reg.get_octets(context) ) ||
+	    !reg.get_u8(timeout) || !reg.get_u8(priority) || !reg.get_u8(range_subid) || !reg.get_u8(reserved) ||
+	    !reg.get_oid(m_subtree) )
+	    throw runtime_error( "malformed Register-PDU" );
+	respond(h, m_session_id);
+	cerr << "registered " << agentx_oid_str(m_subtree) << endl;
+    }
+
+    AgentXOid const & subtree() const { return m_subtree; }
+
+    void get(AgentXOid const &oid, vector<string> *rows)
+    {
+	vector< std::pair<AgentXOid, AgentXOid> > ranges( 1, std::make_pair( oid, AgentXOid() ) );
+	ranges[0].first.include = false;
+	request(AGENTX_GET_PDU, ranges, 0, 0, rows, 0);
+    }
+
+    void get_next(AgentXOid const &oid, vector<string> *rows)
+    {
+	vector< std::pair<AgentXOid, AgentXOid> > ranges( 1, std::make_pair( oid, AgentXOid() ) );
+	ranges[0].first.include = false;
+	request(AGENTX_GETNEXT_PDU, ranges, 0, 0, rows, 0);
+    }
+
+    /* everything below oid, by GETNEXT or GETBULK of bulk repetitions, returns the number of varbinds */
+    size_t walk(AgentXOid const &oid, unsigned bulk, vector<string> *rows)
+    {
+	vector< std::pair<AgentXOid, AgentXOid> > ranges( 1, std::make_pair( oid, AgentXOid() ) );
+	ranges[0].first.include = false;
+	size_t n = 0;
+	for(;;)
+	{
+	    AgentXOid last;
+	    size_t const got = request( bulk ? AGENTX_GETBULK_PDU : AGENTX_GETNEXT_PDU, ranges, 0, bulk, rows, &oid, &last );
+	    n += got;
+	    if( !got || ( bulk && ( got < bulk ) ) )
+		return n;
+	    ranges[0].first = last;
+	    ranges[0].first.include = false;
+	}
+    }
+
+    void close_session()
+    {
+	m_out.begin( AGENTX_CLOSE_PDU, 0, m_session_id, 0, ++m_packet_id );
+	m_out.put_u8(AGENTX_REASON_SHUTDOWN);
+	m_out.put_u8(0);
+	m_out.put_u16(0);
+	agentx_write_pdu( m_fd, m_out.end() );
+    }
+
+protected:
+    int m_fd;
+    uint32_t m_session_id;
+    uint32_t m_packet_id;
+    AgentXOid m_subtree;
+    AgentXPduWriter m_out;
+    string m_payload;
+
+    void respond(AgentXHeader const &h, uint32_t session_id)
+    {
+	m_out.begin( AGENTX_RESPONSE_PDU, 0, session_id, h.transaction_id, h.packet_id );
+	m_out.put_u32(0);
+	m_out.put_u16(AGENTX_NOERROR);
+	m_out.put_u16(0);
+	if( !agentx_write_pdu( m_fd, m_out.end() ) )
+	    throw runtime_error( string("can't write to subagent: ") + strerror(errno) );
+    }
+
+    /*
+     * sends one request and prints its varbinds to rows (if any), with
+     * below only those in or below it and not past an endOfMibView;
+     * returns the number of those varbinds, last is the last of them
+     */
+    size_t request(unsigned type, vector< std::pair<AgentXOid, AgentXOid> > const &ranges, unsigned non_repeaters, unsigned max_repetitions,
+		   vector<string> *rows, AgentXOid const *below, AgentXOid *last = 0)
+    {
+	uint32_t const packet_id = ++m_packet_id;
+	m_out.begin( type, 0, m_session_id, packet_id, packet_id );
+	if( AGENTX_GETBULK_PDU == type )
+	{
+	    m_out.put_u16(non_repeaters);
+	    m_out.put_u16(max_repetitions);
+	}
+	for( size_t i = 0; i < ranges.size(); ++i )
+	{
+	    m_out.put_oid( ranges[i].first );
+	    m_out.put_oid( ranges[i].second );
+	}
+	if( !agentx_write_pdu( m_fd, m_out.end() ) )
+	    throw runtime_error( string("can't write to subagent: ") + strerror(errno) );
+
+	AgentXHeader h;
+	if( !agentx_read_pdu( m_fd, h, m_payload ) )
+	    throw runtime_error( "subagent hung up" );
+	if( ( AGENTX_RESPONSE_PDU != h.type ) || ( m_packet_id != h.packet_id ) )
+	    throw runtime_error( "subagent sent no response" );
+
+	AgentXPduReader in( m_payload.data(), m_payload.size(), h.flags );
+	uint32_t sys_uptime;
+	unsigned error, index;
+	if( !in.get_u32(sys_uptime) || !in.get_u16(error) || !in.get_u16(index) )
+	    throw runtime_error( "malformed Response-PDU" );
+	if( AGENTX_NOERROR != error )
+	    throw runtime_error( "subagent answered error " + to_string(error) );
+
+	size_t n = 0;
+	while( !in.at_end() )
+	{
+	    AgentXOid name;
+	    string row;
+	    unsigned vb_type;
+	    if( !in.get_u16(vb_type) || !in.get_u16(index) || !in.get_oid(name) || !read_value(in, vb_type, row) )
+		throw runtime_error( "malformed VarBind" );
+
+	    if( below )
+	    {
+		bool const inside = ( name.n_subid >= below->n_subid ) &&
+		    std::equal( below->subids, below->subids + below->n_subid, name.subids );
+		if( ( AGENTX_ENDOFMIBVIEW == vb_type ) || !inside )
+		    break;
+	    }
+
+	    ++n;
+	    if( last )
+		*last = name;
+	    if( rows )
+		rows->push_back( "[ \"" + agentx_oid_str(name) + "\", " + to_string(vb_type) + ", " + row + " ]" );
+	}
+
+	return n;
+    }
+
+    static bool read_value(AgentXPduReader &in, unsigned type, string &row)
+    {
+	uint32_t u32;
+	uint64_t u64;
+	switch( type )
+	{
+	    case AGENTX_INTEGER:
+		if( !in.get_u32(u32) )
+		    return false;
+		row = to_string( static_cast<int32_t>(u32) );
+		return true;
+	    case AGENTX_COUNTER32:
+	    case AGENTX_GAUGE32:
+	    case AGENTX_TIMETICKS:
+		if( !in.get_u32(u32) )
+		    return false;
+		row = to_string(u32);
+		return true;
+	    case AGENTX_COUNTER64:
+		if( !in.get_u64(u64) )
+		    return false;
+		row = to_string(u64);
+		return true;
+	    case AGENTX_OCTET_STRING:
+		if( !in.get_octets(row) )
+		    return false;
+		row = "\"" + row + "\"";
+		return true;
+	    case AGENTX_NOSUCHOBJECT:
+		row = "noSuchObject";
+		return true;
+	    case AGENTX_NOSUCHINSTANCE:
+		row = "noSuchInstance";
+		return true;
+	    case AGENTX_ENDOFMIBVIEW:
+		row = "endOfMibView";
+		return true;
+	    case AGENTX_NULL:
+		row = "null";
+		return true;
+	}
+
+	return false;
+    }
+
+    template<class T>
+    static string to_string(T v)
+    {
+	ostringstream os;
+	os << v;
+	return os.str();
+    }
+
+private:
+    MasterSession();
+    MasterSession(MasterSession const &);
+    MasterSession & operator = (MasterSession const &);
+};
+
+void
+print(vector<string> &rows)
+{
+    for( vector<string>::const_iterator ci = rows.begin(); ci != rows.end(); ++ci )
+	cout << *ci << endl;
+    rows.clear();
+}
+
+int
+main(int argc, char *argv[])
+{
+    try
+    {
+	options_description desc("Allowed options");
+	desc.add_options()
+	    ("help", "produce help message")
+	    ("socket", value<string>()->default_value(AGENTX_DEFAULT_SOCKET), "Unix socket to listen on for the subagent")
+	    ("get", value< vector<string> >()->composing(), "GET of OID, repeat for several")
+	    ("getnext", value< vector<string> >()->composing(), "GETNEXT of OID, repeat for several")
+	    ("walk", value< vector<string> >()->composing(), "walk below OID (. for the registered subtree), repeat for several")
+	    ("bulk", value<unsigned>()->default_value(0), "walk by GETBULK of this many repetitions instead of GETNEXT")
+	    ("repeat", value<unsigned>()->default_value(1), "do the walks this many times, print the first and time all on stderr")
+	    ;
+	variables_map vm;
+	store( parse_command_line( argc, argv, desc ), vm );
+	notify(vm);
+
+	if( vm.count("help") )
+	{
+	    cout << desc << endl;
+	    return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	string const &path = vm["socket"].as<string>();
+	struct sockaddr_un addr;
+	int lfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( !agentx_socket_address( path, addr ) )
+	{
+	    cerr << "socket path too long: " << path << endl;
+	    return 255;
+	}
+	unlink( path.c_str() );
+	if( ( lfd < 0 ) ||
+	    ( 0 != ::bind( lfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr) ) ) ||
+	    ( 0 != listen( lfd, 1 ) ) )
+	{
+	    cerr << "can't listen on " << path << ": " << strerror(errno) << endl;
+	    return 255;
+	}
+
+	int fd;
+	while( ( fd = accept( lfd, 0, 0 ) ) < 0 )
+	{
+	    if( EINTR != errno )
+	    {
+		cerr << "accept failed: " << strerror(errno) << endl;
+		return 255;
+	    }
+	}
+	close(lfd);
+	unlink( path.c_str() );
+
+	MasterSession session(fd);
+	session.accept_subagent();
+	vector<string> rows;
+
+	if( vm.count("get") )
+	{
+	    vector<string> const &oids = vm["get"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = oids.begin(); ci != oids.end(); ++ci )
+		session.get( agentx_parse_oid(*ci), &rows );
+	    print(rows);
+	}
+
+	if( vm.count("getnext") )
+	{
+	    vector<string> const &oids = vm["getnext"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = oids.begin(); ci != oids.end(); ++ci )
+		session.get_next( agentx_parse_oid(*ci), &rows );
+	    print(rows);
+	}
+
+	if( vm.count("walk") )
+	{
+	    vector<string> const &oids = vm["walk"].as< vector<string> >();
+	    unsigned const bulk = vm["bulk"].as<unsigned>(), repeat = vm["repeat"].as<unsigned>();
+	    size_t varbinds = 0;
+
+	    boost::timer::cpu_timer dur;
+	    for( unsigned r = 0; r < repeat; ++r )
+	    {
+		for( vector<string>::const_iterator ci = oids.begin(); ci != oids.end(); ++ci )
+		{
+		    AgentXOid const oid = "." == *ci ? session.subtree() : agentx_parse_oid(*ci);
+		    varbinds += session.walk( oid, bulk, r ? 0 : &rows );
+		}
+		print(rows);
+	    }
+	    dur.stop();
+
+	    if( repeat > 1 )
+	    {
+		double const ms = dur.elapsed().wall / 1e6;
+		fprintf( stderr, "%zu varbinds in %.1f ms, %.2f us per varbind\n", varbinds, ms, varbinds ? ms * 1e3 / varbinds : 0.0 );
+	    }
+	}
+
+	session.close_session();
+	close(fd);
+    }
+    catch( std::exception &e )
+    {
+	cerr << e.what() << endl;
+	return 255;
+    }
+
+    return 0;
+}
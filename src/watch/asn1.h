@@ -11,6 +11,7 @@
 #define ASN_NULL         (0x05)
 #endif
 #define ASN_OBJECT_ID    (0x06)
+#define ASN_RELATIVE_OID (0x0D)
 #ifndef ASN_SEQUENCE
 #define ASN_SEQUENCE     (0x10)
 #endif
@@ -52,4 +53,8 @@
 #define SMI_COUNTER64       (ASN_APPLICATION | 6)
 #define SMI_UINTEGER        (ASN_APPLICATION | 7)
 
+#ifndef SNMP_NOSUCHINSTANCE
+#define SNMP_NOSUCHINSTANCE (ASN_CONTEXT | ASN_PRIMITIVE | 0x1)
+#endif
+
 #endif /*?__ASN1_H_INCLUDED__*/
@@ -0,0 +1,296 @@
+/*
+ * Offline benchmark of the extractor and dump pipeline of mongodb-stats.
+ * Command replies are synthesised from the generated MIB tables, so every
+ * field the extractors know is present, and run through the extractors
+ * and writers of watch_mongodb.cpp without a mongod.
+ */
+
+#define WATCH_MONGODB_NO_MAIN
+#include "watch/watch_mongodb.cpp"
+#include "watch/synthetic_replies.h"
+
+#include <iomanip>
+#include <new>
+#include <sys/resource.h>
+
+// every allocation of the process is counted, the benchmark is single threaded
+static unsigned long long bench_allocs = 0;
+
+// dynamic exception specifications are gone since C++17
+#if __cplusplus >= 201103L
+#define BENCH_NEW_THROW
+#define BENCH_DELETE_THROW noexcept
+#else
+#define BENCH_NEW_THROW throw(std::bad_alloc)
+#define BENCH_DELETE_THROW throw()
+#endif
+
+void *
+operator new(size_t size) BENCH_NEW_THROW
+{
+    ++bench_allocs;
+    void *p = malloc( size ? size : 1 );
+    if( !p )
+	throw std::bad_alloc();
+    return p;
+}
+
+void
+operator delete(void *p) BENCH_DELETE_THROW
+{
+    free(p);
+}
+
+/* what Poller::collect() does with the replies of one poll, in one thread */
+void
+extract_poll(SyntheticReplies const &replies, PollExtractors &extractors, OidValueBuffer &out_vals)
+{
+    out_vals.clear();
+    extractors.databases(out_vals.pin(replies.list_databases()), out_vals);
+
+    vector<string> database_names;
+    vector<unsigned> database_rows;
+    find_databases(out_vals, database_names, database_rows);
+
+    for( size_t i = 0; i < database_rows.size(); ++i )
+	extractors.dbstats(out_vals.pin(replies.dbstats(i)), database_rows[i], out_vals);
+    extractors.server_status(out_vals.pin(replies.server_status()), out_vals);
+    extractors.repl_set_status(out_vals.pin(replies.repl_set_get_status()), out_vals);
+
+    out_vals.index();
+}
+
+/*
+ * Runs one case until min_seconds passed, after a warm up run which
+ * assigns the table rows and sizes all buffers like an earlier poll.
+ */
+class BenchCase
+{
+public:
+    BenchCase(double min_seconds)
+	: m_min_seconds(min_seconds)
+    {}
+
+    virtual ~BenchCase() {}
+
+    void run(char const *name, unsigned n_databases)
+    {
+	step();
+
+	boost::timer::nanosecond_type const min_wall = static_cast<boost::timer::nanosecond_type>( m_min_seconds * 1e9 );
+	unsigned long long iterations = 0, values = 0;
+	unsigned long long const allocs_before = bench_allocs;
+	boost::timer::cpu_timer dur;
+	do
+	{
+	    values += step();
+	    ++iterations;
+	}
+	while( dur.elapsed().wall < min_wall );
+	dur.stop();
+
+	double const secs = dur.elapsed().wall / 1e9;
+	cout << setw(9) << n_databases << "  " << left << setw(16) << name << right
+	     << setw(10) << iterations
+	     << setw(14) << static_cast<unsigned long long>( secs * 1e9 / iterations )
+	     << setw(14) << static_cast<unsigned long long>( values / secs )
+	     << setw(12) << ( bench_allocs - allocs_before ) / iterations
+	     << endl;
+    }
+
+protected:
+    double const m_min_seconds;
+
+    /* one iteration, returns the number of values handled */
+    virtual size_t step() = 0;
+};
+
+struct ExtractPollCase
+    : public BenchCase
+{
+    ExtractPollCase(double min_seconds, SyntheticReplies const &replies)
+	: BenchCase(min_seconds)
+	, m_replies(replies)
+	, m_extractors()
+	, m_out_vals()
+    {}
+
+    virtual size_t step()
+    {
+	extract_poll(m_replies, m_extractors, m_out_vals);
+	return m_out_vals.size();
+    }
+
+    SyntheticReplies const &m_replies;
+    PollExtractors m_extractors;
+    OidValueBuffer m_out_vals;
+};
+
+struct ListDatabasesCase
+    : public ExtractPollCase
+{
+    ListDatabasesCase(double min_seconds, SyntheticReplies const &replies)
+	: ExtractPollCase(min_seconds, replies)
+    {}
+
+    virtual size_t step()
+    {
+	m_out_vals.clear();
+	m_extractors.databases(m_replies.list_databases(), m_out_vals);
+	return m_out_vals.size();
+    }
+};
+
+struct ServerStatusCase
+    : public ExtractPollCase
+{
+    ServerStatusCase(double min_seconds, SyntheticReplies const &replies)
+	: ExtractPollCase(min_seconds, replies)
+    {
+	// the locks of the databases are only extracted for known rows
+	extract_poll(m_replies, m_extractors, m_out_vals);
+    }
+
+    virtual size_t step()
+    {
+	m_out_vals.clear();
+	m_extractors.server_status(m_replies.server_status(), m_out_vals);
+	return m_out_vals.size();
+    }
+};
+
+/* TableRowExtractor::find_key over the extracted row of every database */
+struct FindKeyCase
+    : public BenchCase
+{
+    FindKeyCase(double min_seconds, vector<string> const &database_names)
+	: BenchCase(min_seconds)
+	, m_rows()
+	, m_extractor( ".21", m_rows, vector<Oid>(1, Oid(".1")) )
+	, m_embed_vals(database_names.size())
+    {
+	for( size_t i = 0; i < database_names.size(); ++i )
+	{
+	    m_embed_vals[i].append( OidValueTuple( ".1", ASN_OCTET_STR ).set_string( database_names[i] ) );
+	    m_embed_vals[i].append( OidValueTuple( ".2", SMI_COUNTER64 ).set_uint64( i ) );
+	    m_embed_vals[i].index();
+	}
+    }
+
+    virtual size_t step()
+    {
+	unsigned rows = 0;
+	for( vector<OidValueBuffer>::const_iterator ci = m_embed_vals.begin(); ci != m_embed_vals.end(); ++ci )
+	    rows += ( 0 != m_extractor.find_key(*ci) );
+	return rows;
+    }
+
+    TableRowIndex m_rows;
+    TableRowExtractor< MibLevelExtractor<MIB_LEVEL_LISTDATABASES_DATABASES_ROW> > m_extractor;
+    vector<OidValueBuffer> m_embed_vals;
+};
+
+struct DumpCase
+    : public BenchCase
+{
+    DumpCase(double min_seconds, OidValueBuffer const &out_vals, DumpWriter &writer)
+	: BenchCase(min_seconds)
+	, m_out_vals(out_vals)
+	, m_writer(writer)
+    {}
+
+    virtual size_t step()
+    {
+	m_writer.dump(m_out_vals);
+	return m_out_vals.size();
+    }
+
+    OidValueBuffer const &m_out_vals;
+    DumpWriter &m_writer;
+};
+
+long
+peak_rss_kb()
+{
+    struct rusage usage;
+    if( 0 != getrusage(RUSAGE_SELF, &usage) )
+	return -1;
+    return usage.ru_maxrss;
+}
+
+int
+main(int argc, char *argv[])
+{
+    try
+    {
+	options_description desc("Allowed options");
+	desc.add_options()
+	    ("help", "produce help message")
+	    ("databases", value< vector<unsigned> >()->multitoken(), "database counts to run (default: 10 100 1000 10000)")
+	    ("members", value<unsigned>()->default_value(3), "replica set members, the last one is an arbiter")
+	    ("unmapped", value<unsigned>()->default_value(4), "fields unknown to the MIB per document level")
+	    ("seconds", value<double>()->default_value(1.0), "minimum run time of each case")
+	    ;
+	variables_map vm;
+	store( parse_command_line( argc, argv, desc ), vm );
+	notify(vm);
+
+	if( vm.count("help") )
+	{
+	    cout << desc << endl;
+	    return 1;
+	}
+
+	vector<unsigned> database_counts;
+	if( vm.count("databases") )
+	    database_counts = vm["databases"].as< vector<unsigned> >();
+	else
+	{
+	    static unsigned const defaults[] = { 10, 100, 1000, 10000 };
+	    database_counts.assign( defaults, defaults + sizeof(defaults) / sizeof(defaults[0]) );
+	}
+
+	double const secs = vm["seconds"].as<double>();
+	int const null_fd = open("/dev/null", O_WRONLY);
+	if( null_fd < 0 )
+	{
+	    cerr << "can't open /dev/null: " << strerror(errno) << endl;
+	    return 255;
+	}
+
+	cout << "databases  case              iterations       ns/iter      values/s  allocs/iter" << endl;
+	for( vector<unsigned>::const_iterator ci = database_counts.begin(); ci != database_counts.end(); ++ci )
+	{
+	    SyntheticReplies replies( *ci, vm["members"].as<unsigned>(), vm["unmapped"].as<unsigned>() );
+
+	    ExtractPollCase( secs, replies ).run("extract poll", *ci);
+	    ListDatabasesCase( secs, replies ).run("listDatabases", *ci);
+	    ServerStatusCase( secs, replies ).run("serverStatus", *ci);
+	    FindKeyCase( secs, replies.database_names() ).run("find_key", *ci);
+
+	    PollExtractors extractors;
+	    OidValueBuffer out_vals;
+	    extract_poll(replies, extractors, out_vals);
+
+	    JsonDumpWriter json(null_fd);
+	    DumpCase( secs, out_vals, json ).run("dump json", *ci);
+	    BerDumpWriter ber(null_fd);
+	    DumpCase( secs, out_vals, ber ).run("dump ber", *ci);
+
+	    cout << setw(9) << *ci << "  peak RSS " << peak_rss_kb() << " kB" << endl;
+	}
+
+	close(null_fd);
+    }
+    catch( DBException &e )
+    {
+	cout << "caught " << e.what() << endl;
+    }
+    catch( std::exception &e )
+    {
+	cerr << e.what() << endl;
+	return 255;
+    }
+
+    return 0;
+}
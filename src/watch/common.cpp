@@ -6,15 +6,30 @@ using namespace mongo;
 
 void
 connect(DBClientConnection &c,
-        std::string const &dsn,
-	std::string const &dbname,
-	std::string const &user)
+        std::string const &dsn)
+{
+    c.connect(dsn);
+}
+
+void
+authenticate(DBClientConnection &c,
+	     std::string const &dbname,
+	     std::string const &user)
 {
     std::string pw = summarize( get_summarizers() );
 
     std::string errmsg;
-    c.connect(dsn);
     c.auth(dbname, user, pw, errmsg);
 }
 
+void
+connect(DBClientConnection &c,
+        std::string const &dsn,
+	std::string const &dbname,
+	std::string const &user)
+{
+    connect(c, dsn);
+    authenticate(c, dbname, user);
+}
+
 
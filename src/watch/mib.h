@@ -0,0 +1,83 @@
+#ifndef __MIB_H_INCLUDED__
+#define __MIB_H_INCLUDED__
+
+/*
+ * Layout of the extractor table generated from mib.ods by
+ * script/mib2extractors.pl (see mongo_mib.cpp after a build).
+ *
+ * Every struct level of a command reply is a MibLevel. Its fields are
+ * found with a collision free hash of the BSON field name: the slot
+ * mib_hash(seed, name) & slot_mask holds the field index + 1, or 0 when
+ * no field hashes there. Fields either emit values (MIB_ITEM), descend
+ * into another level (MIB_STRUCT) or are handed to a hand written
+ * extractor bound to their hook (MIB_TABLE: arrays and maps keyed by
+ * database name, which become table rows).
+ *
+ * OIDs of values inside a table entry are relative to the entry (e.g.
+ * .2 for .20.7.1.2), the table extractor adds prefix and row.
+ */
+
+#define MIB_MAX_ARCS 8
+#define MIB_NO_LEVEL 0xFFFF
+#define MIB_NO_HOOK  0xFFFF
+
+enum MibKind
+{
+    MIB_ITEM,
+    MIB_STRUCT,
+    MIB_TABLE
+};
+
+enum MibValue
+{
+    MIB_STR,
+    MIB_INT,
+    MIB_UINT,
+    MIB_UINT64,
+    MIB_DOUBLE
+};
+
+struct MibEmit
+{
+    unsigned char value;        /* MibValue, selects the conversion */
+    unsigned char asn_type;     /* ASN.1/SMI type of the MIB */
+    unsigned char n_arcs;
+    unsigned arcs[MIB_MAX_ARCS];
+};
+
+struct MibField
+{
+    char const *name;
+    unsigned char kind;         /* MibKind */
+    unsigned short level;       /* MIB_STRUCT: level of the sub document */
+    unsigned short hook;        /* MIB_TABLE: index of the bound extractor */
+    unsigned short first_emit;  /* MIB_ITEM: range in mib_emits */
+    unsigned short n_emits;
+};
+
+struct MibLevel
+{
+    char const *path;           /* command:path of the level, for diagnostics */
+    unsigned seed;
+    unsigned short first_field;
+    unsigned short n_fields;
+    unsigned first_slot;
+    unsigned slot_mask;
+};
+
+/* FNV-1a over the NUL terminated name, seeded per level */
+inline unsigned
+mib_hash(unsigned seed, char const *name)
+{
+    unsigned h = 2166136261U ^ seed;
+
+    while( *name )
+    {
+	h ^= static_cast<unsigned char>(*name++);
+	h *= 16777619U;
+    }
+
+    return h;
+}
+
+#endif /*?__MIB_H_INCLUDED__*/
@@ -0,0 +1,197 @@
+/*
+ * Reads the shared memory snapshot of mongodb-stats --daemon --shm: GET
+ * and GETNEXT of single OIDs and walks of subtrees, printed as rows like
+ * the JSON dump.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "asn1.h"
+#include "shm_snapshot.h"
+
+using namespace std;
+using namespace boost::program_options;
+
+/* dotted OID, "." is the root */
+unsigned
+parse_oid(string const &dotted, unsigned *arcs)
+{
+    unsigned n = 0;
+    char const *p = dotted.c_str();
+    if( "." == dotted )
+	return 0;
+
+    while( '.' == *p )
+    {
+	char *end;
+	unsigned long arc = strtoul( ++p, &end, 10 );
+	if( ( end == p ) || ( n >= SHM_MAX_ARCS ) )
+	    throw invalid_argument( "malformed oid: " + dotted );
+	arcs[n++] = arc;
+	p = end;
+    }
+
+    if( *p )
+	throw invalid_argument( "malformed oid: " + dotted );
+
+    return n;
+}
+
+void
+print_value(ShmValue const &value)
+{
+    cout << "[ \"";
+    for( unsigned i = 0; i < value.n_arcs; ++i )
+	cout << "." << value.arcs[i];
+    cout << "\", " << value.type << ", ";
+
+    bool const quote = ASN_OCTET_STR == value.type;
+    switch( value.kind )
+    {
+	case SHM_VAL_INT:
+	    cout << ( quote ? "\"" : "" ) << value.i << ( quote ? "\"" : "" );
+	    break;
+	case SHM_VAL_UINT:
+	case SHM_VAL_UINT64:
+	    cout << ( quote ? "\"" : "" ) << value.u64 << ( quote ? "\"" : "" );
+	    break;
+	case SHM_VAL_DOUBLE:
+	{
+	    char buf[32];
+	    snprintf( buf, sizeof(buf), "%.17g", value.d );
+	    cout << ( quote ? "\"" : "" ) << buf << ( quote ? "\"" : "" );
+	    break;
+	}
+	case SHM_VAL_STRING:
+	    cout << ( quote ? "\"" : "" ) << value.str << ( quote ? "\"" : "" );
+	    break;
+	default:
+	    cout << "null";
+	    break;
+    }
+
+    cout << " ]" << endl;
+}
+
+bool
+below(ShmValue const &value, unsigned const *arcs, unsigned n_arcs)
+{
+    if( value.n_arcs < n_arcs )
+	return false;
+
+    for( unsigned i = 0; i < n_arcs; ++i )
+    {
+	if( value.arcs[i] != arcs[i] )
+	    return false;
+    }
+
+    return true;
+}
+
+int
+main(int argc, char *argv[])
+{
+    try
+    {
+	options_description desc("Allowed options");
+	desc.add_options()
+	    ("help", "produce help message")
+	    ("file", value<string>(), "snapshot file of mongodb-stats --shm")
+	    ("get", value< vector<string> >()->composing(), "print the value of OID, repeat for several")
+	    ("getnext", value< vector<string> >()->composing(), "print the value following OID, repeat for several")
+	    ("walk", value< vector<string> >()->composing(), "print all values below OID (. for all), repeat for several")
+	    ("generation", "print the generation of the snapshot")
+	    ;
+	variables_map vm;
+	store( parse_command_line( argc, argv, desc ), vm );
+	notify(vm);
+
+	if( vm.count("help") )
+	{
+	    cout << desc << endl;
+	    return 1;
+	}
+
+	if( !vm.count("file") )
+	{
+	    cerr << desc << endl;
+	    return 255;
+	}
+
+	ShmSnapshotReader reader( vm["file"].as<string>() );
+	unsigned arcs[SHM_MAX_ARCS];
+	ShmValue value;
+	int rc = 0;
+
+	if( vm.count("generation") )
+	    cout << reader.generation() << endl;
+
+	if( vm.count("get") )
+	{
+	    vector<string> const &oids = vm["get"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = oids.begin(); ci != oids.end(); ++ci )
+	    {
+		if( reader.get( arcs, parse_oid(*ci, arcs), value ) )
+		    print_value(value);
+		else
+		{
+		    cerr << *ci << ": no such instance" << endl;
+		    rc = 1;
+		}
+	    }
+	}
+
+	if( vm.count("getnext") )
+	{
+	    vector<string> const &oids = vm["getnext"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = oids.begin(); ci != oids.end(); ++ci )
+	    {
+		if( reader.get_next( arcs, parse_oid(*ci, arcs), value ) )
+		    print_value(value);
+		else
+		{
+		    cerr << *ci << ": end of snapshot" << endl;
+		    rc = 1;
+		}
+	    }
+	}
+
+	if( vm.count("walk") )
+	{
+	    vector<string> const &oids = vm["walk"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = oids.begin(); ci != oids.end(); ++ci )
+	    {
+		unsigned const n_arcs = parse_oid(*ci, arcs);
+		if( n_arcs && reader.get( arcs, n_arcs, value ) )
+		    print_value(value);
+
+		unsigned next[SHM_MAX_ARCS];
+		std::copy( arcs, arcs + n_arcs, next );
+		unsigned n_next = n_arcs;
+
+		// every step is a GETNEXT of its own, like an agent walking
+		while( reader.get_next( next, n_next, value ) && below( value, arcs, n_arcs ) )
+		{
+		    print_value(value);
+		    std::copy( value.arcs, value.arcs + value.n_arcs, next );
+		    n_next = value.n_arcs;
+		}
+	    }
+	}
+
+	return rc;
+    }
+    catch( std::exception &e )
+    {
+	cerr << e.what() << endl;
+	return 255;
+    }
+}
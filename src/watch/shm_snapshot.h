@@ -0,0 +1,354 @@
+#ifndef __SHM_SNAPSHOT_H_INCLUDED__
+#define __SHM_SNAPSHOT_H_INCLUDED__
+
+/*
+ * Layout of the snapshot file mongodb-stats --daemon --shm publishes
+ * every poll into, and a reader for it. The file is mapped by writer and
+ * readers; it holds two slots, each a complete snapshot:
+ *
+ *   ShmSnapshotHeader
+ *   slot: ShmSlotHeader, ShmEntry[n_entries] ordered by OID,
+ *         the OID arcs (uint32_t[n_arcs]), the strings (data_size bytes)
+ *
+ * The writer fills the slot readers are not sent to and then points
+ * current at it. Each slot is guarded by a sequence lock: seq is odd
+ * while the slot is written, a reader which saw seq change while it read
+ * reads again. A reader thus looks values up with a binary search right
+ * in the mapping, without a system call or lock. Integers are native, a
+ * reader runs on the host of the writer.
+ *
+ * Only this header is needed to read the file, it does not depend on the
+ * mongo driver.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_SNAPSHOT_MAGIC "mgostat"
+#define SHM_SNAPSHOT_VERSION 1
+#define SHM_MAX_ARCS 32
+#define SHM_ALIGN 64
+
+enum ShmValueKind
+{
+    SHM_VAL_NONE,               /* no value, e.g. ASN_NULL */
+    SHM_VAL_INT,
+    SHM_VAL_UINT,
+    SHM_VAL_UINT64,
+    SHM_VAL_DOUBLE,             /* goes out as text (ASN_OCTET_STR) */
+    SHM_VAL_STRING
+};
+
+struct ShmSlotRef
+{
+    uint64_t seq;               /* odd while the slot is written */
+    uint64_t offset;            /* of the ShmSlotHeader in the file */
+    uint64_t size;              /* capacity of the slot */
+};
+
+struct ShmSnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t current;           /* slot holding the latest snapshot */
+    ShmSlotRef slots[2];
+};
+
+struct ShmSlotHeader
+{
+    uint64_t generation;        /* 0: nothing published yet */
+    uint32_t n_entries;
+    uint32_t n_arcs;
+    uint64_t data_size;
+};
+
+struct ShmEntry
+{
+    uint32_t first_arc;         /* index into the arcs of the slot */
+    uint8_t n_arcs;
+    uint8_t type;               /* ASN.1/SMI type */
+    uint8_t kind;               /* ShmValueKind */
+    uint8_t pad;
+    uint32_t len;               /* SHM_VAL_STRING: bytes at offset in the strings */
+    uint32_t pad2;
+    uint64_t value;             /* number (a double's bits) or string offset */
+};
+
+/* full barrier, orders the accesses of the sequence lock */
+inline void
+shm_barrier()
+{
+    __sync_synchronize();
+}
+
+inline uint64_t
+shm_load(uint64_t const volatile &v)
+{
+    uint64_t r = v;
+    shm_barrier();
+    return r;
+}
+
+/* a value read from the snapshot, copied out of the mapping */
+struct ShmValue
+{
+    ShmValue()
+	: n_arcs(0)
+	, type(0)
+	, kind(SHM_VAL_NONE)
+	, i(0)
+	, u64(0)
+	, d(0)
+	, str()
+    {}
+
+    unsigned arcs[SHM_MAX_ARCS];
+    unsigned n_arcs;
+    unsigned type;
+    unsigned kind;
+    long long i;                /* SHM_VAL_INT */
+    unsigned long long u64;     /* SHM_VAL_UINT, SHM_VAL_UINT64 */
+    double d;                   /* SHM_VAL_DOUBLE */
+    std::string str;            /* SHM_VAL_STRING */
+};
+
+class ShmSnapshotReader
+{
+public:
+    ShmSnapshotReader(std::string const &path)
+	: m_path(path)
+	, m_fd(-1)
+	, m_map(0)
+	, m_size(0)
+	, m_ino(0)
+    {
+	m_fd = open( path.c_str(), O_RDONLY );
+	if( m_fd < 0 )
+	    throw std::runtime_error( "can't open snapshot '" + path + "'" );
+
+	if( !remap() )
+	{
+	    close(m_fd);
+	    throw std::runtime_error( "can't map snapshot '" + path + "'" );
+	}
+
+	ShmSnapshotHeader const *hdr = header();
+	if( ( 0 != memcmp( hdr->magic, SHM_SNAPSHOT_MAGIC, sizeof(hdr->magic) ) ) || ( SHM_SNAPSHOT_VERSION != hdr->version ) )
+	{
+	    unmap();
+	    close(m_fd);
+	    throw std::runtime_error( "'" + path + "' is no snapshot" );
+	}
+    }
+
+    ~ShmSnapshotReader()
+    {
+	unmap();
+	close(m_fd);
+    }
+
+    /* value of an OID, false if there is none */
+    bool get(unsigned const *arcs, unsigned n_arcs, ShmValue &value)
+    {
+	return read(arcs, n_arcs, false, value);
+    }
+
+    /* first value after an OID, false at the end */
+    bool get_next(unsigned const *arcs, unsigned n_arcs, ShmValue &value)
+    {
+	return read(arcs, n_arcs, true, value);
+    }
+
+    /* of the latest snapshot, 0 before the first one */
+    unsigned long long generation()
+    {
+	for(;;)
+	{
+	    ShmSlotRef const volatile *ref;
+	    uint64_t seq, offset, size;
+	    if( !lock_slot(ref, seq, offset, size) )
+		return 0;
+
+	    uint64_t const generation = reinterpret_cast<ShmSlotHeader const volatile *>( m_map + offset )->generation;
+	    shm_barrier();
+	    if( ref->seq == seq )
+		return generation;
+	}
+    }
+
+    /* whether the writer restarted and put a new file in place, costs a stat(2) */
+    bool replaced() const
+    {
+	struct stat st;
+	return ( 0 != stat( m_path.c_str(), &st ) ) || ( st.st_ino != m_ino );
+    }
+
+protected:
+    std::string const m_path;
+    int m_fd;
+    char const *m_map;
+    size_t m_size;
+    ino_t m_ino;
+
+    ShmSnapshotHeader const * header() const
+    {
+	return reinterpret_cast<ShmSnapshotHeader const *>(m_map);
+    }
+
+    /* the file grows when a snapshot outgrows its slot */
+    bool remap()
+    {
+	struct stat st;
+	if( ( 0 != fstat( m_fd, &st ) ) || ( static_cast<size_t>(st.st_size) < sizeof(ShmSnapshotHeader) ) )
+	    return false;
+
+	void *map = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, m_fd, 0 );
+	if( MAP_FAILED == map )
+	    return false;
+
+	unmap();
+	m_map = static_cast<char const *>(map);
+	m_size = st.st_size;
+	m_ino = st.st_ino;
+	return true;
+    }
+
+    void unmap()
+    {
+	if( m_map )
+	    munmap( const_cast<char *>(m_map), m_size );
+	m_map = 0;
+	m_size = 0;
+    }
+
+    /* the current slot with an even sequence number and where it is, inside the mapping */
+    bool lock_slot(ShmSlotRef const volatile *&ref, uint64_t &seq, uint64_t &offset, uint64_t &size)
+    {
+	for(;;)
+	{
+	    ShmSnapshotHeader const volatile *hdr = reinterpret_cast<ShmSnapshotHeader const volatile *>(m_map);
+	    ref = &hdr->slots[hdr->current & 1];
+	    seq = shm_load(ref->seq);
+	    if( seq & 1 )
+		continue;
+
+	    offset = ref->offset;
+	    size = ref->size;
+	    if( ( offset <= m_size ) && ( size <= m_size - offset ) && ( size >= sizeof(ShmSlotHeader) ) )
+		return true;
+
+	    // a slot is moved to the end of a grown file with its sequence lock held
+	    shm_barrier();
+	    if( ref->seq != seq )
+		continue;
+	    size_t const mapped = m_size;
+	    if( !remap() || ( m_size <= mapped ) )
+		return false;
+	}
+    }
+
+    bool read(unsigned const *arcs, unsigned n_arcs, bool next, ShmValue &value)
+    {
+	for(;;)
+	{
+	    ShmSlotRef const volatile *ref;
+	    uint64_t seq, offset, size;
+	    if( !lock_slot(ref, seq, offset, size) )
+		return false;
+
+	    bool const found = lookup( m_map + offset, size, arcs, n_arcs, next, value );
+	    shm_barrier();
+	    if( ref->seq == seq )
+		return found;
+	}
+    }
+
+    /* everything read is checked against the slot, a torn read must not go astray */
+    static bool lookup(char const *slot, uint64_t size, unsigned const *arcs, unsigned n_arcs, bool next, ShmValue &value)
+    {
+	ShmSlotHeader const *sh = reinterpret_cast<ShmSlotHeader const *>(slot);
+	uint64_t const n_entries = sh->n_entries, n_all_arcs = sh->n_arcs, data_size = sh->data_size;
+	uint64_t const arcs_ofs = sizeof(ShmSlotHeader) + n_entries * sizeof(ShmEntry);
+	uint64_t const data_ofs = arcs_ofs + n_all_arcs * sizeof(uint32_t);
+	if( data_ofs + data_size > size )
+	    return false;
+
+	ShmEntry const *entries = reinterpret_cast<ShmEntry const *>( slot + sizeof(ShmSlotHeader) );
+	uint32_t const *all_arcs = reinterpret_cast<uint32_t const *>( slot + arcs_ofs );
+
+	// first entry not below the OID, with next the first one above it
+	size_t lo = 0, hi = n_entries;
+	while( lo < hi )
+	{
+	    size_t const mid = lo + ( hi - lo ) / 2;
+	    ShmEntry const &e = entries[mid];
+	    if( e.first_arc + static_cast<uint64_t>(e.n_arcs) > n_all_arcs )
+		return false;
+
+	    int const cmp = compare( all_arcs + e.first_arc, e.n_arcs, arcs, n_arcs );
+	    if( ( cmp < 0 ) || ( next && ( 0 == cmp ) ) )
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	if( lo == n_entries )
+	    return false;
+
+	ShmEntry const &e = entries[lo];
+	if( ( e.first_arc + static_cast<uint64_t>(e.n_arcs) > n_all_arcs ) || ( e.n_arcs > SHM_MAX_ARCS ) )
+	    return false;
+	if( !next && ( 0 != compare( all_arcs + e.first_arc, e.n_arcs, arcs, n_arcs ) ) )
+	    return false;
+
+	std::copy( all_arcs + e.first_arc, all_arcs + e.first_arc + e.n_arcs, value.arcs );
+	value.n_arcs = e.n_arcs;
+	value.type = e.type;
+	value.kind = e.kind;
+	switch( e.kind )
+	{
+	    case SHM_VAL_INT:
+		value.i = static_cast<int64_t>(e.value);
+		break;
+	    case SHM_VAL_UINT:
+	    case SHM_VAL_UINT64:
+		value.u64 = e.value;
+		break;
+	    case SHM_VAL_DOUBLE:
+		memcpy( &value.d, &e.value, sizeof(value.d) );
+		break;
+	    case SHM_VAL_STRING:
+		if( e.value + e.len > data_size )
+		    return false;
+		value.str.assign( slot + data_ofs + e.value, e.len );
+		break;
+	}
+
+	return true;
+    }
+
+    static int compare(uint32_t const *a, unsigned n_a, unsigned const *b, unsigned n_b)
+    {
+	for( unsigned i = 0; ( i < n_a ) && ( i < n_b ); ++i )
+	{
+	    if( a[i] != b[i] )
+		return a[i] < b[i] ? -1 : 1;
+	}
+
+	return n_a == n_b ? 0 : ( n_a < n_b ? -1 : 1 );
+    }
+
+private:
+    ShmSnapshotReader();
+    ShmSnapshotReader(ShmSnapshotReader const &);
+    ShmSnapshotReader & operator = (ShmSnapshotReader const &);
+};
+
+#endif /*?__SHM_SNAPSHOT_H_INCLUDED__*/
@@ -0,0 +1,302 @@
+/*
+ * Stand-in for mongod, speaking just enough of the wire protocol for
+ * mongodb-stats: commands sent as OP_QUERY on <db>.$cmd are answered by
+ * OP_REPLY. The replies come from a capture made by mongodb-stats
+ * --record or are synthesised for a number of databases, and each
+ * command can be delayed to play a loaded server. Everybody passes
+ * authentication.
+ */
+
+#define WATCH_MONGODB_NO_MAIN
+#include "watch/watch_mongodb.cpp"
+#include "watch/synthetic_replies.h"
+
+#include <csignal>
+#include <strings.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define OP_REPLY 1
+#define OP_QUERY 2004
+
+#define MAX_MESSAGE_SIZE (48 * 1024 * 1024)
+
+/* latency_ms plus up to jitter_ms */
+struct CommandDelay
+{
+    CommandDelay(unsigned latency = 0, unsigned jitter = 0)
+	: latency_ms(latency)
+	, jitter_ms(jitter)
+    {}
+
+    unsigned latency_ms;
+    unsigned jitter_ms;
+};
+
+/* [CMD=]MS[+JITTER], without CMD the delay of all other commands */
+void
+parse_delay(string const &arg, map<string, CommandDelay> &delays)
+{
+    string::size_type eq = arg.find('=');
+    string cmd = string::npos == eq ? string() : arg.substr(0, eq);
+    string spec = string::npos == eq ? arg : arg.substr(eq + 1);
+
+    string::size_type plus = spec.find('+');
+    CommandDelay delay( lexical_cast<unsigned>( spec.substr(0, plus) ) );
+    if( string::npos != plus )
+	delay.jitter_ms = lexical_cast<unsigned>( spec.substr(plus + 1) );
+
+    delays[cmd] = delay;
+}
+
+class StandinReplies
+{
+public:
+    StandinReplies(CaptureReplay *replay, SyntheticReplies const *synthetic, map<string, CommandDelay> const &delays)
+	: m_replay(replay)
+	, m_synthetic(synthetic)
+	, m_delays(delays)
+    {}
+
+    /* the reply may refer into the capture or the synthesised replies */
+    BSONObj answer(string const &dbname, BSONObj const &query, unsigned &seed) const
+    {
+	char const *cmdname = query.firstElement().fieldName();
+
+	// handshake and authentication are not delayed
+	if( 0 == strcasecmp( cmdname, "ismaster" ) )
+	    return BSONObjBuilder().append("ismaster", true).append("maxBsonObjectSize", 16 * 1024 * 1024).append("ok", 1.0).obj();
+	if( 0 == strcmp( cmdname, "getnonce" ) )
+	    return BSONObjBuilder().append("nonce", "2375531c32080ae8").append("ok", 1.0).obj();
+	if( ( 0 == strcmp( cmdname, "authenticate" ) ) || ( 0 == strcmp( cmdname, "logout" ) ) )
+	    return BSONObjBuilder().append("ok", 1.0).obj();
+
+	delay(cmdname, seed);
+
+	BSONObj reply;
+	if( m_replay ? m_replay->next(dbname, cmdname, reply) : m_synthetic->find(dbname, cmdname, reply) )
+	    return reply;
+
+	return BSONObjBuilder().append("errmsg", string("no such cmd: ") + cmdname).append("ok", 0.0).obj();
+    }
+
+protected:
+    CaptureReplay *m_replay;
+    SyntheticReplies const *m_synthetic;
+    map<string, CommandDelay> const m_delays;
+
+    void delay(char const *cmdname, unsigned &seed) const
+    {
+	map<string, CommandDelay>::const_iterator ci = m_delays.find(cmdname);
+	if( ci == m_delays.end() )
+	    ci = m_delays.find("");
+	if( ci == m_delays.end() )
+	    return;
+
+	unsigned ms = ci->second.latency_ms;
+	if( ci->second.jitter_ms )
+	    ms += rand_r(&seed) % ( ci->second.jitter_ms + 1 );
+	if( ms )
+	    boost::this_thread::sleep( boost::posix_time::milliseconds(ms) );
+    }
+
+private:
+    StandinReplies();
+    StandinReplies(StandinReplies const &);
+    StandinReplies & operator = (StandinReplies const &);
+};
+
+bool
+read_all(int fd, char *p, size_t left)
+{
+    while( left )
+    {
+	ssize_t n = read( fd, p, left );
+	if( n < 0 )
+	{
+	    if( EINTR == errno )
+		continue;
+	    return false;
+	}
+	if( 0 == n )
+	    return false;
+	p += n;
+	left -= n;
+    }
+
+    return true;
+}
+
+/* wire protocol integers are little endian */
+unsigned
+get_le32(char const *p)
+{
+    unsigned char const *b = reinterpret_cast<unsigned char const *>(p);
+    return b[0] | ( b[1] << 8 ) | ( b[2] << 16 ) | ( static_cast<unsigned>(b[3]) << 24 );
+}
+
+void
+put_le32(string &buf, unsigned v)
+{
+    for( unsigned i = 0; i < 4; ++i )
+	buf += static_cast<char>( ( v >> ( i * 8 ) ) & 0xFF );
+}
+
+/* answers the commands of one client until it hangs up */
+void
+serve(int fd, StandinReplies const &replies)
+{
+    unsigned seed = static_cast<unsigned>(fd);
+    unsigned reply_id = 0;
+    vector<char> msg;
+    string out;
+
+    for(;;)
+    {
+	char header[16];
+	if( !read_all( fd, header, sizeof(header) ) )
+	    break;
+
+	unsigned const len = get_le32(header), request_id = get_le32(header + 4), op = get_le32(header + 12);
+	if( ( len <= sizeof(header) ) || ( len > MAX_MESSAGE_SIZE ) )
+	    break;
+
+	msg.resize( len - sizeof(header) );
+	if( !read_all( fd, &msg[0], msg.size() ) )
+	    break;
+
+	// other operations (e.g. OP_KILL_CURSORS) get no reply
+	if( OP_QUERY != op )
+	    continue;
+
+	// flags, full collection name, number to skip and to return, query
+	char const *p = &msg[0] + 4, *end = &msg[0] + msg.size();
+	char const *nul = static_cast<char const *>( memchr( p, '\0', end - p ) );
+	if( !nul || ( end - nul < 1 + 8 + 5 ) )
+	    break;
+
+	string const ns( p, nul );
+	p = nul + 1 + 8;
+	if( get_le32(p) > static_cast<unsigned>( end - p ) )
+	    break;
+
+	BSONObj query(p);
+	BSONElement first = query.firstElement();
+	if( ( Object == first.type() ) &&
+	    ( ( 0 == strcmp( first.fieldName(), "$query" ) ) || ( 0 == strcmp( first.fieldName(), "query" ) ) ) )
+	    query = first.Obj();
+
+	BSONObj const reply = replies.answer( ns.substr( 0, ns.find('.') ), query, seed );
+
+	out.clear();
+	put_le32( out, 16 + 20 + reply.objsize() );
+	put_le32( out, ++reply_id );
+	put_le32( out, request_id );
+	put_le32( out, OP_REPLY );
+	put_le32( out, 0 );             // response flags
+	put_le32( out, 0 );             // cursor id (64 bit)
+	put_le32( out, 0 );
+	put_le32( out, 0 );             // starting from
+	put_le32( out, 1 );             // number returned
+	out.append( reply.objdata(), reply.objsize() );
+
+	if( !write_all( fd, out.data(), out.size() ) )
+	    break;
+    }
+
+    close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+    try
+    {
+	options_description desc("Allowed options");
+	desc.add_options()
+	    ("help", "produce help message")
+	    ("bind", value<string>()->default_value("127.0.0.1"), "address to listen on")
+	    ("port", value<unsigned short>()->default_value(27018), "port to listen on")
+	    ("replay", value<string>(), "answer from a capture made by mongodb-stats --record")
+	    ("databases", value<unsigned>()->default_value(100), "databases of the synthesised replies")
+	    ("members", value<unsigned>()->default_value(3), "replica set members of the synthesised replies")
+	    ("latency", value< vector<string> >()->composing(),
+	     "delay as [CMD=]MS[+JITTER], e.g. 2+1 for all commands and dbstats=5+5, repeat for several commands")
+	    ;
+	variables_map vm;
+	store( parse_command_line( argc, argv, desc ), vm );
+	notify(vm);
+
+	if( vm.count("help") )
+	{
+	    cout << desc << endl;
+	    return 1;
+	}
+
+	map<string, CommandDelay> delays;
+	if( vm.count("latency") )
+	{
+	    vector<string> const &specs = vm["latency"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = specs.begin(); ci != specs.end(); ++ci )
+		parse_delay(*ci, delays);
+	}
+
+	scoped_ptr<CaptureReplay> replay;
+	scoped_ptr<SyntheticReplies> synthetic;
+	if( vm.count("replay") )
+	    replay.reset( new CaptureReplay( vm["replay"].as<string>() ) );
+	else
+	    synthetic.reset( new SyntheticReplies( vm["databases"].as<unsigned>(), vm["members"].as<unsigned>(), 4 ) );
+	StandinReplies const replies( replay.get(), synthetic.get(), delays );
+
+	signal(SIGPIPE, SIG_IGN);
+
+	int lfd = socket( AF_INET, SOCK_STREAM, 0 );
+	int on = 1;
+	setsockopt( lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( vm["port"].as<unsigned short>() );
+	if( 1 != inet_pton( AF_INET, vm["bind"].as<string>().c_str(), &addr.sin_addr ) )
+	{
+	    cerr << "can't parse address " << vm["bind"].as<string>() << endl;
+	    return 255;
+	}
+
+	if( ( lfd < 0 ) ||
+	    ( 0 != ::bind( lfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr) ) ) ||
+	    ( 0 != listen( lfd, 64 ) ) )
+	{
+	    cerr << "can't listen on " << vm["bind"].as<string>() << ":" << vm["port"].as<unsigned short>() << ": " << strerror(errno) << endl;
+	    return 255;
+	}
+
+	for(;;)
+	{
+	    int fd = accept( lfd, 0, 0 );
+	    if( fd < 0 )
+	    {
+		if( EINTR == errno )
+		    continue;
+		cerr << "accept failed: " << strerror(errno) << endl;
+		return 255;
+	    }
+
+	    boost::thread( boost::bind( &serve, fd, boost::cref(replies) ) ).detach();
+	}
+    }
+    catch( DBException &e )
+    {
+	cout << "caught " << e.what() << endl;
+    }
+    catch( std::exception &e )
+    {
+	cerr << e.what() << endl;
+	return 255;
+    }
+
+    return 0;
+}
@@ -0,0 +1,214 @@
+#ifndef __SYNTHETIC_REPLIES_H_INCLUDED__
+#define __SYNTHETIC_REPLIES_H_INCLUDED__
+
+/*
+ * Command replies synthesised from the generated MIB tables for the
+ * benchmark and the mongod stand-in. Include after watch_mongodb.cpp,
+ * which brings in the tables (mongo_mib.cpp) and the BSON types.
+ */
+
+/*
+ * Replies of a mongod with n_databases databases in a replica set of
+ * n_members. Each level gets n_unmapped extra fields no extractor knows,
+ * like the many serverStatus sections not in the MIB.
+ */
+class SyntheticReplies
+{
+public:
+    SyntheticReplies(unsigned n_databases, unsigned n_members, unsigned n_unmapped)
+	: m_n_unmapped(n_unmapped)
+	, m_seq(0)
+	, m_database_names()
+	, m_database_index()
+	, m_member_names()
+	, m_list_databases()
+	, m_dbstats()
+	, m_server_status()
+	, m_repl_set_get_status()
+    {
+	for( unsigned i = 0; i < n_databases; ++i )
+	{
+	    m_database_names.push_back( "db" + lexical_cast<string>(i) );
+	    m_database_index[m_database_names.back()] = i;
+	}
+	for( unsigned i = 0; i < n_members; ++i )
+	    m_member_names.push_back( "node" + lexical_cast<string>(i) + ".example.net:27017" );
+
+	m_list_databases = command(MIB_LEVEL_LISTDATABASES, "");
+	for( unsigned i = 0; i < n_databases; ++i )
+	    m_dbstats.push_back( command(MIB_LEVEL_DBSTATS, m_database_names[i]) );
+	m_server_status = command(MIB_LEVEL_SERVERSTATUS, "");
+	m_repl_set_get_status = command(MIB_LEVEL_REPLSETGETSTATUS, "");
+    }
+
+    vector<string> const & database_names() const { return m_database_names; }
+
+    BSONObj const & list_databases() const { return m_list_databases; }
+    BSONObj const & dbstats(size_t i) const { return m_dbstats[i]; }
+    BSONObj const & server_status() const { return m_server_status; }
+    BSONObj const & repl_set_get_status() const { return m_repl_set_get_status; }
+
+    /* reply to command cmdname run on dbname, false for commands not synthesised */
+    bool find(string const &dbname, char const *cmdname, BSONObj &reply) const
+    {
+	if( 0 == strcmp( cmdname, "dbstats" ) )
+	{
+	    boost::unordered_map<string, size_t>::const_iterator ci = m_database_index.find(dbname);
+	    if( ci == m_database_index.end() )
+		return false;
+	    reply = m_dbstats[ci->second];
+	    return true;
+	}
+
+	if( dbname != DBNAME )
+	    return false;
+
+	if( 0 == strcmp( cmdname, "listDatabases" ) )
+	    reply = m_list_databases;
+	else if( 0 == strcmp( cmdname, "serverStatus" ) )
+	    reply = m_server_status;
+	else if( 0 == strcmp( cmdname, "replSetGetStatus" ) )
+	    reply = m_repl_set_get_status;
+	else
+	    return false;
+
+	return true;
+    }
+
+protected:
+    unsigned const m_n_unmapped;
+    unsigned long long m_seq;
+    vector<string> m_database_names;
+    boost::unordered_map<string, size_t> m_database_index;
+    vector<string> m_member_names;
+
+    BSONObj m_list_databases;
+    vector<BSONObj> m_dbstats;
+    BSONObj m_server_status;
+    BSONObj m_repl_set_get_status;
+
+    BSONObj command(unsigned level, string const &name)
+    {
+	BSONObjBuilder b;
+	fill_level(b, level, name);
+	b.append("ok", 1.0);
+	return b.obj();
+    }
+
+    /* name is the value of the string fields of a table row */
+    void fill_level(BSONObjBuilder &b, unsigned level, string const &name)
+    {
+	MibLevel const &l = mib_levels[level];
+	for( unsigned f = l.first_field; f < l.first_field + l.n_fields; ++f )
+	{
+	    MibField const &field = mib_fields[f];
+	    switch( field.kind )
+	    {
+		case MIB_ITEM:
+		    fill_item(b, field, name);
+		    break;
+		case MIB_STRUCT:
+		{
+		    BSONObjBuilder sub;
+		    fill_level(sub, field.level, name);
+		    b.append(field.name, sub.obj());
+		    break;
+		}
+		case MIB_TABLE:
+		    fill_table(b, field);
+		    break;
+	    }
+	}
+
+	for( unsigned i = 0; i < m_n_unmapped; ++i )
+	    b.append( "unmapped" + lexical_cast<string>(i), static_cast<long long>( ++m_seq ) );
+    }
+
+    void fill_item(BSONObjBuilder &b, MibField const &field, string const &name)
+    {
+	unsigned long long const v = ++m_seq;
+
+	// several conversions of one field are the time and increment of a timestamp
+	if( field.n_emits > 1 )
+	{
+	    b.appendTimestamp(field.name, v * 1000, static_cast<unsigned>(v));
+	    return;
+	}
+
+	switch( mib_emits[field.first_emit].value )
+	{
+	    case MIB_STR:
+		b.append(field.name, name.empty() ? string("synthetic") : name);
+		break;
+	    case MIB_INT:
+	    case MIB_UINT:
+		b.append(field.name, static_cast<int>(v & 0x7FFFFFFF));
+		break;
+	    case MIB_UINT64:
+		b.append(field.name, static_cast<long long>(v));
+		break;
+	    case MIB_DOUBLE:
+		b.append(field.name, static_cast<double>(v) / 7);
+		break;
+	}
+    }
+
+    void fill_table(BSONObjBuilder &b, MibField const &field)
+    {
+	switch( field.hook )
+	{
+	    case MIB_HOOK_SERVERSTATUS_LOCKS:
+	    {
+		BSONObjBuilder locks, global;
+		fill_level(global, MIB_LEVEL_SERVERSTATUS_LOCKS_DOT, "");
+		locks.append(".", global.obj());
+		for( vector<string>::const_iterator ci = m_database_names.begin(); ci != m_database_names.end(); ++ci )
+		{
+		    BSONObjBuilder database;
+		    fill_level(database, MIB_LEVEL_SERVERSTATUS_LOCKS_ANY, *ci);
+		    locks.append(*ci, database.obj());
+		}
+		b.append(field.name, locks.obj());
+		break;
+	    }
+	    case MIB_HOOK_SERVERSTATUS_REPL_HOSTS:
+	    case MIB_HOOK_SERVERSTATUS_REPL_ARBITERS:
+	    {
+		// the last member is the arbiter
+		BSONArrayBuilder hosts;
+		for( size_t i = 0; i < m_member_names.size(); ++i )
+		{
+		    if( ( i + 1 == m_member_names.size() ) == ( MIB_HOOK_SERVERSTATUS_REPL_ARBITERS == field.hook ) )
+			hosts.append( m_member_names[i] );
+		}
+		b.appendArray(field.name, hosts.arr());
+		break;
+	    }
+	    case MIB_HOOK_REPLSETGETSTATUS_MEMBERS:
+		fill_rows(b, field, MIB_LEVEL_REPLSETGETSTATUS_MEMBERS_ROW, m_member_names);
+		break;
+	    case MIB_HOOK_LISTDATABASES_DATABASES:
+		fill_rows(b, field, MIB_LEVEL_LISTDATABASES_DATABASES_ROW, m_database_names);
+		break;
+	}
+    }
+
+    void fill_rows(BSONObjBuilder &b, MibField const &field, unsigned level, vector<string> const &names)
+    {
+	BSONArrayBuilder rows;
+	for( vector<string>::const_iterator ci = names.begin(); ci != names.end(); ++ci )
+	{
+	    BSONObjBuilder row;
+	    fill_level(row, level, *ci);
+	    rows.append( row.obj() );
+	}
+	b.appendArray(field.name, rows.arr());
+    }
+
+private:
+    SyntheticReplies();
+    SyntheticReplies(SyntheticReplies const &);
+    SyntheticReplies & operator = (SyntheticReplies const &);
+};
+
+#endif /*?__SYNTHETIC_REPLIES_H_INCLUDED__*/
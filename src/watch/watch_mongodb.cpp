@@ -1,12 +1,23 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <limits>
+#include <memory>
 #include <stdexcept>
 #include <set>
 #include <map>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <client/dbclient.h>
 
 #include <boost/lexical_cast.hpp>
@@ -16,11 +27,21 @@
 #include <boost/program_options/variables_map.hpp>
 #include <boost/timer/timer.hpp>
 #include <boost/locale.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/bind.hpp>
 
 #include <algorithm>
 #include <boost/lambda/lambda.hpp>
 
+#include "agentx.h"
 #include "asn1.h"
+#include "mib.h"
+#include "shm_snapshot.h"
+
+#include "mongo_mib.cpp"
 
 using namespace mongo;
 using namespace std;
@@ -36,6 +57,10 @@ using namespace boost::lambda;
 
 extern
 void connect(DBClientConnection &c, std::string const &dsn, std::string const &dbname, std::string const &user);
+extern
+void connect(DBClientConnection &c, std::string const &dsn);
+extern
+void authenticate(DBClientConnection &c, std::string const &dbname, std::string const &user);
 
 namespace boost
 {
@@ -49,29 +74,166 @@ lexical_cast<std::string>( bool const &v )
 
 }
 
-string
-join( string const &delim, vector<string> const &list )
+#define EXCEED_TYPE_BOUNDS(TYPE, VAL) \
+	std::numeric_limits<TYPE>::is_integer && \
+	((VAL > std::numeric_limits<TYPE>::max()) || \
+	 (VAL < std::numeric_limits<TYPE>::min()))
+
+#define OID_MAX_ARCS 16
+
+/*
+ * Object identifier relative to the MIB root, kept as fixed size array of
+ * numeric arcs. Compares in SNMP lexicographic order (.2 < .10) and allows
+ * prefix operations without touching any string, the dotted notation is
+ * produced only when the values are written out.
+ */
+struct Oid
 {
-    string rc;
+    Oid()
+	: len(0)
+    {}
+
+    Oid(char const *dotted)
+	: len(0)
+    {
+	parse(dotted);
+    }
+
+    Oid(string const &dotted)
+	: len(0)
+    {
+	parse(dotted.c_str());
+    }
+
+    explicit Oid(unsigned arc)
+	: len(0)
+    {
+	push_back(arc);
+    }
+
+    Oid(unsigned const *first, unsigned const *last)
+	: len(0)
+    {
+	while( first != last )
+	    push_back(*first++);
+    }
+
+    Oid & push_back(unsigned arc)
+    {
+	if( len >= OID_MAX_ARCS )
+	    throw out_of_range( "oid exceeds " + lexical_cast<string>(OID_MAX_ARCS) + " arcs" );
+	arcs[len++] = arc;
+	return *this;
+    }
+
+    Oid & operator += (Oid const &tail)
+    {
+	if( len + tail.len > OID_MAX_ARCS )
+	    throw out_of_range( "oid exceeds " + lexical_cast<string>(OID_MAX_ARCS) + " arcs" );
+	std::copy( tail.arcs, tail.arcs + tail.len, arcs + len );
+	len += tail.len;
+	return *this;
+    }
+
+    Oid & operator += (unsigned arc)
+    {
+	return push_back(arc);
+    }
 
-    for( vector<string>::const_iterator ci = list.begin(); ci != list.end(); ++ci )
+    unsigned size() const { return len; }
+    bool empty() const { return 0 == len; }
+    unsigned back() const { return arcs[len - 1]; }
+    unsigned operator [] (unsigned i) const { return arcs[i]; }
+
+    bool is_prefix_of(Oid const &o) const
+    {
+	return ( len <= o.len ) && std::equal( arcs, arcs + len, o.arcs );
+    }
+
+    string str() const
+    {
+	char buf[OID_MAX_ARCS * 11];
+	return string( buf, format(buf) );
+    }
+
+    /* writes dotted notation to buf (at least OID_MAX_ARCS * 11 bytes), returns length */
+    size_t format(char *buf) const
+    {
+	char *p = buf;
+	for( unsigned i = 0; i < len; ++i )
+	{
+	    char digits[10];
+	    unsigned n = 0, v = arcs[i];
+	    do
+	    {
+		digits[n++] = '0' + ( v % 10 );
+		v /= 10;
+	    } while( v );
+
+	    *p++ = '.';
+	    while( n )
+		*p++ = digits[--n];
+	}
+
+	return p - buf;
+    }
+
+    unsigned arcs[OID_MAX_ARCS];
+    unsigned char len;
+
+protected:
+    void parse(char const *dotted)
     {
-        if( !rc.empty() )
-            rc += delim;
-        rc += *ci;
+	char const *p = dotted;
+	while( '.' == *p )
+	{
+	    char *end;
+	    unsigned long arc = strtoul( ++p, &end, 10 );
+	    if( end == p )
+		throw invalid_argument( string("malformed oid: ") + dotted );
+	    push_back(arc);
+	    p = end;
+	}
+
+	if( *p )
+	    throw invalid_argument( string("malformed oid: ") + dotted );
     }
+};
 
-    return rc;
+inline bool
+operator < (Oid const &x, Oid const &y)
+{
+    return std::lexicographical_compare( x.arcs, x.arcs + x.len, y.arcs, y.arcs + y.len );
 }
 
-#define EXCEED_TYPE_BOUNDS(TYPE, VAL) \
-	std::numeric_limits<TYPE>::is_integer && \
-	((VAL > std::numeric_limits<TYPE>::max()) || \
-	 (VAL < std::numeric_limits<TYPE>::min()))
+inline bool
+operator == (Oid const &x, Oid const &y)
+{
+    return ( x.len == y.len ) && std::equal( x.arcs, x.arcs + x.len, y.arcs );
+}
+
+inline Oid
+operator + (Oid x, Oid const &y)
+{
+    return x += y;
+}
+
+inline Oid
+operator + (Oid x, unsigned arc)
+{
+    return x += arc;
+}
+
+ostream &
+operator << (ostream &os, Oid const &oid)
+{
+    os << oid.str();
+    return os;
+}
 
 template<class T>
 T
-extract_number(BSONElement const &e, string const &oid)
+extract_number(BSONElement const &e, Oid const &oid)
 {
     T result;
 
@@ -82,7 +244,7 @@ extract_number(BSONElement const &e, string const &oid)
 	    double tmp = e.Double();
 	    if( EXCEED_TYPE_BOUNDS(T, tmp) )
 		throw out_of_range(
-		    string("double value for ") + oid +
+		    string("double value for ") + oid.str() +
 		    " (" + lexical_cast<string>(tmp) + ") not between " +
 		    lexical_cast<string>(std::numeric_limits<T>::min()) +
 		    " and " +
@@ -99,7 +261,7 @@ extract_number(BSONElement const &e, string const &oid)
 	    long long tmp = e.Int();
 	    if( EXCEED_TYPE_BOUNDS(T, tmp) )
 		throw out_of_range(
-		    string("int value for ") + oid +
+		    string("int value for ") + oid.str() +
 		    " (" + lexical_cast<string>(tmp) + ") not between " +
 		    lexical_cast<string>(std::numeric_limits<T>::min()) +
 		    " and " +
@@ -111,7 +273,7 @@ extract_number(BSONElement const &e, string const &oid)
 	    unsigned long long tmp = e.Date();
 	    if( EXCEED_TYPE_BOUNDS(T, tmp) )
 		throw out_of_range(
-		    string("int value for ") + oid +
+		    string("int value for ") + oid.str() +
 		    " (" + lexical_cast<string>(tmp) + ") not between " +
 		    lexical_cast<string>(std::numeric_limits<T>::min()) +
 		    " and " +
@@ -125,7 +287,7 @@ extract_number(BSONElement const &e, string const &oid)
 		unsigned int tmp = e.timestampInc();
 		if( EXCEED_TYPE_BOUNDS(T, tmp) )
 		    throw out_of_range(
-			string("int value for ") + oid +
+			string("int value for ") + oid.str() +
 			" (" + lexical_cast<string>(tmp) + ") not between " +
 			lexical_cast<string>(std::numeric_limits<T>::min()) +
 			" and " +
@@ -137,7 +299,7 @@ extract_number(BSONElement const &e, string const &oid)
 		unsigned long long tmp = e.timestampTime();
 		if( EXCEED_TYPE_BOUNDS(T, tmp) )
 		    throw out_of_range(
-			string("int value for ") + oid +
+			string("int value for ") + oid.str() +
 			" (" + lexical_cast<string>(tmp) + ") not between " +
 			lexical_cast<string>(std::numeric_limits<T>::min()) +
 			" and " +
@@ -150,7 +312,7 @@ extract_number(BSONElement const &e, string const &oid)
 	    long long tmp = e.Long();
 	    if( EXCEED_TYPE_BOUNDS(T, tmp) )
 		throw out_of_range(
-		    string("long long value for ") + oid +
+		    string("long long value for ") + oid.str() +
 		    " (" + lexical_cast<string>(tmp) + ") not between " +
 		    lexical_cast<string>(std::numeric_limits<T>::min()) +
 		    " and " +
@@ -172,17 +334,133 @@ extract_number(BSONElement const &e, string const &oid)
     }
 }
 
+#define OID_VALUE_FORMAT_SIZE 32
+
+/*
+ * Value of one OID. Numbers are stored native, strings either refer into
+ * a BSON reply pinned by the OidValueBuffer holding the value or are owned
+ * by the tuple. Text is produced only when the value is written out.
+ */
 struct OidValueTuple
 {
-    string oid;
+    enum ValueKind
+    {
+	VAL_NONE,
+	VAL_INT,
+	VAL_UINT,
+	VAL_UINT64,
+	VAL_DOUBLE,
+	VAL_STRREF,
+	VAL_STRING
+    };
+
+    Oid oid;
     unsigned type;
-    string value;
+    unsigned char kind;
+    union
+    {
+	int i;
+	unsigned u;
+	unsigned long long u64;
+	double d;
+	struct
+	{
+	    char const *ptr;
+	    size_t len;
+	} ref;
+    } v;
+    string owned;
 
-    OidValueTuple(string const &an_oid, unsigned a_type = ASN_NULL, string const &a_value = string())
+    OidValueTuple(Oid const &an_oid, unsigned a_type = ASN_NULL)
 	: oid(an_oid)
 	, type(a_type)
-	, value(a_value)
-    {}
+	, kind(VAL_NONE)
+	, owned()
+    {
+	v.u64 = 0;
+    }
+
+    OidValueTuple & set_int(int i) { kind = VAL_INT; v.i = i; return *this; }
+    OidValueTuple & set_uint(unsigned u) { kind = VAL_UINT; v.u = u; return *this; }
+    OidValueTuple & set_uint64(unsigned long long u64) { kind = VAL_UINT64; v.u64 = u64; return *this; }
+    OidValueTuple & set_double(double d) { kind = VAL_DOUBLE; v.d = d; return *this; }
+
+    /* ptr must stay valid as long as the value, see OidValueBuffer::pin() */
+    OidValueTuple & set_string_ref(char const *ptr, size_t len)
+    {
+	kind = VAL_STRREF;
+	v.ref.ptr = ptr;
+	v.ref.len = len;
+	return *this;
+    }
+
+    OidValueTuple & set_string(string const &s)
+    {
+	kind = VAL_STRING;
+	owned = s;
+	return *this;
+    }
+
+    bool is_string() const { return ( VAL_STRREF == kind ) || ( VAL_STRING == kind ); }
+    char const * str_data() const { return VAL_STRING == kind ? owned.data() : v.ref.ptr; }
+    size_t str_size() const { return VAL_STRING == kind ? owned.size() : v.ref.len; }
+
+    /* writes a number to buf (at least OID_VALUE_FORMAT_SIZE bytes) as lexical_cast does, returns length */
+    size_t format_number(char *buf) const
+    {
+	int n = 0;
+
+	switch( kind )
+	{
+	    case VAL_INT:
+		n = snprintf( buf, OID_VALUE_FORMAT_SIZE, "%d", v.i );
+		break;
+	    case VAL_UINT:
+		n = snprintf( buf, OID_VALUE_FORMAT_SIZE, "%u", v.u );
+		break;
+	    case VAL_UINT64:
+		n = snprintf( buf, OID_VALUE_FORMAT_SIZE, "%llu", v.u64 );
+		break;
+	    case VAL_DOUBLE:
+		n = snprintf( buf, OID_VALUE_FORMAT_SIZE, "%.17g", v.d );
+		break;
+	}
+
+	return n > 0 ? n : 0;
+    }
+
+    string str() const
+    {
+	if( is_string() )
+	    return string( str_data(), str_size() );
+
+	char buf[OID_VALUE_FORMAT_SIZE];
+	return string( buf, format_number(buf) );
+    }
+
+    bool same_value(OidValueTuple const &o) const
+    {
+	if( is_string() || o.is_string() )
+	    return is_string() && o.is_string() && ( str_size() == o.str_size() ) &&
+		( 0 == memcmp( str_data(), o.str_data(), str_size() ) );
+
+	if( kind != o.kind )
+	    return false;
+
+	switch( kind )
+	{
+	    case VAL_INT:
+		return v.i == o.v.i;
+	    case VAL_UINT:
+		return v.u == o.v.u;
+	    case VAL_UINT64:
+		return v.u64 == o.v.u64;
+	    case VAL_DOUBLE:
+		return v.d == o.v.d;
+	}
+
+	return true;
+    }
 };
 
 inline bool
@@ -191,58 +469,188 @@ operator < (OidValueTuple const &x, OidValueTuple const &y)
     return x.oid < y.oid;
 }
 
+inline void
+swap(OidValueTuple &a, OidValueTuple &b)
+{
+    std::swap(a.oid, b.oid);
+    std::swap(a.type, b.type);
+    std::swap(a.kind, b.kind);
+    std::swap(a.v, b.v);
+    a.owned.swap(b.owned);
+}
+
+struct OidValueBelowPrefix
+{
+    bool operator () (OidValueTuple const &v, Oid const &prefix) const { return v.oid < prefix; }
+    bool operator () (Oid const &prefix, OidValueTuple const &v) const { return ( prefix < v.oid ) && !prefix.is_prefix_of(v.oid); }
+};
+
+/*
+ * Result buffer of a poll. Extractors only append to a contiguous vector,
+ * ordering and removal of duplicates (the value appended last wins) is
+ * done once the values are looked up or written out. Appends after such
+ * an index run are sorted separately and merged into the ordered range.
+ * String values refer into the command replies, which are pinned here
+ * for the lifetime of the values.
+ */
+class OidValueBuffer
+{
+public:
+    typedef vector<OidValueTuple>::const_iterator const_iterator;
+
+    OidValueBuffer()
+	: m_vals()
+	, m_sorted(0)
+	, m_replies()
+    {}
+
+    void append(OidValueTuple const &v) { m_vals.push_back(v); }
+
+    /* appends all values of other below prefix, the replies they refer to are pinned here too */
+    void append(OidValueBuffer const &other, Oid const &prefix)
+    {
+	m_vals.reserve( m_vals.size() + other.size() );
+	for( const_iterator iter = other.begin(); iter != other.end(); ++iter )
+	{
+	    m_vals.push_back( *iter );
+	    m_vals.back().oid = prefix + iter->oid;
+	}
+	m_replies.insert( m_replies.end(), other.m_replies.begin(), other.m_replies.end() );
+    }
+
+    /* like above, but only the values in or below one of subtrees, all of them without subtrees */
+    void append(OidValueBuffer const &other, Oid const &prefix, vector<Oid> const &subtrees)
+    {
+	if( subtrees.empty() )
+	{
+	    append(other, prefix);
+	    return;
+	}
+
+	for( vector<Oid>::const_iterator ci = subtrees.begin(); ci != subtrees.end(); ++ci )
+	{
+	    std::pair<const_iterator, const_iterator> range = other.prefix_range(*ci);
+	    for( const_iterator iter = range.first; iter != range.second; ++iter )
+	    {
+		m_vals.push_back( *iter );
+		m_vals.back().oid = prefix + iter->oid;
+	    }
+	}
+	m_replies.insert( m_replies.end(), other.m_replies.begin(), other.m_replies.end() );
+    }
+
+    /* keeps reply alive with the values, extract from the returned object */
+    BSONObj pin(BSONObj const &reply)
+    {
+	m_replies.push_back( reply.getOwned() );
+	return m_replies.back();
+    }
+
+    void reserve(size_t n) { m_vals.reserve(n); }
+    void clear() { m_vals.clear(); m_sorted = 0; m_replies.clear(); }
+    bool empty() const { return m_vals.empty(); }
+    size_t size() const { index(); return m_vals.size(); }
+
+    const_iterator begin() const { index(); return m_vals.begin(); }
+    const_iterator end() const { index(); return m_vals.end(); }
+
+    const_iterator lower_bound(Oid const &oid) const
+    {
+	index();
+	return std::lower_bound( m_vals.begin(), m_vals.end(), oid, OidValueBelowPrefix() );
+    }
+
+    /* all values at or below prefix */
+    std::pair<const_iterator, const_iterator> prefix_range(Oid const &prefix) const
+    {
+	index();
+	return std::equal_range( m_vals.begin(), m_vals.end(), prefix, OidValueBelowPrefix() );
+    }
+
+    void index() const
+    {
+	if( m_sorted == m_vals.size() )
+	    return;
+
+	std::stable_sort( m_vals.begin() + m_sorted, m_vals.end() );
+	std::inplace_merge( m_vals.begin(), m_vals.begin() + m_sorted, m_vals.end() );
+
+	// equal OIDs are in append order now, keep the last one
+	vector<OidValueTuple>::iterator out = m_vals.begin();
+	for( vector<OidValueTuple>::iterator in = m_vals.begin(); in != m_vals.end(); ++in )
+	{
+	    vector<OidValueTuple>::iterator next = in + 1;
+	    if( ( next != m_vals.end() ) && ( next->oid == in->oid ) )
+		continue;
+	    if( out != in )
+		swap(*out, *in);
+	    ++out;
+	}
+	m_vals.erase( out, m_vals.end() );
+	m_sorted = m_vals.size();
+    }
+
+protected:
+    mutable vector<OidValueTuple> m_vals;
+    mutable size_t m_sorted;
+    vector<BSONObj> m_replies;
+};
+
 template<class T>
 OidValueTuple
-extract(BSONElement const &e, string const &oid)
+extract(BSONElement const &e, Oid const &oid)
 {
     return OidValueTuple( oid );
 }
 
 template<>
 OidValueTuple
-extract<string>(BSONElement const &e, string const &oid)
+extract<string>(BSONElement const &e, Oid const &oid)
 {
-    return OidValueTuple( oid, ASN_OCTET_STR, e.String() );
+    BSONElement const &str = e.chk(String);
+    return OidValueTuple( oid, ASN_OCTET_STR ).set_string_ref( str.valuestr(), str.valuestrsize() - 1 );
 }
 
 template<>
 OidValueTuple
-extract<int>(BSONElement const &e, string const &oid)
+extract<int>(BSONElement const &e, Oid const &oid)
 {
-    return OidValueTuple( oid, ASN_INTEGER, lexical_cast<string>( extract_number<int>(e, oid) ) );
+    return OidValueTuple( oid, ASN_INTEGER ).set_int( extract_number<int>(e, oid) );
 }
 
 template<>
 OidValueTuple
-extract<unsigned int>(BSONElement const &e, string const &oid)
+extract<unsigned int>(BSONElement const &e, Oid const &oid)
 {
-    return OidValueTuple( oid, SMI_UINTEGER, lexical_cast<string>( extract_number<unsigned int>(e, oid) ) );
+    return OidValueTuple( oid, SMI_UINTEGER ).set_uint( extract_number<unsigned int>(e, oid) );
 }
 
 template<>
 OidValueTuple
-extract<unsigned long long>(BSONElement const &e, string const &oid)
+extract<unsigned long long>(BSONElement const &e, Oid const &oid)
 {
-    return OidValueTuple( oid, SMI_COUNTER64, lexical_cast<string>( extract_number<unsigned long long>(e, oid) ) );
+    return OidValueTuple( oid, SMI_COUNTER64 ).set_uint64( extract_number<unsigned long long>(e, oid) );
 }
 
 template<>
 OidValueTuple
-extract<double>(BSONElement const &e, string const &oid)
+extract<double>(BSONElement const &e, Oid const &oid)
 {
-    return OidValueTuple( oid, ASN_OCTET_STR, lexical_cast<string>( extract_number<double>(e, oid) ) );
+    return OidValueTuple( oid, ASN_OCTET_STR ).set_double( extract_number<double>(e, oid) );
 }
 
 struct Extractor
 {
 public:
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals) = 0;
+    virtual ~Extractor() {}
+
+    virtual void operator()(BSONElement const &e, OidValueBuffer &out_vals) = 0;
 };
 
 ostream &
 operator << (ostream &os, OidValueTuple const val)
 {
-    os << "(" << val.oid << ", " << val.type << ", " << val.value << ")";
+    os << "(" << val.oid << ", " << val.type << ", " << val.str() << ")";
     return os;
 }
 
@@ -251,105 +659,179 @@ struct ItemExtractor
     : public Extractor
 {
 public:
-    ItemExtractor(string const &oid)
+    ItemExtractor(Oid const &oid)
 	: Extractor()
 	, m_oid(oid)
     {}
 
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals)
+    virtual void operator()(BSONElement const &e, OidValueBuffer &out_vals)
     {
-	out_vals.insert( extract<T>( e, m_oid ) );
+	out_vals.append( extract<T>( e, m_oid ) );
     }
 
 protected:
-    string const m_oid;
+    Oid const m_oid;
 
 private:
     ItemExtractor();
 };
 
-struct StructExtractor
+OidValueTuple
+extract_mib(BSONElement const &e, MibEmit const &emit)
+{
+    Oid const oid( emit.arcs, emit.arcs + emit.n_arcs );
+    OidValueTuple val( oid );
+
+    switch( emit.value )
+    {
+	case MIB_STR:
+	    val = extract<string>( e, oid );
+	    break;
+	case MIB_INT:
+	    val = extract<int>( e, oid );
+	    break;
+	case MIB_UINT:
+	    val = extract<unsigned int>( e, oid );
+	    break;
+	case MIB_UINT64:
+	    val = extract<unsigned long long>( e, oid );
+	    break;
+	case MIB_DOUBLE:
+	    val = extract<double>( e, oid );
+	    break;
+    }
+
+    val.type = emit.asn_type;
+    return val;
+}
+
+/*
+ * Walks a command reply along the levels of the generated MIB table.
+ * Fields are looked up by their hash and checked by name, no field name
+ * is copied. Tables need row handling and are passed to the extractor
+ * bound to their hook, those are owned by the root extractor.
+ */
+struct MibStructExtractor
     : public Extractor
 {
 public:
-    StructExtractor(map<string, Extractor *> *item_rules)
+    MibStructExtractor(unsigned level)
 	: Extractor()
-	, m_item_rules(item_rules)
+	, m_level(level)
+	, m_hooks(MIB_HOOK_COUNT, static_cast<Extractor *>(0))
     {}
 
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals)
+    virtual ~MibStructExtractor()
     {
-        BSONObjIterator i(e.Obj());
-        while( i.more() )
+	for( vector<Extractor *>::iterator i = m_hooks.begin(); i != m_hooks.end(); ++i )
 	{
-            BSONElement elem = i.next();
-            string fname = elem.fieldName();
+	    delete *i;
+	    *i = 0;
+	}
+    }
 
-	    map<string, Extractor *>::iterator iter = m_item_rules->find( fname );
-	    if( iter != m_item_rules->end() )
-	    {
-		Extractor &ex = *iter->second;
-		ex(elem, out_vals);
-	    }
-        }
+    void bind(MibHookId hook, Extractor *extractor)
+    {
+	delete m_hooks[hook];
+	m_hooks[hook] = extractor;
     }
 
-    virtual void operator()(BSONObj const &o, set<OidValueTuple> &out_vals)
+    virtual void operator()(BSONElement const &e, OidValueBuffer &out_vals)
     {
-        BSONObjIterator i(o.begin());
-        while( i.more() )
-	{
-            BSONElement elem = i.next();
-            string fname = elem.fieldName();
+	extract_level( m_level, e.Obj(), out_vals );
+    }
 
-	    map<string, Extractor *>::iterator iter = m_item_rules->find( fname );
-	    if( iter != m_item_rules->end() )
-	    {
-		Extractor &ex = *iter->second;
-		ex(elem, out_vals);
-	    }
-        }
+    void operator()(BSONObj const &o, OidValueBuffer &out_vals)
+    {
+	extract_level( m_level, o, out_vals );
     }
 
-    virtual ~StructExtractor()
+    static MibField const *
+    find_field(MibLevel const &level, char const *fname)
     {
-	for( map<string, Extractor *>::iterator i = m_item_rules->begin();
-	     i != m_item_rules->end();
-	     ++i )
-	{
-	    delete i->second;
-	    i->second = 0;
-	}
+	unsigned slot = mib_slots[level.first_slot + ( mib_hash( level.seed, fname ) & level.slot_mask )];
+	if( 0 == slot )
+	    return 0;
 
-	delete m_item_rules;
+	MibField const &field = mib_fields[slot - 1];
+	return 0 == strcmp( field.name, fname ) ? &field : 0;
     }
 
 protected:
-    map<string, Extractor *> *m_item_rules;
+    unsigned const m_level;
+    vector<Extractor *> m_hooks;
+
+    void extract_level(unsigned level, BSONObj const &o, OidValueBuffer &out_vals)
+    {
+        BSONObjIterator i(o);
+        while( i.more() )
+	{
+            BSONElement elem = i.next();
+	    MibField const *field = find_field( mib_levels[level], elem.fieldName() );
+	    if( !field )
+		continue;
+
+	    switch( field->kind )
+	    {
+		case MIB_ITEM:
+		    for( unsigned k = field->first_emit; k < field->first_emit + field->n_emits; ++k )
+		    {
+			// a value not fitting its type loses its varbind, not the section
+			try
+			{
+			    out_vals.append( extract_mib( elem, mib_emits[k] ) );
+			}
+			catch( out_of_range &e )
+			{
+			    cerr << e.what() << endl;
+			}
+		    }
+		    break;
+		case MIB_STRUCT:
+		    extract_level( field->level, elem.Obj(), out_vals );
+		    break;
+		case MIB_TABLE:
+		    if( m_hooks[field->hook] )
+			(*m_hooks[field->hook])(elem, out_vals);
+		    break;
+	    }
+        }
+    }
 
 private:
-    StructExtractor();
-    StructExtractor(StructExtractor const &);
-    StructExtractor & operator = (StructExtractor const &);
+    MibStructExtractor();
+    MibStructExtractor(MibStructExtractor const &);
+    MibStructExtractor & operator = (MibStructExtractor const &);
+};
+
+/* one level as default constructible embed of table and *fix extractors */
+template<unsigned Level>
+struct MibLevelExtractor
+    : public MibStructExtractor
+{
+public:
+    MibLevelExtractor()
+	: MibStructExtractor(Level)
+    {}
 };
 
 struct Anyfix
 {
-    virtual string operator()() const = 0;
+    virtual Oid operator()() const = 0;
 };
 
 struct StaticAnyfix
     : public Anyfix
 {
-    StaticAnyfix(string const &anyfix)
+    StaticAnyfix(Oid const &anyfix)
 	: Anyfix()
 	, m_anyfix(anyfix)
     {}
 
-    virtual string operator()() const { return m_anyfix; }
+    virtual Oid operator()() const { return m_anyfix; }
 
 protected:
-     string m_anyfix;
+     Oid m_anyfix;
 };
 
 #if 0
@@ -383,64 +865,56 @@ public:
 	, m_postfix(postfix)
     {}
 
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals)
+    virtual void operator()(BSONElement const &e, OidValueBuffer &out_vals)
+    {
+	m_ofs_vals.clear();
+	Embed::operator()(e, m_ofs_vals);
+	apply_fixes(m_ofs_vals, out_vals);
+    }
+
+    void operator()(BSONObj const &o, OidValueBuffer &out_vals)
     {
-	set<OidValueTuple> ofs_vals;
-	Embed::operator()(e, ofs_vals);
-	apply_fixes(ofs_vals, out_vals);
+	m_ofs_vals.clear();
+	Embed::operator()(o, m_ofs_vals);
+	apply_fixes(m_ofs_vals, out_vals);
     }
 
-    void apply_fixes(set<OidValueTuple> &collected_vals, set<OidValueTuple> &out_vals)
+    void apply_fixes(OidValueBuffer const &collected_vals, OidValueBuffer &out_vals)
     {
-	for( set<OidValueTuple>::iterator iter = collected_vals.begin();
+	Oid const prefix = m_prefix(), postfix = m_postfix();
+	for( OidValueBuffer::const_iterator iter = collected_vals.begin();
 	     iter != collected_vals.end();
 	     ++iter )
 	{
-	    OidValueTuple ov = *iter;
-	    ov.oid = m_prefix() + ov.oid + m_postfix();
-	    insert_or_update( out_vals, ov );
+	    OidValueTuple ov( *iter );
+	    ov.oid = prefix;
+	    ov.oid += iter->oid;
+	    ov.oid += postfix;
+	    out_vals.append( ov );
 	}
     }
 
 protected:
     Pre m_prefix;
     Post m_postfix;
-
-    std::set<OidValueTuple>::iterator
-    insert_or_update( std::set<OidValueTuple> &vals, OidValueTuple const &v )
-    {
-	std::set<OidValueTuple>::iterator i = vals.lower_bound(v);
-	if( ( i == vals.end() ) || ( vals.key_comp()(v, *i ) ) )
-	{
-	    i = vals.insert( i, v );
-	}
-	else
-	{
-	    OidValueTuple &ev = const_cast<OidValueTuple &>(*i);
-	    ev = v;
-	}
-
-	return i;
-    }
+    OidValueBuffer m_ofs_vals; // reused for each struct, keeps its capacity
 
 private:
     BothfixStructExtractor();
-    BothfixStructExtractor(StructExtractor const &);
+    BothfixStructExtractor(BothfixStructExtractor const &);
     BothfixStructExtractor & operator = (BothfixStructExtractor const &);
 };
 
 struct RowPostfix
     : public Anyfix
 {
-    friend void swap(RowPostfix &a, RowPostfix &b);
-
 public:
     RowPostfix(unsigned row = 0)
 	: Anyfix()
 	, m_row(row)
     {}
 
-    virtual string operator()() const { return "." + lexical_cast<string>(m_row); }
+    virtual Oid operator()() const { return Oid(m_row); }
 
     operator unsigned() const { return m_row; }
 
@@ -452,31 +926,25 @@ protected:
     unsigned m_row;
 };
 
-void
-swap(RowPostfix &a, RowPostfix &b)
-{
-    swap(a.m_row, b.m_row);
-}
-
 template<class T>
 struct ServReplHostsExtractor
     : public ItemExtractor<T>
 {
 public:
-    ServReplHostsExtractor(string const &type)
+    ServReplHostsExtractor(char const *type)
 	: ItemExtractor<T>(".2")
 	, m_type(type)
     {}
 
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals)
+    virtual void operator()(BSONElement const &e, OidValueBuffer &out_vals)
     {
 	ItemExtractor<T>::operator()( e, out_vals );
 
-	out_vals.insert( OidValueTuple( ".5", ASN_OCTET_STR, m_type ) );
+	out_vals.append( OidValueTuple( ".5", ASN_OCTET_STR ).set_string_ref( m_type, strlen(m_type) ) );
     }
 
 protected:
-    string m_type;
+    char const *m_type; // string literal, outlives every value
 };
 
 struct ServReplWorkersExtractor
@@ -495,89 +963,148 @@ struct ServReplArbiterExtractor
     {}
 };
 
-template <class E>
-struct TableRowExtractor
-    : public BothfixStructExtractor<E, const StaticAnyfix, RowPostfix &>
+/*
+ * Row numbers of a table by key value. A row is handed out the first time
+ * its key is seen, so a database or replica set member keeps its row
+ * across polls. Extractors writing into the same table share one index.
+ * Keys not seen in a poll are dropped by retain_seen(); their rows are
+ * handed out again only after a poll without them, so no counter rate
+ * spans two different keys.
+ */
+class TableRowIndex
 {
 public:
-    TableRowExtractor(string const &tblOid, RowPostfix &rowPostfix, vector<string> const &key_chk = vector<string>() )
-	: BothfixStructExtractor<E, const StaticAnyfix, RowPostfix &>(StaticAnyfix(tblOid + ".1"), rowPostfix)
-	, m_key_chk(key_chk)
+    TableRowIndex()
+	: m_rows()
+	, m_last_row(0)
+	, m_poll(0)
+	, m_released()
+	, m_free()
     {}
 
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals)
-    {
-	unsigned merge_row;
-	set<OidValueTuple> embed_vals;
-
-	E::operator()(e, embed_vals);
-	if( ( merge_row = find_key(embed_vals, out_vals) ) > 0 )
-	{
-	    RowPostfix save(merge_row);
+    /* keys seen from now on make up the poll */
+    void start_poll() { ++m_poll; }
 
-	    swap(save, this->m_postfix);
-	    this->apply_fixes(embed_vals, out_vals);
-	    swap(save, this->m_postfix);
-	}
-	else
+    unsigned row(string const &key)
+    {
+	Entry &entry = m_rows[key];
+	if( 0 == entry.row )
 	{
-	    if( merge_row < 0 )
-		this->m_postfix.setNextRow( 0 - ( merge_row - 1 ) );
+	    if( m_free.empty() )
+		entry.row = ++m_last_row;
 	    else
-		this->m_postfix.nextRow();
-	    this->apply_fixes(embed_vals, out_vals);
+	    {
+		entry.row = *m_free.begin();
+		m_free.erase( m_free.begin() );
+	    }
 	}
+	entry.seen = m_poll;
+	return entry.row;
     }
 
-    unsigned find_key(set<OidValueTuple> const &embed_vals, set<OidValueTuple> &out_vals) const
+    /* 0 when key has no row */
+    unsigned find(string const &key) const
     {
-	vector<bool> found;
-	for( vector<string>::const_iterator ci = m_key_chk.begin();
-	     ci != m_key_chk.end();
-	     ++ci )
-	{
-	    OidValueTuple search_key( *ci, ASN_OCTET_STR );
-	    set<OidValueTuple>::iterator cmp_iter = embed_vals.lower_bound(search_key);
-	    if( cmp_iter == embed_vals.end() )
-		continue;
-
-	    search_key.value = cmp_iter->value;
-	    search_key.oid = this->m_prefix() + search_key.oid + ".";
+	boost::unordered_map<string, Entry>::const_iterator ci = m_rows.find(key);
+	return ci == m_rows.end() ? 0 : ci->second.row;
+    }
 
-	    for( cmp_iter = out_vals.lower_bound(search_key);
-		 ( cmp_iter != out_vals.end() ) && ( 0 == cmp_iter->oid.compare( 0, search_key.oid.length(), search_key.oid ) );
-		 ++cmp_iter )
-	    {
-		if( cmp_iter->value == search_key.value )
-		{
-		    string row_str = cmp_iter->oid.substr( cmp_iter->oid.find_last_of("." ) + 1 );
-		    unsigned row = lexical_cast<unsigned>(row_str);
-		    if( found.size() < (row+1) )
-			found.resize(row+1);
+    /* 0 when key was not seen in this poll */
+    unsigned find_seen(string const &key) const
+    {
+	boost::unordered_map<string, Entry>::const_iterator ci = m_rows.find(key);
+	return ( ci == m_rows.end() ) || ( ci->second.seen != m_poll ) ? 0 : ci->second.row;
+    }
 
-		    if( ci == m_key_chk.begin() )
-			found[row] = true;
-		    else
-			found[row] = found[row] & true;
-		}
-	    }
-	}
+    /* for entries without key, never found again */
+    unsigned new_row() { return ++m_last_row; }
 
-	// scan found for first full matching row
-	unsigned row = 0;
-	for( vector<bool>::iterator vbi = found.begin();
-	     vbi != found.end();
-	     ++vbi, ++row )
+    /* forgets the keys not seen in this poll */
+    void retain_seen()
+    {
+	m_free.insert( m_released.begin(), m_released.end() );
+	m_released.clear();
+	for( boost::unordered_map<string, Entry>::iterator i = m_rows.begin(); i != m_rows.end(); )
 	{
-	    if( *vbi )
-		return row;
+	    if( i->second.seen == m_poll )
+		++i;
+	    else
+	    {
+		m_released.push_back( i->second.row );
+		i = m_rows.erase(i);
+	    }
 	}
-
-	return 0;
     }
 
 protected:
-    vector<string> m_key_chk;
+    struct Entry
+    {
+	Entry() : row(0), seen(0) {}
+
+	unsigned row;
+	unsigned seen;          // poll the key was last seen in
+    };
+
+    boost::unordered_map<string, Entry> m_rows;
+    unsigned m_last_row;
+    unsigned m_poll;
+    vector<unsigned> m_released;        // free from the next poll on
+    std::set<unsigned> m_free;
+
+private:
+    TableRowIndex(TableRowIndex const &);
+    TableRowIndex & operator = (TableRowIndex const &);
+};
+
+template <class E>
+struct TableRowExtractor
+    : public BothfixStructExtractor<E, const StaticAnyfix, RowPostfix>
+{
+public:
+    TableRowExtractor(Oid const &tblOid, TableRowIndex &rows, vector<Oid> const &key_chk = vector<Oid>() )
+	: BothfixStructExtractor<E, const StaticAnyfix, RowPostfix>(StaticAnyfix(tblOid + 1), RowPostfix())
+	, m_rows(rows)
+	, m_key_chk(key_chk)
+	, m_key()
+    {}
+
+    virtual void operator()(BSONElement const &e, OidValueBuffer &out_vals)
+    {
+	OidValueBuffer &embed_vals = this->m_ofs_vals;
+
+	embed_vals.clear();
+	E::operator()(e, embed_vals);
+	this->m_postfix.setNextRow( find_key(embed_vals) );
+	this->apply_fixes(embed_vals, out_vals);
+    }
+
+    /* row of the key columns' values, several key columns are joined by NUL */
+    unsigned find_key(OidValueBuffer const &embed_vals)
+    {
+	m_key.clear();
+	for( vector<Oid>::const_iterator ci = m_key_chk.begin();
+	     ci != m_key_chk.end();
+	     ++ci )
+	{
+	    OidValueBuffer::const_iterator key_iter = embed_vals.lower_bound(*ci);
+	    if( ( key_iter == embed_vals.end() ) || !( key_iter->oid == *ci ) )
+		return m_rows.new_row();
+
+	    if( ci != m_key_chk.begin() )
+		m_key += '\0';
+	    if( key_iter->is_string() )
+		m_key.append( key_iter->str_data(), key_iter->str_size() );
+	    else
+		m_key += key_iter->str();
+	}
+
+	return m_key_chk.empty() ? m_rows.new_row() : m_rows.row(m_key);
+    }
+
+protected:
+    TableRowIndex &m_rows;
+    vector<Oid> m_key_chk;
+    string m_key;
 
 private:
     TableRowExtractor();
@@ -588,11 +1115,11 @@ struct ListRowExtractor
     : public TableRowExtractor<E>
 {
 public:
-    ListRowExtractor( string const &tblOid, RowPostfix &rowPostfix = RowPostfix(), vector<string> const &key_chk = vector<string>() )
-	: TableRowExtractor<E>( tblOid, rowPostfix, key_chk )
+    ListRowExtractor( Oid const &tblOid, TableRowIndex &rows, vector<Oid> const &key_chk = vector<Oid>() )
+	: TableRowExtractor<E>( tblOid, rows, key_chk )
     {}
 
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals)
+    virtual void operator()(BSONElement const &e, OidValueBuffer &out_vals)
     {
         BSONObjIterator i(e.Obj());
         while( i.more() )
@@ -603,571 +1130,4300 @@ public:
     }
 };
 
-Extractor *
-global_lock_extractors()
+/*
+ * serverStatus.locks: "." holds the global lock times, every other field
+ * is a database. Databases are mapped to the row listDatabases gave them
+ * in this poll, so one extractor serves all databases of all polls.
+ */
+struct LocksExtractor
+    : public Extractor
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+public:
+    LocksExtractor(TableRowIndex const &db_rows)
+	: Extractor()
+	, m_global()
+	, m_db_row()
+	, m_database(StaticAnyfix(".21.1"), m_db_row)
+	, m_db_rows(db_rows)
+    {}
 
-    extractor_map->insert( make_pair<string, Extractor *>( "totalTime", new ItemExtractor<unsigned long long>( ".10.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "lockTime", new ItemExtractor<unsigned long long>( ".10.2" ) ) );
+    virtual void operator()(BSONElement const &e, OidValueBuffer &out_vals)
+    {
+        BSONObjIterator i(e.Obj());
+        while( i.more() )
+	{
+            BSONElement elem = i.next();
+	    char const *fname = elem.fieldName();
 
-    map<string, Extractor *> *current_queue_map = new map<string, Extractor *>;
-    current_queue_map->insert( make_pair<string, Extractor *>( "total", new ItemExtractor<unsigned long long>( ".10.3.1" ) ) );
-    current_queue_map->insert( make_pair<string, Extractor *>( "readers", new ItemExtractor<unsigned long long>( ".10.3.2" ) ) );
-    current_queue_map->insert( make_pair<string, Extractor *>( "writers", new ItemExtractor<unsigned long long>( ".10.3.3" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "lockTime", new StructExtractor(current_queue_map) ) );
+	    if( 0 == strcmp( fname, "." ) )
+	    {
+		m_global(elem, out_vals);
+		continue;
+	    }
 
-    map<string, Extractor *> *active_clients_map = new map<string, Extractor *>;
-    active_clients_map->insert( make_pair<string, Extractor *>( "total", new ItemExtractor<unsigned long long>( ".10.4.1" ) ) );
-    active_clients_map->insert( make_pair<string, Extractor *>( "readers", new ItemExtractor<unsigned long long>( ".10.4.2" ) ) );
-    active_clients_map->insert( make_pair<string, Extractor *>( "writers", new ItemExtractor<unsigned long long>( ".10.4.3" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "lockTime", new StructExtractor(active_clients_map) ) );
+	    unsigned row = m_db_rows.find_seen( fname );
+	    if( row )
+	    {
+		m_db_row.setNextRow( row );
+		m_database(elem, out_vals);
+	    }
+        }
+    }
 
-    return new StructExtractor(extractor_map);
-}
+protected:
+    MibLevelExtractor<MIB_LEVEL_SERVERSTATUS_LOCKS_DOT> m_global;
+    RowPostfix m_db_row;
+    BothfixStructExtractor<MibLevelExtractor<MIB_LEVEL_SERVERSTATUS_LOCKS_ANY>, const StaticAnyfix, RowPostfix &> m_database;
+    TableRowIndex const &m_db_rows;
 
-Extractor *
-mem_extractors()
+private:
+    LocksExtractor();
+    LocksExtractor(LocksExtractor const &);
+    LocksExtractor & operator = (LocksExtractor const &);
+};
+
+MibStructExtractor *
+server_status_extractors(TableRowIndex &repl_rows, TableRowIndex const &db_rows)
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+    MibStructExtractor *extractor = new MibStructExtractor(MIB_LEVEL_SERVERSTATUS);
 
-    extractor_map->insert( make_pair<string, Extractor *>( "bits", new ItemExtractor<unsigned int>( ".11.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "resident", new ItemExtractor<unsigned long long>( ".11.2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "virtual", new ItemExtractor<unsigned long long>( ".11.3" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "supported", new ItemExtractor<unsigned long long>( ".11.4" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "mapped", new ItemExtractor<unsigned long long>( ".11.5" ) ) );
+    vector<Oid> repl_tbl;
+    repl_tbl.push_back(".2");
+    extractor->bind( MIB_HOOK_SERVERSTATUS_REPL_HOSTS,
+	new ListRowExtractor<ServReplWorkersExtractor>(".20.7", repl_rows, repl_tbl) );
+    extractor->bind( MIB_HOOK_SERVERSTATUS_REPL_ARBITERS,
+	new ListRowExtractor<ServReplArbiterExtractor>(".20.7", repl_rows, repl_tbl) );
+    extractor->bind( MIB_HOOK_SERVERSTATUS_LOCKS, new LocksExtractor(db_rows) );
 
-    return new StructExtractor(extractor_map);
+    return extractor;
 }
 
-Extractor *
-connections_extractors()
+MibStructExtractor *
+repl_set_status_extractors(TableRowIndex &repl_rows)
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+    MibStructExtractor *extractor = new MibStructExtractor(MIB_LEVEL_REPLSETGETSTATUS);
 
-    extractor_map->insert( make_pair<string, Extractor *>( "current", new ItemExtractor<unsigned int>( ".12.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "available", new ItemExtractor<unsigned long long>( ".12.2" ) ) );
+    vector<Oid> repl_tbl;
+    repl_tbl.push_back(".2");
+    extractor->bind( MIB_HOOK_REPLSETGETSTATUS_MEMBERS,
+	new ListRowExtractor<MibLevelExtractor<MIB_LEVEL_REPLSETGETSTATUS_MEMBERS_ROW> >(".20.7", repl_rows, repl_tbl) );
 
-    return new StructExtractor(extractor_map);
+    return extractor;
 }
 
-Extractor *
-bg_flush_extractors()
+MibStructExtractor *
+databases_extractors(TableRowIndex &db_rows)
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+    MibStructExtractor *extractor = new MibStructExtractor(MIB_LEVEL_LISTDATABASES);
 
-    extractor_map->insert( make_pair<string, Extractor *>( "flushes", new ItemExtractor<unsigned long long>( ".13.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "total_ms", new ItemExtractor<unsigned long long>( ".13.2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "average_ms", new ItemExtractor<unsigned long long>( ".13.3" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "last_ms", new ItemExtractor<unsigned long long>( ".13.4" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "last_finished", new ItemExtractor<unsigned long long>( ".13.5" ) ) );
+    vector<Oid> db_tbl;
+    db_tbl.push_back(".1");
+    extractor->bind( MIB_HOOK_LISTDATABASES_DATABASES,
+	new ListRowExtractor<MibLevelExtractor<MIB_LEVEL_LISTDATABASES_DATABASES_ROW> >(".21", db_rows, db_tbl) );
 
-    return new StructExtractor(extractor_map);
+    return extractor;
 }
 
-Extractor *
-cursors_extractors()
+/*
+ * Where the extractors bound to the hooks above put their values: the
+ * level a hook extracts with below root, or MIB_NO_LEVEL when a hand
+ * written extractor fills root. Kept in line with the bindings, subtree
+ * requests work out the commands to run from it.
+ */
+struct MibHookFeed
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
-
-    extractor_map->insert( make_pair<string, Extractor *>( "totalOpen", new ItemExtractor<unsigned long long>( ".14.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "clientCursors_size", new ItemExtractor<unsigned long long>( ".14.2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "timedOut", new ItemExtractor<unsigned long long>( ".14.3" ) ) );
+    unsigned short hook;
+    unsigned short level;
+    char const *root;
+};
 
-    return new StructExtractor(extractor_map);
-}
+static MibHookFeed const mib_hook_feeds[] =
+{
+    { MIB_HOOK_SERVERSTATUS_LOCKS, MIB_LEVEL_SERVERSTATUS_LOCKS_DOT, "" },
+    { MIB_HOOK_SERVERSTATUS_LOCKS, MIB_LEVEL_SERVERSTATUS_LOCKS_ANY, ".21.1" },
+    { MIB_HOOK_SERVERSTATUS_REPL_HOSTS, MIB_NO_LEVEL, ".20.7.1" },
+    { MIB_HOOK_SERVERSTATUS_REPL_ARBITERS, MIB_NO_LEVEL, ".20.7.1" },
+    { MIB_HOOK_REPLSETGETSTATUS_MEMBERS, MIB_LEVEL_REPLSETGETSTATUS_MEMBERS_ROW, ".20.7.1" },
+    { MIB_HOOK_LISTDATABASES_DATABASES, MIB_LEVEL_LISTDATABASES_DATABASES_ROW, ".21.1" },
+};
 
-Extractor *
-network_extractors()
+/* adds the OIDs (below root, without table rows) the values of a level go to */
+void
+level_feeds(unsigned level, Oid const &root, vector<Oid> &feeds)
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+    MibLevel const &lvl = mib_levels[level];
+    for( unsigned f = lvl.first_field; f < lvl.first_field + lvl.n_fields; ++f )
+    {
+	MibField const &field = mib_fields[f];
+	switch( field.kind )
+	{
+	    case MIB_ITEM:
+		for( unsigned e = field.first_emit; e < field.first_emit + field.n_emits; ++e )
+		    feeds.push_back( root + Oid( mib_emits[e].arcs, mib_emits[e].arcs + mib_emits[e].n_arcs ) );
+		break;
 
-    extractor_map->insert( make_pair<string, Extractor *>( "bytesIn", new ItemExtractor<unsigned long long>( ".15.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "bytesOut", new ItemExtractor<unsigned long long>( ".15.2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "numRequests", new ItemExtractor<unsigned long long>( ".15.3" ) ) );
+	    case MIB_STRUCT:
+		level_feeds(field.level, root, feeds);
+		break;
 
-    return new StructExtractor(extractor_map);
+	    case MIB_TABLE:
+		for( size_t h = 0; h < sizeof(mib_hook_feeds) / sizeof(mib_hook_feeds[0]); ++h )
+		{
+		    MibHookFeed const &hook = mib_hook_feeds[h];
+		    if( hook.hook != field.hook )
+			continue;
+		    if( MIB_NO_LEVEL == hook.level )
+			feeds.push_back( Oid(hook.root) );
+		    else
+			level_feeds(hook.level, root + Oid(hook.root), feeds);
+		}
+		break;
+	}
+    }
 }
 
-Extractor *
-opcounters_extractors()
+/* commands of a poll, bit 1 << command of a command set */
+enum PollCommand
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+    COMMAND_LIST_DATABASES,
+    COMMAND_DBSTATS,
+    COMMAND_SERVER_STATUS,
+    COMMAND_REPL_SET_STATUS,
+    COMMAND_COLL_STATS,
+    COMMAND_COUNT
+};
 
-    extractor_map->insert( make_pair<string, Extractor *>( "insert", new ItemExtractor<unsigned long long>( ".16.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "query", new ItemExtractor<unsigned long long>( ".16.2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "update", new ItemExtractor<unsigned long long>( ".16.3" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "delete", new ItemExtractor<unsigned long long>( ".16.4" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "getmore", new ItemExtractor<unsigned long long>( ".16.5" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "command", new ItemExtractor<unsigned long long>( ".16.6" ) ) );
+static char const * const poll_command_names[COMMAND_COUNT] = {
+    "listDatabases", "dbstats", "serverStatus", "replSetGetStatus", "collStats"
+};
 
-    return new StructExtractor(extractor_map);
-}
+#define ALL_COMMANDS ( ( 1U << COMMAND_COUNT ) - 1 )
 
-Extractor *
-asserts_extractors()
+inline bool
+runs(unsigned commands, PollCommand command)
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
-
-    extractor_map->insert( make_pair<string, Extractor *>( "regular", new ItemExtractor<unsigned long long>( ".17.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "warning", new ItemExtractor<unsigned long long>( ".17.2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "msg", new ItemExtractor<unsigned long long>( ".17.3" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "user", new ItemExtractor<unsigned long long>( ".17.4" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "rollovers", new ItemExtractor<unsigned long long>( ".17.5" ) ) );
-
-    return new StructExtractor(extractor_map);
+    return 0 != ( commands & ( 1U << command ) );
 }
 
-Extractor *
-record_stats_extractors()
+/*
+ * OID subtrees asked for by --subtree or a daemon request, none for all
+ * of them. A command is run when it feeds an OID in or above one of the
+ * subtrees; the rates (.98) need serverStatus, anything of the database
+ * table (.21) the rows of listDatabases, its dbstats age column (.21.1.18)
+ * dbstats, the collection and index tables
+ * (.22, .23) listDatabases and the collStats round robin.
+ */
+class Subtrees
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+public:
+    Subtrees()
+	: m_roots()
+    {
+	level_feeds( MIB_LEVEL_LISTDATABASES, Oid(), m_feeds[COMMAND_LIST_DATABASES] );
+	level_feeds( MIB_LEVEL_DBSTATS, Oid(".21.1"), m_feeds[COMMAND_DBSTATS] );
+	m_feeds[COMMAND_DBSTATS].push_back( Oid(".21.1.18") ); // the age of the dbstats, sent by the poller
+	level_feeds( MIB_LEVEL_SERVERSTATUS, Oid(), m_feeds[COMMAND_SERVER_STATUS] );
+	level_feeds( MIB_LEVEL_REPLSETGETSTATUS, Oid(), m_feeds[COMMAND_REPL_SET_STATUS] );
+	m_feeds[COMMAND_COLL_STATS].push_back( Oid(".22") );
+	m_feeds[COMMAND_COLL_STATS].push_back( Oid(".23") );
+    }
 
-    extractor_map->insert( make_pair<string, Extractor *>( "accessesNotInMemory", new ItemExtractor<unsigned long long>( ".18.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "pageFaultExceptionsThrown", new ItemExtractor<unsigned long long>( ".18.2" ) ) );
+    /* comma separated OIDs, throws invalid_argument for a malformed one */
+    void add(string const &list)
+    {
+	string::size_type start = 0;
+	while( start <= list.size() )
+	{
+	    string::size_type comma = list.find(',', start);
+	    if( string::npos == comma )
+		comma = list.size();
+	    if( comma > start )
+		m_roots.push_back( Oid( list.substr(start, comma - start) ) );
+	    start = comma + 1;
+	}
+    }
 
-    return new StructExtractor(extractor_map);
-}
+    bool empty() const { return m_roots.empty(); }
+    vector<Oid> const & roots() const { return m_roots; }
 
-struct LocksExtractor
-    : public StructExtractor
-{
-public:
-    LocksExtractor(int row)
-	: StructExtractor(get_extractor_map(row))
-    {}
+    /* the same for the same subtrees in any order, empty for all */
+    string key() const
+    {
+	vector<string> dotted;
+	for( vector<Oid>::const_iterator ci = m_roots.begin(); ci != m_roots.end(); ++ci )
+	    dotted.push_back( ci->str() );
+	std::sort( dotted.begin(), dotted.end() );
+	dotted.erase( std::unique( dotted.begin(), dotted.end() ), dotted.end() );
+
+	string key;
+	for( vector<string>::const_iterator ci = dotted.begin(); ci != dotted.end(); ++ci )
+	    key += ( key.empty() ? "" : "," ) + *ci;
+	return key;
+    }
 
-protected:
-    static map<string, Extractor *> *
-    get_extractor_map(int row)
+    /* whether anything in or above oid is asked for */
+    bool overlaps(Oid const &oid) const
     {
-	map<string, Extractor *> *overall_map = new map<string, Extractor *>;
+	if( m_roots.empty() )
+	    return true;
 
-	if( 0 == row )
+	for( vector<Oid>::const_iterator ci = m_roots.begin(); ci != m_roots.end(); ++ci )
 	{
-	    map<string, Extractor *> *details_map = new map<string, Extractor *>;
-	    details_map->insert( make_pair<string, Extractor *>( "R", new ItemExtractor<unsigned long long>( ".19.1.1" ) ) );
-	    details_map->insert( make_pair<string, Extractor *>( "W", new ItemExtractor<unsigned long long>( ".19.1.2" ) ) );
-	    overall_map->insert( make_pair<string, Extractor *>( "timeLockedMicros", new StructExtractor(details_map) ) );
-
-	    details_map = new map<string, Extractor *>;
-	    details_map->insert( make_pair<string, Extractor *>( "R", new ItemExtractor<unsigned long long>( ".19.2.1" ) ) );
-	    details_map->insert( make_pair<string, Extractor *>( "W", new ItemExtractor<unsigned long long>( ".19.2.2" ) ) );
-	    overall_map->insert( make_pair<string, Extractor *>( "timeAcquiringMicros", new StructExtractor(details_map) ) );
+	    if( ci->is_prefix_of(oid) || oid.is_prefix_of(*ci) )
+		return true;
 	}
-	else
-	{
-	    map<string, Extractor *> *details_map = new map<string, Extractor *>;
-	    details_map->insert( make_pair<string, Extractor *>( "r", new ItemExtractor<unsigned long long>( ".21.1.14." + lexical_cast<string>(row) ) ) );
-	    details_map->insert( make_pair<string, Extractor *>( "w", new ItemExtractor<unsigned long long>( ".21.1.15." + lexical_cast<string>(row) ) ) );
-	    overall_map->insert( make_pair<string, Extractor *>( "timeLockedMicros", new StructExtractor(details_map) ) );
 
-	    details_map = new map<string, Extractor *>;
-	    details_map->insert( make_pair<string, Extractor *>( "r", new ItemExtractor<unsigned long long>( ".21.1.16." + lexical_cast<string>(row) ) ) );
-	    details_map->insert( make_pair<string, Extractor *>( "w", new ItemExtractor<unsigned long long>( ".21.1.17." + lexical_cast<string>(row) ) ) );
-	    overall_map->insert( make_pair<string, Extractor *>( "timeAcquiringMicros", new StructExtractor(details_map) ) );
-	}
+	return false;
+    }
+
+    unsigned commands() const
+    {
+	if( m_roots.empty() )
+	    return ALL_COMMANDS;
 
-	return overall_map;
+	unsigned commands = 0;
+	for( vector<Oid>::const_iterator ci = m_roots.begin(); ci != m_roots.end(); ++ci )
+	    commands |= feeding(*ci);
+	return commands;
     }
-};
 
+protected:
+    vector<Oid> m_roots;
+    vector<Oid> m_feeds[COMMAND_COUNT];
 
-Extractor *
-locks_extractors(vector<string> const &dbnames)
-{
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+    unsigned feeding(Oid const &root) const
+    {
+	Oid const rates(".98"), databases(".21");
+	if( rates.is_prefix_of(root) )
+	{
+	    Oid const counter( root.arcs + 1, root.arcs + root.size() );
+	    unsigned commands = 1U << COMMAND_SERVER_STATUS;
+	    if( databases.is_prefix_of(counter) || counter.is_prefix_of(databases) )
+		commands |= 1U << COMMAND_LIST_DATABASES;
+	    return commands;
+	}
 
-    extractor_map->insert( make_pair<string, Extractor *>( ".", new LocksExtractor(0) ) );
-    unsigned row = 1;
-    for( vector<string>::const_iterator ci = dbnames.begin(); ci != dbnames.end(); ++ci, ++row )
-	extractor_map->insert( make_pair<string, Extractor *>( *ci, new LocksExtractor(row) ) );
+	unsigned commands = 0;
+	for( unsigned c = 0; c < COMMAND_COUNT; ++c )
+	{
+	    for( vector<Oid>::const_iterator ci = m_feeds[c].begin(); ci != m_feeds[c].end(); ++ci )
+	    {
+		if( ci->is_prefix_of(root) || root.is_prefix_of(*ci) )
+		{
+		    commands |= 1U << c;
+		    break;
+		}
+	    }
+	}
 
-    return new StructExtractor(extractor_map);
-}
+	if( databases.is_prefix_of(root) || root.is_prefix_of(databases) || runs(commands, COMMAND_COLL_STATS) )
+	    commands |= 1U << COMMAND_LIST_DATABASES;
+	return commands;
+    }
+};
 
-StructExtractor *
-serv_info_repl_extractors()
+/*
+ * Phases of a poll, row i + 1 of .99.5 (and of .99.6 for the phases
+ * running commands against mongod).
+ */
+enum PollPhase
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
-
-    extractor_map->insert( make_pair<string, Extractor *>( "setName", new ItemExtractor<string>( ".20.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "ismaster", new ItemExtractor<int>( ".20.2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "secondary", new ItemExtractor<int>( ".20.3" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "me", new ItemExtractor<string>( ".20.4" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "primary", new ItemExtractor<string>( ".20.5" ) ) );
+    PHASE_CONNECT,
+    PHASE_AUTH,
+    PHASE_LIST_DATABASES,
+    PHASE_DBSTATS,
+    PHASE_SERVER_STATUS,
+    PHASE_REPL_SET_STATUS,
+    PHASE_EXTRACT,
+    PHASE_SERIALIZE,
+    PHASE_COLL_STATS,
+    PHASE_COUNT
+};
 
-    static RowPostfix repl_rows;
-    vector<string> repl_tbl;
-    repl_tbl.push_back(".2");
-    extractor_map->insert( make_pair<string, Extractor *>(
-	"hosts", new ListRowExtractor<ServReplWorkersExtractor>(".20.7", repl_rows, repl_tbl) ) );
-    extractor_map->insert( make_pair<string, Extractor *>(
-	"arbiters", new ListRowExtractor<ServReplArbiterExtractor>(".20.7", repl_rows, repl_tbl) ) );
+static char const * const poll_phase_names[PHASE_COUNT] = {
+    "connect", "auth", "listDatabases", "dbstats", "serverStatus", "replSetGetStatus", "extraction", "serialisation", "collStats"
+};
 
-    return new StructExtractor(extractor_map);
+void
+report_phase(PollPhase phase, boost::timer::cpu_times const &t, OidValueBuffer &out_vals)
+{
+    Oid const entry(".99.5.1");
+    unsigned const row = phase + 1;
+    char const *name = poll_phase_names[phase];
+
+    out_vals.append( OidValueTuple( entry + 1 + row, ASN_OCTET_STR ).set_string_ref( name, strlen(name) ) );
+    out_vals.append( OidValueTuple( entry + 2 + row, SMI_COUNTER64 ).set_uint64( t.wall ) );
+    out_vals.append( OidValueTuple( entry + 3 + row, SMI_COUNTER64 ).set_uint64( t.user ) );
+    out_vals.append( OidValueTuple( entry + 4 + row, SMI_COUNTER64 ).set_uint64( t.system ) );
 }
 
-Extractor *
-repl_network_queue_extractors()
+/*
+ * Where the time of one poll went: wall and CPU time summed per phase and
+ * the wall time of every command run. CPU times are those of the whole
+ * process, they include dbstats workers and other instances polled
+ * meanwhile.
+ */
+class PollTimes
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+public:
+    PollTimes()
+    {
+	clear();
+    }
 
-    extractor_map->insert( make_pair<string, Extractor *>( "waitTimeMs", new ItemExtractor<unsigned long long>( ".20.6.1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "numElems", new ItemExtractor<unsigned long long>( ".20.6.2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "numBytes", new ItemExtractor<unsigned long long>( ".20.6.3" ) ) );
+    void clear()
+    {
+	for( unsigned p = 0; p < PHASE_COUNT; ++p )
+	{
+	    m_phases[p].clear();
+	    m_measured[p] = false;
+	    m_latencies[p].clear();
+	}
+    }
 
-    return new StructExtractor(extractor_map);
-}
+    void add(PollPhase phase, boost::timer::cpu_times const &t)
+    {
+	m_phases[phase].wall += t.wall;
+	m_phases[phase].user += t.user;
+	m_phases[phase].system += t.system;
+	m_measured[phase] = true;
+    }
 
-StructExtractor *
-server_status_extractors(vector<string> const &dbnames)
-{
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
-
-    extractor_map->insert( make_pair<string, Extractor *>( "host", new ItemExtractor<string>( ".1" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "version", new ItemExtractor<string>( ".2" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "process", new ItemExtractor<string>( ".3" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "pid", new ItemExtractor<int>( ".4" ) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "uptimeMillis", new ItemExtractor<unsigned long long>( ".5" ) ) );
-
-    extractor_map->insert( make_pair<string, Extractor *>( "globalLock", global_lock_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "mem", mem_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "connections", connections_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "backgroundFlushing", bg_flush_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "cursors", cursors_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "network", network_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "opcounters", opcounters_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "asserts", asserts_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "recordStats", record_stats_extractors() ) );
-
-/*  XXX
-		if( serv_status.hasField("locks") && serv_status["locks"].Obj().hasField(dbname.value.c_str()) );
-		{
-		    BSONObj dbl = serv_status["locks"].Obj().getField(dbname.value).Obj();
+    void add_latency(PollPhase phase, boost::timer::nanosecond_type wall)
+    {
+	m_latencies[phase].push_back(wall);
+    }
 
-		    if( dbl.hasField("timeLockedMicros") )
-		    {
-			BSONObj o3 = dbl["timeLockedMicros"].Obj();
+    void add_latencies(PollPhase phase, vector<boost::timer::nanosecond_type> const &walls)
+    {
+	m_latencies[phase].insert( m_latencies[phase].end(), walls.begin(), walls.end() );
+    }
 
-			if( o3.hasField("r") )
-			    out_vals.insert( extract_uint64( o3["r"], string(".21.1.14.") + row_str ) );
-			if( o3.hasField("w") )
-			    out_vals.insert( extract_uint64( o3["w"], string(".21.1.15.") + row_str ) );
-		    }
+    vector<boost::timer::nanosecond_type> const & latencies(PollPhase phase) const { return m_latencies[phase]; }
 
-		    if( dbl.hasField("timeAcquiringMicros") )
-		    {
-			BSONObj o3 = dbl["timeAcquiringMicros"].Obj();
+    /* adds the times a command thread measured on its own */
+    void merge(PollTimes const &other)
+    {
+	for( unsigned p = 0; p < PHASE_COUNT; ++p )
+	{
+	    if( other.m_measured[p] )
+		add( static_cast<PollPhase>(p), other.m_phases[p] );
+	    add_latencies( static_cast<PollPhase>(p), other.m_latencies[p] );
+	}
+    }
 
-			if( o3.hasField("r") )
-			    out_vals.insert( extract_uint64( o3["r"], string(".21.1.16.") + row_str ) );
-			if( o3.hasField("w") )
-			    out_vals.insert( extract_uint64( o3["w"], string(".21.1.17.") + row_str ) );
-		    }
-		}
-*/
-    extractor_map->insert( make_pair<string, Extractor *>( "locks", locks_extractors(dbnames) ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "repl", serv_info_repl_extractors() ) );
-    extractor_map->insert( make_pair<string, Extractor *>( "replNetworkQueue", repl_network_queue_extractors() ) );
-    // extractor_map->insert( make_pair<string, Extractor *>( "indexCounters", index_cOunters_extractors() ) );
+    void report(OidValueBuffer &out_vals) const
+    {
+	for( unsigned p = 0; p < PHASE_COUNT; ++p )
+	{
+	    if( m_measured[p] )
+		report_phase( static_cast<PollPhase>(p), m_phases[p], out_vals );
+	}
+    }
 
-    return new StructExtractor(extractor_map);
-}
+protected:
+    boost::timer::cpu_times m_phases[PHASE_COUNT];
+    bool m_measured[PHASE_COUNT];
+    vector<boost::timer::nanosecond_type> m_latencies[PHASE_COUNT];
+};
 
-template<class T1, class T2>
-struct DualItemExtractor
-    : public Extractor
+/*
+ * Adds the time until the end of the scope to a phase, for a command also
+ * as one latency sample.
+ */
+class PhaseTimer
 {
 public:
-    DualItemExtractor(string const &oid1, string const &oid2)
-	: Extractor()
-	, m_oid1(oid1)
-	, m_oid2(oid2)
+    PhaseTimer(PollTimes &times, PollPhase phase, bool command = false)
+	: m_times(times)
+	, m_phase(phase)
+	, m_command(command)
+	, m_timer()
     {}
 
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals)
+    ~PhaseTimer()
     {
-	out_vals.insert( extract<T1>( e, m_oid1 ) );
-	out_vals.insert( extract<T2>( e, m_oid2 ) );
+	m_timer.stop();
+	boost::timer::cpu_times const t = m_timer.elapsed();
+	m_times.add(m_phase, t);
+	if( m_command )
+	    m_times.add_latency(m_phase, t.wall);
     }
 
 protected:
-    string const m_oid1;
-    string const m_oid2;
+    PollTimes &m_times;
+    PollPhase const m_phase;
+    bool const m_command;
+    boost::timer::cpu_timer m_timer;
 
 private:
-    DualItemExtractor();
+    PhaseTimer();
+    PhaseTimer(PhaseTimer const &);
+    PhaseTimer & operator = (PhaseTimer const &);
 };
 
-struct ReplSetMemberRowExtractor
-    : public StructExtractor
+/*
+ * Log-linear latency histogram: every power of two is split into 8
+ * linear buckets, so a quantile is off by at most 12.5 % while the
+ * histogram keeps a fixed size for any range of nanoseconds.
+ */
+class LatencyHistogram
 {
 public:
-    ReplSetMemberRowExtractor()
-	: StructExtractor(get_extractor_map())
-    {}
-
-protected:
-    static map<string, Extractor *> *
-    get_extractor_map()
+    enum
     {
-	map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
-
-	extractor_map->insert( make_pair<string, Extractor *>( "_id", new ItemExtractor<unsigned>( ".1" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "name", new ItemExtractor<string>( ".2" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "health", new ItemExtractor<double>( ".3" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "state", new ItemExtractor<unsigned>( ".4" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "stateStr", new ItemExtractor<string>( ".5" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "uptime", new ItemExtractor<unsigned long long>( ".6" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>(
-	    "optime", new DualItemExtractor<unsigned long long, unsigned>( ".7", ".8" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "pingMs", new ItemExtractor<unsigned long long>( ".9" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "lastHeartbeat", new ItemExtractor<unsigned long long>( ".10" ) ) );
+	SUB_BITS = 3,
+	SUB_BUCKETS = 1 << SUB_BITS,
+	BUCKETS = 64 * SUB_BUCKETS
+    };
+
+    LatencyHistogram()
+	: m_count(0)
+	, m_max(0)
+    {
+	std::fill( m_buckets, m_buckets + BUCKETS, 0ULL );
+    }
 
-	return extractor_map;
+    void add(unsigned long long v)
+    {
+	++m_buckets[bucket(v)];
+	++m_count;
+	if( v > m_max )
+	    m_max = v;
     }
-};
 
-StructExtractor *
-repl_set_status_extractors()
-{
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+    unsigned long long count() const { return m_count; }
+    unsigned long long max() const { return m_max; }
 
-    static RowPostfix repl_rows;
-    vector<string> repl_tbl;
-    repl_tbl.push_back(".2");
-    extractor_map->insert( make_pair<string, Extractor *>(
-	"members", new ListRowExtractor<ReplSetMemberRowExtractor>(".20.7", repl_rows, repl_tbl) ) );
+    /* upper bound of the bucket holding the q quantile */
+    unsigned long long quantile(double q) const
+    {
+	if( !m_count )
+	    return 0;
 
-    return new StructExtractor(extractor_map);
-}
+	// nearest rank
+	unsigned long long const rank = std::max( 1ULL, static_cast<unsigned long long>( std::ceil( q * m_count ) ) );
+	unsigned long long seen = 0;
+	for( unsigned b = 0; b < BUCKETS; ++b )
+	{
+	    seen += m_buckets[b];
+	    if( seen >= rank )
+		return std::min( bucket_upper(b), m_max );
+	}
 
-struct DatabasesMemberRowExtractor
-    : public StructExtractor
-{
-public:
-    DatabasesMemberRowExtractor()
-	: StructExtractor(get_extractor_map())
-	, m_conn(NULL)
-	, m_cmd(BSONObjBuilder().append("dbstats", 1).obj())
-	, m_dbinfo()
-	, m_dbextractor(get_dbinfo_map())
-    {}
+	return m_max;
+    }
 
-    DatabasesMemberRowExtractor(DBClientConnection *conn)
-	: StructExtractor(get_extractor_map())
-	, m_conn(conn)
-	, m_cmd(BSONObjBuilder().append("dbstats", 1).obj())
-	, m_dbinfo()
-	, m_dbextractor(get_dbinfo_map())
-    {}
+protected:
+    unsigned long long m_buckets[BUCKETS];
+    unsigned long long m_count;
+    unsigned long long m_max;
 
-    virtual void operator()(BSONElement const &e, set<OidValueTuple> &out_vals)
+    static unsigned bucket(unsigned long long v)
     {
-	StructExtractor::operator() (e, out_vals);
+	if( v < SUB_BUCKETS )
+	    return static_cast<unsigned>(v);
 
-	OidValueTuple search_key( ".1" ); // ASN.1 type doesn't matter, only OID
-	set<OidValueTuple>::iterator cmp_iter = out_vals.lower_bound(search_key);
-	if( m_conn && (cmp_iter != out_vals.end()) )
-	{
-	    m_conn->runCommand(cmp_iter->value, m_cmd, m_dbinfo);
-	    m_dbextractor(m_dbinfo, out_vals);
-	}
+	unsigned msb = SUB_BITS;
+	for( unsigned long long rest = v >> ( SUB_BITS + 1 ); rest; rest >>= 1 )
+	    ++msb;
+
+	unsigned const shift = msb - SUB_BITS;
+	return ( ( shift + 1 ) << SUB_BITS ) + static_cast<unsigned>( ( v >> shift ) & ( SUB_BUCKETS - 1 ) );
     }
 
-    virtual void operator()(BSONObj const &o, set<OidValueTuple> &out_vals)
+    static unsigned long long bucket_upper(unsigned b)
     {
-	StructExtractor::operator() (o, out_vals);
+	if( b < SUB_BUCKETS )
+	    return b;
+
+	unsigned const shift = ( b >> SUB_BITS ) - 1;
+	unsigned long long const first = SUB_BUCKETS | ( b & ( SUB_BUCKETS - 1 ) );
+	// wraps to the largest value for the topmost bucket
+	return ( ( first + 1 ) << shift ) - 1;
+    }
+};
 
-	OidValueTuple search_key( ".1" ); // ASN.1 type doesn't matter, only OID
-	set<OidValueTuple>::iterator cmp_iter = out_vals.lower_bound(search_key);
-	if( m_conn && (cmp_iter != out_vals.end()) )
+bool
+write_all(int fd, char const *p, size_t left)
+{
+    while( left )
+    {
+	ssize_t n = write( fd, p, left );
+	if( n < 0 )
 	{
-	    m_conn->runCommand(cmp_iter->value, m_cmd, m_dbinfo);
-	    m_dbextractor(m_dbinfo, out_vals);
+	    if( EINTR == errno )
+		continue;
+	    return false;
 	}
+	p += n;
+	left -= n;
     }
 
-    void set_conn(DBClientConnection *conn) { m_conn = conn; }
+    return true;
+}
 
-protected:
-    DBClientConnection *m_conn;
-    BSONObj m_cmd, m_dbinfo;
-    StructExtractor m_dbextractor;
+/*
+ * Capture of command replies (--record, --replay): the magic line below
+ * followed by one record per command run, made of the database name and
+ * the command name as NUL terminated strings and the raw reply BSON,
+ * which carries its own length.
+ */
+#define CAPTURE_MAGIC "mongodb-stats-capture-1\n"
 
-    static map<string, Extractor *> *
-    get_extractor_map()
+class CaptureWriter
+{
+public:
+    CaptureWriter(string const &path)
+	: m_path(path)
+	, m_fd( open( path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644 ) )
+	, m_mtx()
     {
-	map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+	if( m_fd < 0 )
+	    throw runtime_error( "can't open capture '" + path + "': " + strerror(errno) );
 
-	extractor_map->insert( make_pair<string, Extractor *>( "name", new ItemExtractor<string>( ".1" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "sizeOnDisk", new ItemExtractor<unsigned long long>( ".2" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "empty", new ItemExtractor<int>( ".3" ) ) );
+	struct stat st;
+	if( ( 0 == fstat( m_fd, &st ) ) && ( 0 == st.st_size ) )
+	    write_record( string(CAPTURE_MAGIC) );
+    }
 
-	return extractor_map;
+    ~CaptureWriter()
+    {
+	close(m_fd);
     }
 
-    static map<string, Extractor *> *
-    get_dbinfo_map()
+    void append(string const &dbname, char const *cmdname, BSONObj const &reply)
     {
-	map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
+	string rec;
+	rec.reserve( dbname.size() + strlen(cmdname) + 2 + reply.objsize() );
+	rec.append( dbname.c_str(), dbname.size() + 1 );
+	rec.append( cmdname, strlen(cmdname) + 1 );
+	rec.append( reply.objdata(), reply.objsize() );
+
+	write_record(rec);
+    }
 
-	extractor_map->insert( make_pair<string, Extractor *>( "collections", new ItemExtractor<unsigned long long>( ".4" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "objects", new ItemExtractor<unsigned long long>( ".5" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "avgObjSize", new ItemExtractor<double>( ".6" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "dataSize", new ItemExtractor<unsigned long long>( ".7" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "storageSize", new ItemExtractor<unsigned long long>( ".8" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "numExtents", new ItemExtractor<unsigned>( ".9" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "indexes", new ItemExtractor<unsigned>( ".10" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "sizeOnDisk", new ItemExtractor<unsigned>( ".11" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "fileSize", new ItemExtractor<unsigned long long>( ".12" ) ) );
-	extractor_map->insert( make_pair<string, Extractor *>( "nsSizeMB", new ItemExtractor<unsigned>( ".13" ) ) );
+protected:
+    string const m_path;
+    int const m_fd;
+    boost::mutex m_mtx;
 
-	return extractor_map;
+    /* dbstats workers record concurrently, a record goes out with one write */
+    void write_record(string const &rec)
+    {
+	boost::lock_guard<boost::mutex> lock(m_mtx);
+	if( !write_all( m_fd, rec.data(), rec.size() ) )
+	    cerr << "writing capture '" << m_path << "' failed: " << strerror(errno) << endl;
     }
+
+private:
+    CaptureWriter();
+    CaptureWriter(CaptureWriter const &);
+    CaptureWriter & operator = (CaptureWriter const &);
 };
 
-StructExtractor *
-databases_extractors(DBClientConnection &conn)
+/*
+ * A capture mapped into memory. The replies of a command on a database
+ * are handed out in recorded order and start over at the end, so a
+ * capture of several polls replays them all and then repeats.
+ */
+class CaptureReplay
 {
-    map<string, Extractor *> *extractor_map = new map<string, Extractor *>;
-
-    static RowPostfix db_rows;
-    vector<string> db_tbl;
-    db_tbl.push_back(".1");
-    ListRowExtractor<DatabasesMemberRowExtractor> *lre = new ListRowExtractor<DatabasesMemberRowExtractor>(".21", db_rows, db_tbl);
-    lre->set_conn(&conn);
-    extractor_map->insert( make_pair<string, Extractor *>( "databases", lre ) );
+public:
+    CaptureReplay(string const &path)
+	: m_path(path)
+	, m_data(0)
+	, m_size(0)
+	, m_replies()
+	, m_mtx()
+    {
+	int fd = open( path.c_str(), O_RDONLY );
+	if( fd < 0 )
+	    throw runtime_error( "can't open capture '" + path + "': " + strerror(errno) );
 
-    return new StructExtractor(extractor_map);
-}
+	struct stat st;
+	if( 0 != fstat( fd, &st ) )
+	{
+	    close(fd);
+	    throw runtime_error( "can't stat capture '" + path + "': " + strerror(errno) );
+	}
+	m_size = st.st_size;
 
-void
-collect(DBClientConnection &c, set<OidValueTuple> &out_vals)
-{
-    BSONObj serv_status, dbases, repl_info, cmd;
-    StructExtractor *bson_extractor = 0;
+	void *data = m_size ? mmap( 0, m_size, PROT_READ, MAP_PRIVATE, fd, 0 ) : MAP_FAILED;
+	close(fd);
+	if( MAP_FAILED == data )
+	    throw runtime_error( "can't map capture '" + path + "'" );
+	m_data = static_cast<char const *>(data);
 
-    cmd = BSONObjBuilder().append("listDatabases", 1).obj();
-    c.runCommand(DBNAME, cmd, dbases);
+	try
+	{
+	    index();
+	}
+	catch(...)
+	{
+	    munmap( const_cast<char *>(m_data), m_size );
+	    throw;
+	}
+    }
 
-    bson_extractor = databases_extractors(c);
-    (*bson_extractor)(dbases, out_vals);
+    ~CaptureReplay()
+    {
+	munmap( const_cast<char *>(m_data), m_size );
+    }
 
-    // XXX extract row + dbname for serv_status.locks[]
-    vector<string> database_names;
-    OidValueTuple search_key(".21.1.1.");
-    for( set<OidValueTuple>::iterator cmp_iter = out_vals.lower_bound(search_key);
-         ( cmp_iter != out_vals.end() ) && ( 0 == cmp_iter->oid.compare( 0, search_key.oid.length(), search_key.oid ) );
-	 ++cmp_iter )
+    /* reply refers into the mapping, false when the command was not recorded */
+    bool next(string const &dbname, char const *cmdname, BSONObj &reply)
     {
-	database_names.push_back(cmp_iter->value);
+	string key( dbname );
+	key += '\0';
+	key += cmdname;
+
+	boost::lock_guard<boost::mutex> lock(m_mtx);
+	boost::unordered_map<string, Replies>::iterator i = m_replies.find(key);
+	if( i == m_replies.end() )
+	    return false;
+
+	Replies &replies = i->second;
+	reply = BSONObj( replies.records[replies.next] );
+	replies.next = ( replies.next + 1 ) % replies.records.size();
+	return true;
     }
 
-    cmd = BSONObjBuilder().append( "serverStatus", 1 ).obj();
-    c.runCommand(DBNAME, cmd, serv_status);
+protected:
+    struct Replies
+    {
+	Replies() : records(), next(0) {}
 
-    bson_extractor = server_status_extractors(database_names);
-    (*bson_extractor)(serv_status, out_vals);
+	vector<char const *> records;
+	size_t next;
+    };
 
-    cmd = BSONObjBuilder().append("replSetGetStatus", 1).obj();
-    c.runCommand(DBNAME, cmd, repl_info);
+    string const m_path;
+    char const *m_data;
+    size_t m_size;
+    boost::unordered_map<string, Replies> m_replies;
+    boost::mutex m_mtx;
 
-    bson_extractor = repl_set_status_extractors();
-    (*bson_extractor)(repl_info, out_vals);
-}
+    void index()
+    {
+	size_t const magic_len = strlen(CAPTURE_MAGIC);
+	if( ( m_size < magic_len ) || ( 0 != memcmp( m_data, CAPTURE_MAGIC, magic_len ) ) )
+	    throw runtime_error( "'" + m_path + "' is no capture" );
 
-void
-dump(set<OidValueTuple> const &out_vals)
-{
-    vector<string> result;
-    result.reserve(out_vals.size() + 2);
-    for( set<OidValueTuple>::iterator iter = out_vals.begin();
-         iter != out_vals.end();
-	 ++iter )
-    {
-	std::string s = "  [ \"";
-	
-	s += iter->oid;
-	s += "\", ";
-	s += lexical_cast<string>(iter->type);
-	s += ", ";
-	if( ASN_OCTET_STR == iter->type )
-	    s += "\"";
-	if( ASN_NULL == iter->type )
-	    s += "null";
-	else if( ASN_OCTET_STR == iter->type )
-	    s += boost::locale::conv::utf_to_utf<char>(iter->value);
-	else
-	    s += iter->value;
-	if( ASN_OCTET_STR == iter->type )
-	    s += "\"";
-	s += " ]";
+	char const *p = m_data + magic_len, *end = m_data + m_size;
+	while( p < end )
+	{
+	    char const *dbname = p;
+	    char const *cmdname = next_string(dbname, end);
+	    char const *bson = next_string(cmdname, end);
+
+	    // BSON starts with its length as little endian int32
+	    unsigned char const *len_bytes = reinterpret_cast<unsigned char const *>(bson);
+	    if( end - bson < 5 )
+		truncated();
+	    size_t len = len_bytes[0] | ( len_bytes[1] << 8 ) | ( len_bytes[2] << 16 ) | ( static_cast<size_t>(len_bytes[3]) << 24 );
+	    if( ( len < 5 ) || ( len > static_cast<size_t>( end - bson ) ) )
+		truncated();
+
+	    string key( dbname, cmdname - 1 );
+	    key += '\0';
+	    key += cmdname;
+	    m_replies[key].records.push_back(bson);
+
+	    p = bson + len;
+	}
+    }
 
-	result.push_back(s);
+    char const * next_string(char const *s, char const *end) const
+    {
+	char const *nul = static_cast<char const *>( memchr( s, '\0', end - s ) );
+	if( !nul )
+	    truncated();
+	return nul + 1;
     }
 
-    cout << "[" << endl
-	 << join(",\n", result) << endl
-	 << "]" << endl;
-}
+    void truncated() const
+    {
+	throw runtime_error( "capture '" + m_path + "' is truncated or corrupt" );
+    }
 
-int
-main(int argc, char *argv[])
+private:
+    CaptureReplay();
+    CaptureReplay(CaptureReplay const &);
+    CaptureReplay & operator = (CaptureReplay const &);
+};
+
+/*
+ * End of a poll (--poll-timeout): commands are not started after it and
+ * running ones give up at it by their socket timeout. A runner and its
+ * forks share the deadline of the poll, it is set before any thread
+ * of the poll starts.
+ */
+class PollDeadline
 {
-    try
+public:
+    PollDeadline(unsigned timeout_ms)
+	: m_timeout_ms(timeout_ms)
+	, m_until()
+    {}
+
+    /* at the start of a poll, before connecting */
+    void start()
     {
-	options_description desc("Allowed options");
-	desc.add_options()
-	    ("help", "produce help message")
-	    ("dsn", value<string>(), "set mongodb dsn")
-	    ;
-	variables_map vm;
-	store( parse_command_line( argc, argv, desc ), vm );
-	notify(vm);
+	if( m_timeout_ms )
+	    m_until = boost::get_system_time() + boost::posix_time::milliseconds(m_timeout_ms);
+    }
 
-	if( vm.count("help") )
-	{
-	    cout << desc << endl;
-	    return 1;
-	}
+    unsigned timeout_ms() const { return m_timeout_ms; }
 
-	if( vm.count("dsn") == 0 )
-	{
-	    cerr << desc << endl;
-	    return 255;
-	}
+    bool passed() const
+    {
+	return !m_until.is_not_a_date_time() && ( boost::get_system_time() >= m_until );
+    }
 
-	set<OidValueTuple> out_vals;
-	do {
-	    DBClientConnection c;
+    /* the earlier of the deadline and now + budget */
+    boost::system_time within(boost::posix_time::time_duration const &budget) const
+    {
+	boost::system_time const until = boost::get_system_time() + budget;
+	return m_until.is_not_a_date_time() ? until : std::min(until, m_until);
+    }
 
-	    boost::timer::cpu_timer db_dur;
-	    db_dur.start();
-	    connect(c, vm["dsn"].as<string>(), DBNAME, "admin");
-	    collect(c, out_vals);
-	    db_dur.stop();
+    /* socket timeout in seconds for a command started now, 0 (none) without deadline */
+    double socket_timeout() const
+    {
+	if( m_until.is_not_a_date_time() )
+	    return 0;
+	long long const left_ms = ( m_until - boost::get_system_time() ).total_milliseconds();
+	return left_ms > 0 ? left_ms / 1000.0 : 0.001;
+    }
 
-	    OidValueTuple val( ".99.1", SMI_COUNTER64 );
-	    val.value = lexical_cast<string>( db_dur.elapsed().user );
-	    out_vals.insert( val );
+protected:
+    unsigned const m_timeout_ms;
+    boost::system_time m_until;
 
-	    val.oid = ".99.2";
-	    val.value = lexical_cast<string>( db_dur.elapsed().system );
-	    out_vals.insert( val );
+private:
+    PollDeadline();
+    PollDeadline(PollDeadline const &);
+    PollDeadline & operator = (PollDeadline const &);
+};
 
-	    val.oid = ".99.3";
-	    val.value = lexical_cast<string>( db_dur.elapsed().wall );
-	    out_vals.insert( val );
-	} while(0);
+/* whether a reply tells success, like the result of runCommand */
+inline bool
+reply_ok(BSONObj const &reply)
+{
+    return reply["ok"].trueValue();
+}
+
+/*
+ * Runs the commands of a poll, against mongod or from a capture. Workers
+ * running commands in parallel fork a runner of their own. A command
+ * which can't be run leaves an empty reply; once failed() the runner is
+ * of no use any more and is replaced by its owner.
+ */
+struct CommandRunner
+{
+    virtual ~CommandRunner() {}
+
+    virtual bool run(string const &dbname, BSONObj const &cmd, BSONObj &reply) = 0;
+    virtual CommandRunner * fork() = 0;
+    virtual bool failed() const { return false; }
+};
+
+class ConnectionRunner
+    : public CommandRunner
+{
+public:
+    ConnectionRunner(string const &dsn, CaptureWriter *record, PollDeadline const &deadline)
+	: CommandRunner()
+	, m_dsn(dsn)
+	, m_conn( false, 0, deadline.socket_timeout() )
+	, m_record(record)
+	, m_deadline(deadline)
+	, m_failed(false)
+    {}
+
+    /* connects and authenticates, timing both */
+    void open(PollTimes &times)
+    {
+	{
+	    PhaseTimer timer(times, PHASE_CONNECT, true);
+	    connect(m_conn, m_dsn);
+	}
+
+	PhaseTimer timer(times, PHASE_AUTH, true);
+	authenticate(m_conn, DBNAME, "admin");
+    }
+
+    /* nothing is run past the deadline or on a failed connection */
+    virtual bool run(string const &dbname, BSONObj const &cmd, BSONObj &reply)
+    {
+	reply = BSONObj();
+	if( failed() || m_deadline.passed() )
+	    return false;
+
+	bool ok;
+	try
+	{
+	    m_conn.setSoTimeout( m_deadline.socket_timeout() );
+	    ok = m_conn.runCommand(dbname, cmd, reply);
+	}
+	catch( DBException &e )
+	{
+	    cerr << cmd.firstElement().fieldName() << " on " << m_dsn << " failed: " << e.what() << endl;
+	    reply = BSONObj();
+	    m_failed = true;
+	    return false;
+	}
+
+	if( m_record )
+	    m_record->append( dbname, cmd.firstElement().fieldName(), reply );
+	return ok;
+    }
+
+    virtual CommandRunner * fork()
+    {
+	ConnectionRunner *runner = new ConnectionRunner(m_dsn, m_record, m_deadline);
+	try
+	{
+	    connect(runner->m_conn, m_dsn, DBNAME, "admin");
+	}
+	catch( ... )
+	{
+	    delete runner;
+	    throw;
+	}
+	return runner;
+    }
+
+    virtual bool failed() const { return m_failed || m_conn.isFailed(); }
+
+protected:
+    string const m_dsn;
+    DBClientConnection m_conn;
+    CaptureWriter *m_record;
+    PollDeadline const &m_deadline;
+    bool m_failed;
+
+private:
+    ConnectionRunner();
+    ConnectionRunner(ConnectionRunner const &);
+    ConnectionRunner & operator = (ConnectionRunner const &);
+};
+
+class ReplayRunner
+    : public CommandRunner
+{
+public:
+    ReplayRunner(CaptureReplay &replay)
+	: CommandRunner()
+	, m_replay(replay)
+    {}
+
+    virtual bool run(string const &dbname, BSONObj const &cmd, BSONObj &reply)
+    {
+	if( m_replay.next( dbname, cmd.firstElement().fieldName(), reply ) )
+	    return reply_ok(reply);
+
+	reply = BSONObj();
+	return false;
+    }
+
+    virtual CommandRunner * fork() { return new ReplayRunner(m_replay); }
+
+protected:
+    CaptureReplay &m_replay;
+
+private:
+    ReplayRunner();
+    ReplayRunner(ReplayRunner const &);
+    ReplayRunner & operator = (ReplayRunner const &);
+};
+
+/* where the replies of the polls come from and go to, both may be 0 */
+struct PollSource
+{
+    PollSource(CaptureWriter *a_record = 0, CaptureReplay *a_replay = 0)
+	: record(a_record)
+	, replay(a_replay)
+    {}
+
+    CaptureWriter *record;
+    CaptureReplay *replay;
+};
+
+/* stands in for a connection which could not be opened, every command fails */
+class UnreachableRunner
+    : public CommandRunner
+{
+public:
+    UnreachableRunner()
+	: CommandRunner()
+    {}
+
+    virtual bool run(string const &, BSONObj const &, BSONObj &reply)
+    {
+	reply = BSONObj();
+	return false;
+    }
+
+    virtual CommandRunner * fork() { return new UnreachableRunner(); }
+    virtual bool failed() const { return true; }
+
+private:
+    UnreachableRunner(UnreachableRunner const &);
+    UnreachableRunner & operator = (UnreachableRunner const &);
+};
+
+/*
+ * When connecting or authenticating fails the poll still runs, on a
+ * runner failing every command, so each section is sent stale or
+ * reported missing rather than the poll giving nothing at all.
+ */
+CommandRunner *
+open_runner(string const &dsn, PollSource const &source, PollDeadline const &deadline, PollTimes &times)
+{
+    if( source.replay )
+	return new ReplayRunner(*source.replay);
+
+    ConnectionRunner *runner = new ConnectionRunner(dsn, source.record, deadline);
+    try
+    {
+	runner->open(times);
+	return runner;
+    }
+    catch( DBException &e )
+    {
+	delete runner;
+	cerr << "connecting to " << dsn << " failed: " << e.what() << endl;
+	return new UnreachableRunner();
+    }
+    catch( ... )
+    {
+	delete runner;
+	throw;
+    }
+}
+
+/*
+ * Runs dbstats for a list of databases with at most concurrency commands
+ * in flight. The first worker uses the runner of the caller, the others
+ * fork their own runners (connections) which are kept for the next run.
+ * A database whose worker fails during its dbstats is tried once more by
+ * a worker still running, without one it goes stale like the databases
+ * left at the deadline.
+ */
+class DbStatsFanout
+{
+public:
+    DbStatsFanout(unsigned concurrency)
+	: m_concurrency(concurrency ? concurrency : 1)
+	, m_cmd(BSONObjBuilder().append("dbstats", 1).obj())
+	, m_pool(m_concurrency - 1, static_cast<CommandRunner *>(0))
+	, m_runner(0)
+	, m_deadline(0)
+	, m_dbnames(0)
+	, m_dbinfos(0)
+	, m_next(0)
+	, m_retry()
+	, m_retried()
+	, m_workers(0)
+	, m_serial_dur(0)
+	, m_fanout_dur(0)
+	, m_latencies()
+    {}
+
+    ~DbStatsFanout()
+    {
+	for( vector<CommandRunner *>::iterator i = m_pool.begin(); i != m_pool.end(); ++i )
+	{
+	    delete *i;
+	    *i = 0;
+	}
+    }
+
+    void run(CommandRunner &runner, PollDeadline const &deadline, vector<string> const &dbnames, vector<BSONObj> &dbinfos)
+    {
+	boost::timer::cpu_timer fanout_dur;
+	fanout_dur.start();
+
+	dbinfos.clear();
+	dbinfos.resize(dbnames.size());
+
+	m_runner = &runner;
+	m_deadline = &deadline;
+	m_dbnames = &dbnames;
+	m_dbinfos = &dbinfos;
+	m_next = 0;
+	m_retry.clear();
+	m_retried.assign(dbnames.size(), false);
+	m_serial_dur = 0;
+	m_latencies.clear();
+	m_workers = std::min<size_t>(m_concurrency, dbnames.size());
+
+	boost::thread_group workers;
+	for( unsigned i = 1; i < m_workers; ++i )
+	    workers.create_thread( boost::bind( &DbStatsFanout::pool_worker, this, i - 1 ) );
+
+	try
+	{
+	    work(runner);
+	}
+	catch(...)
+	{
+	    workers.join_all();
+	    throw;
+	}
+	workers.join_all();
+
+	fanout_dur.stop();
+	m_fanout_dur = fanout_dur.elapsed().wall;
+    }
+
+    void report(OidValueBuffer &out_vals) const
+    {
+	out_vals.append( OidValueTuple( ".99.4.1", SMI_UINTEGER ).set_uint( m_workers ) );
+	out_vals.append( OidValueTuple( ".99.4.2", SMI_COUNTER64 ).set_uint64( m_serial_dur ) );
+	out_vals.append( OidValueTuple( ".99.4.3", SMI_COUNTER64 ).set_uint64( m_fanout_dur ) );
+	out_vals.append( OidValueTuple( ".99.4.4", SMI_COUNTER64 ).set_uint64(
+	    m_serial_dur > m_fanout_dur ? m_serial_dur - m_fanout_dur : 0 ) );
+    }
+
+    /* wall time of each dbstats round trip of the last run */
+    vector<boost::timer::nanosecond_type> const & latencies() const { return m_latencies; }
+
+protected:
+    unsigned const m_concurrency;
+    BSONObj const m_cmd;
+    vector<CommandRunner *> m_pool;
+    CommandRunner *m_runner;
+    PollDeadline const *m_deadline;
+
+    boost::mutex m_mtx;
+    vector<string> const *m_dbnames;
+    vector<BSONObj> *m_dbinfos;
+    size_t m_next;
+    vector<size_t> m_retry;             // of failed workers, taken before m_next
+    vector<bool> m_retried;
+    unsigned m_workers;
+    boost::timer::nanosecond_type m_serial_dur;
+    boost::timer::nanosecond_type m_fanout_dur;
+    vector<boost::timer::nanosecond_type> m_latencies;
+
+    /* none past the deadline, the databases left go stale */
+    bool next_job(size_t &job)
+    {
+	boost::lock_guard<boost::mutex> lock(m_mtx);
+	if( m_deadline->passed() )
+	    return false;
+	if( !m_retry.empty() )
+	{
+	    job = m_retry.back();
+	    m_retry.pop_back();
+	    return true;
+	}
+	if( m_next >= m_dbnames->size() )
+	    return false;
+	job = m_next++;
+	return true;
+    }
+
+    void retry(size_t job)
+    {
+	boost::lock_guard<boost::mutex> lock(m_mtx);
+	if( m_retried[job] )
+	    return;
+	m_retried[job] = true;
+	m_retry.push_back(job);
+    }
+
+    /* a worker whose connection failed leaves the remaining databases to the others */
+    void work(CommandRunner &runner)
+    {
+	size_t job;
+	while( !runner.failed() && next_job(job) )
+	{
+	    boost::timer::cpu_timer cmd_dur;
+	    cmd_dur.start();
+	    bool const ok = runner.run((*m_dbnames)[job], m_cmd, (*m_dbinfos)[job]);
+	    cmd_dur.stop();
+	    if( (*m_dbinfos)[job].isEmpty() )
+	    {
+		// not run
+		if( runner.failed() )
+		    retry(job);
+		continue;
+	    }
+	    if( !ok )
+		(*m_dbinfos)[job] = BSONObj(); // an error reply goes stale like no reply
+
+	    boost::lock_guard<boost::mutex> lock(m_mtx);
+	    m_serial_dur += cmd_dur.elapsed().wall;
+	    m_latencies.push_back( cmd_dur.elapsed().wall );
+	}
+    }
+
+    void pool_worker(size_t slot)
+    {
+	try
+	{
+	    if( !m_pool[slot] )
+		m_pool[slot] = m_runner->fork();
+
+	    work(*m_pool[slot]);
+	    if( m_pool[slot]->failed() )
+	    {
+		delete m_pool[slot];
+		m_pool[slot] = 0;
+	    }
+	}
+	catch( std::exception &e )
+	{
+	    // the remaining databases are left to the other workers
+	    cerr << "dbstats worker " << slot + 1 << " failed: " << e.what() << endl;
+	    delete m_pool[slot];
+	    m_pool[slot] = 0;
+	}
+    }
+
+private:
+    DbStatsFanout();
+    DbStatsFanout(DbStatsFanout const &);
+    DbStatsFanout & operator = (DbStatsFanout const &);
+};
+
+/*
+ * Extractor trees for all commands of a poll. They are built once and own
+ * all their extractors. The row indexes of the replica set (.20.7) and
+ * database (.21) tables live as long as the trees, keeping rows stable
+ * from poll to poll while a database or member is there. serverStatus and
+ * replSetGetStatus may be extracted in parallel threads and share the
+ * replica set rows under a lock.
+ */
+class PollExtractors
+{
+public:
+    PollExtractors()
+	: m_repl_mtx()
+	, m_repl_rows()
+	, m_db_rows()
+	, m_dbstats_row()
+	, m_databases( databases_extractors(m_db_rows) )
+	, m_dbstats( StaticAnyfix(".21.1"), m_dbstats_row )
+	, m_coll_stats_row()
+	, m_coll_stats( StaticAnyfix(".22.1"), m_coll_stats_row )
+	, m_server_status( server_status_extractors(m_repl_rows, m_db_rows) )
+	, m_repl_set_status( repl_set_status_extractors(m_repl_rows) )
+    {}
+
+    /* before the commands of a poll start */
+    void start_poll()
+    {
+	m_db_rows.start_poll();
+	m_repl_rows.start_poll();
+    }
+
+    /* after a poll, drops the rows of the databases it did not list */
+    void retain_databases() { m_db_rows.retain_seen(); }
+
+    /* after a poll, drops the rows of the members neither serverStatus nor replSetGetStatus gave */
+    void retain_members()
+    {
+	boost::lock_guard<boost::mutex> lock(m_repl_mtx);
+	m_repl_rows.retain_seen();
+    }
+
+    void databases(BSONObj const &dbases, OidValueBuffer &out_vals)
+    {
+	(*m_databases)(dbases, out_vals);
+    }
+
+    void dbstats(BSONObj const &dbinfo, unsigned row, OidValueBuffer &out_vals)
+    {
+	m_dbstats_row.setNextRow(row);
+	m_dbstats(dbinfo, out_vals);
+    }
+
+    void coll_stats(BSONObj const &collinfo, unsigned row, OidValueBuffer &out_vals)
+    {
+	m_coll_stats_row.setNextRow(row);
+	m_coll_stats(collinfo, out_vals);
+    }
+
+    void server_status(BSONObj const &serv_status, OidValueBuffer &out_vals)
+    {
+	boost::lock_guard<boost::mutex> lock(m_repl_mtx);
+	(*m_server_status)(serv_status, out_vals);
+    }
+
+    void repl_set_status(BSONObj const &repl_info, OidValueBuffer &out_vals)
+    {
+	boost::lock_guard<boost::mutex> lock(m_repl_mtx);
+	(*m_repl_set_status)(repl_info, out_vals);
+    }
+
+protected:
+    boost::mutex m_repl_mtx;
+    TableRowIndex m_repl_rows;
+    TableRowIndex m_db_rows;
+    RowPostfix m_dbstats_row;
+
+    scoped_ptr<MibStructExtractor> m_databases;
+    BothfixStructExtractor<MibLevelExtractor<MIB_LEVEL_DBSTATS>, const StaticAnyfix, RowPostfix &> m_dbstats;
+    RowPostfix m_coll_stats_row;
+    BothfixStructExtractor<MibLevelExtractor<MIB_LEVEL_COLLSTATS>, const StaticAnyfix, RowPostfix &> m_coll_stats;
+    scoped_ptr<MibStructExtractor> m_server_status;
+    scoped_ptr<MibStructExtractor> m_repl_set_status;
+
+private:
+    PollExtractors(PollExtractors const &);
+    PollExtractors & operator = (PollExtractors const &);
+};
+
+/* names and rows of the databases listDatabases gave, for dbstats */
+void
+find_databases(OidValueBuffer const &out_vals, vector<string> &database_names, vector<unsigned> &database_rows)
+{
+    Oid const name_column(".21.1.1");
+    std::pair<OidValueBuffer::const_iterator, OidValueBuffer::const_iterator> names = out_vals.prefix_range(name_column);
+    for( OidValueBuffer::const_iterator cmp_iter = names.first; cmp_iter != names.second; ++cmp_iter )
+    {
+	if( cmp_iter->oid.size() != name_column.size() + 1 )
+	    continue;
+
+	database_names.push_back( cmp_iter->str() );
+	database_rows.push_back( cmp_iter->oid.back() );
+    }
+}
+
+/*
+ * Sections refreshed less often than every poll in daemon mode, row i + 1
+ * of the ages at .99.8.
+ */
+enum CachedSection
+{
+    SECTION_SERVER_STATUS,
+    SECTION_REPL_SET_STATUS,
+    SECTION_DBSTATS,
+    SECTION_COUNT
+};
+
+static char const * const cached_section_names[SECTION_COUNT] = {
+    "serverStatus", "replSetGetStatus", "dbstats"
+};
+
+/* refresh interval of each section in seconds, 0 refreshes on every poll */
+struct RefreshIntervals
+{
+    RefreshIntervals()
+    {
+	std::fill( seconds, seconds + SECTION_COUNT, 0U );
+    }
+
+    /* SECTION=SECONDS, false for an unknown section */
+    bool parse(string const &arg)
+    {
+	string::size_type eq = arg.find('=');
+	if( string::npos == eq )
+	    return false;
+
+	for( unsigned s = 0; s < SECTION_COUNT; ++s )
+	{
+	    if( arg.compare( 0, eq, cached_section_names[s] ) == 0 )
+	    {
+		seconds[s] = lexical_cast<unsigned>( arg.substr(eq + 1) );
+		return true;
+	    }
+	}
+
+	return false;
+    }
+
+    unsigned seconds[SECTION_COUNT];
+};
+
+/*
+ * Replies kept from poll to poll by a collector. A section is run again
+ * once its refresh interval passed, the dbstats of a database also as
+ * soon as its sizeOnDisk in listDatabases changed. Cached replies are
+ * extracted like fresh ones, so their values keep their rows.
+ */
+class ReplyCache
+{
+public:
+    ReplyCache(RefreshIntervals const &intervals)
+	: m_intervals(intervals)
+	, m_now()
+	, m_sections(SECTION_COUNT)
+	, m_dbstats()
+	, m_dbstats_run(0)
+	, m_dbstats_cached(0)
+    {}
+
+    void start_poll()
+    {
+	m_now = boost::get_system_time();
+	m_dbstats_run = m_dbstats_cached = 0;
+    }
+
+    /* cached reply of the section, 0 when it is due */
+    BSONObj const * lookup(CachedSection section) const
+    {
+	Entry const &entry = m_sections[section];
+	return due(entry, section) ? 0 : &entry.reply;
+    }
+
+    void store(CachedSection section, BSONObj const &reply)
+    {
+	refresh( m_sections[section], reply );
+    }
+
+    /* last reply of the section however old, for a poll which could not get it; 0 if there is none */
+    BSONObj const * last(CachedSection section) const
+    {
+	Entry const &entry = m_sections[section];
+	return entry.reply.isEmpty() ? 0 : &entry.reply;
+    }
+
+    unsigned section_age(CachedSection section) const
+    {
+	return age( m_sections[section] );
+    }
+
+    /* cached dbstats of the database, 0 when it is due */
+    BSONObj const * lookup_dbstats(string const &dbname, string const &size_on_disk)
+    {
+	boost::unordered_map<string, Entry>::const_iterator ci = m_dbstats.find(dbname);
+	if( ( ci == m_dbstats.end() ) || due(ci->second, SECTION_DBSTATS) || ( ci->second.size_on_disk != size_on_disk ) )
+	    return 0;
+
+	++m_dbstats_cached;
+	return &ci->second.reply;
+    }
+
+    /* reply of a due dbstats, counted at .99.8.4 when it could be cached */
+    void store_dbstats(string const &dbname, string const &size_on_disk, BSONObj const &reply)
+    {
+	Entry &entry = m_dbstats[dbname];
+	if( !refresh( entry, reply ) )
+	    return;
+	entry.size_on_disk = size_on_disk;
+	++m_dbstats_run;
+    }
+
+    BSONObj const * last_dbstats(string const &dbname) const
+    {
+	boost::unordered_map<string, Entry>::const_iterator ci = m_dbstats.find(dbname);
+	return ( ci == m_dbstats.end() ) || ci->second.reply.isEmpty() ? 0 : &ci->second.reply;
+    }
+
+    /* forgets the databases not listed any more */
+    void retain_databases(vector<string> const &dbnames)
+    {
+	boost::unordered_map<string, Entry> listed;
+	for( vector<string>::const_iterator ci = dbnames.begin(); ci != dbnames.end(); ++ci )
+	{
+	    boost::unordered_map<string, Entry>::iterator i = m_dbstats.find(*ci);
+	    if( i != m_dbstats.end() )
+		listed.insert(*i);
+	}
+	m_dbstats.swap(listed);
+    }
+
+    unsigned dbstats_age(string const &dbname) const
+    {
+	boost::unordered_map<string, Entry>::const_iterator ci = m_dbstats.find(dbname);
+	return ci == m_dbstats.end() ? 0 : age(ci->second);
+    }
+
+    /* age of each section in seconds (of the oldest dbstats) and the dbstats run and reused */
+    void report(OidValueBuffer &out_vals) const
+    {
+	unsigned oldest = 0;
+	for( boost::unordered_map<string, Entry>::const_iterator ci = m_dbstats.begin(); ci != m_dbstats.end(); ++ci )
+	    oldest = std::max( oldest, age(ci->second) );
+
+	out_vals.append( OidValueTuple( ".99.8.1", SMI_UINTEGER ).set_uint( age( m_sections[SECTION_SERVER_STATUS] ) ) );
+	out_vals.append( OidValueTuple( ".99.8.2", SMI_UINTEGER ).set_uint( age( m_sections[SECTION_REPL_SET_STATUS] ) ) );
+	out_vals.append( OidValueTuple( ".99.8.3", SMI_UINTEGER ).set_uint( oldest ) );
+	out_vals.append( OidValueTuple( ".99.8.4", SMI_UINTEGER ).set_uint( m_dbstats_run ) );
+	out_vals.append( OidValueTuple( ".99.8.5", SMI_UINTEGER ).set_uint( m_dbstats_cached ) );
+    }
+
+protected:
+    struct Entry
+    {
+	Entry() : reply(), fetched(), size_on_disk() {}
+
+	BSONObj reply;
+	boost::system_time fetched;
+	string size_on_disk;            // dbstats only
+    };
+
+    RefreshIntervals const m_intervals;
+    boost::system_time m_now;
+    vector<Entry> m_sections;
+    boost::unordered_map<string, Entry> m_dbstats;
+    unsigned m_dbstats_run;
+    unsigned m_dbstats_cached;
+
+    bool due(Entry const &entry, CachedSection section) const
+    {
+	return entry.reply.isEmpty() || ( age(entry) >= m_intervals.seconds[section] );
+    }
+
+    unsigned age(Entry const &entry) const
+    {
+	return entry.reply.isEmpty() ? 0 : static_cast<unsigned>( ( m_now - entry.fetched ).total_seconds() );
+    }
+
+    /* failed commands leave no or an error reply, neither is cached */
+    bool refresh(Entry &entry, BSONObj const &reply)
+    {
+	if( reply.isEmpty() || !reply_ok(reply) )
+	    return false;
+	entry.reply = reply.getOwned();
+	entry.fetched = m_now;
+	return true;
+    }
+
+private:
+    ReplyCache();
+    ReplyCache(ReplyCache const &);
+    ReplyCache & operator = (ReplyCache const &);
+};
+
+/* sections of serverStatus known to be big, left out from the first poll on unless the MIB reads them */
+static char const * const server_status_sections[] =
+{
+    "metrics", "wiredTiger", "tcmalloc", "opcountersRepl", "opLatencies", "storageEngine", "transactions",
+    "logicalSessionRecordCache", "electionMetrics", "flowControl", "freeMonitoring", "extra_info", "security",
+    "shardingStatistics", "sharding", "oplogTruncation", "twoPhaseCommitCoordinator", "catalogStats",
+    "indexBulkBuilder", "indexStats", "readConcernCounters", "readPreferenceCounters", "defaultRWConcern",
+    "scramCache", "transportSecurity", "trafficRecording", "dur", "writeBacksQueued",
+    0
+};
+
+/*
+ * serverStatus with every section no extractor reads turned off, so
+ * mongod neither serialises nor sends them and extraction does not walk
+ * them. The sections a mongod has are learnt from its replies: each sub
+ * document the serverStatus level of the MIB does not know is turned off
+ * from the next poll on.
+ */
+class ServerStatusCommand
+{
+public:
+    ServerStatusCommand()
+	: m_off()
+	, m_cmd()
+    {
+	for( char const * const *name = server_status_sections; *name; ++name )
+	    exclude(*name);
+	build();
+    }
+
+    BSONObj const & command() const { return m_cmd; }
+
+    void learn(BSONObj const &reply)
+    {
+	bool changed = false;
+	BSONObjIterator i(reply);
+	while( i.more() )
+	{
+	    BSONElement e = i.next();
+	    if( ( Object == e.type() ) && exclude( e.fieldName() ) )
+		changed = true;
+	}
+
+	if( changed )
+	    build();
+    }
+
+protected:
+    set<string> m_off;
+    BSONObj m_cmd;
+
+    /* true if name is a section nobody reads which was on so far */
+    bool exclude(char const *name)
+    {
+	return !MibStructExtractor::find_field( mib_levels[MIB_LEVEL_SERVERSTATUS], name ) && m_off.insert(name).second;
+    }
+
+    void build()
+    {
+	BSONObjBuilder cmd;
+	cmd.append("serverStatus", 1);
+	for( set<string>::const_iterator ci = m_off.begin(); ci != m_off.end(); ++ci )
+	    cmd.append(*ci, 0);
+	m_cmd = cmd.obj();
+    }
+
+private:
+    ServerStatusCommand(ServerStatusCommand const &);
+    ServerStatusCommand & operator = (ServerStatusCommand const &);
+};
+
+/* opened once per poll, waiters block until then */
+class PollLatch
+{
+public:
+    PollLatch()
+	: m_open(false)
+    {}
+
+    void reset()
+    {
+	boost::lock_guard<boost::mutex> lock(m_mtx);
+	m_open = false;
+    }
+
+    void open()
+    {
+	boost::lock_guard<boost::mutex> lock(m_mtx);
+	m_open = true;
+	m_cond.notify_all();
+    }
+
+    void wait()
+    {
+	boost::unique_lock<boost::mutex> lock(m_mtx);
+	while( !m_open )
+	    m_cond.wait(lock);
+    }
+
+protected:
+    boost::mutex m_mtx;
+    boost::condition_variable m_cond;
+    bool m_open;
+
+private:
+    PollLatch(PollLatch const &);
+    PollLatch & operator = (PollLatch const &);
+};
+
+/*
+ * A top-level command run in a thread of its own while the poll goes on.
+ * The runner is forked from the one of the poll and kept for the next
+ * poll. The reply is extracted in the thread as soon as it arrived and
+ * the latch it depends on (if any) is open, into values of its own which
+ * finish() adds to the result. A command failing or not answering by the
+ * deadline costs its own values only.
+ */
+class ParallelCommand
+{
+public:
+    typedef void (PollExtractors::*Extract)(BSONObj const &, OidValueBuffer &);
+
+    ParallelCommand(char const *cmdname, PollPhase phase, PollExtractors &extractors, Extract extract, PollLatch *after)
+	: m_cmd(BSONObjBuilder().append(cmdname, 1).obj())
+	, m_phase(phase)
+	, m_extractors(extractors)
+	, m_extract(extract)
+	, m_after(after)
+	, m_runner(0)
+	, m_thread()
+	, m_fetched(false)
+	, m_reply()
+	, m_vals()
+	, m_times()
+	, m_failed(false)
+	, m_error()
+    {}
+
+    ~ParallelCommand()
+    {
+	join();
+	delete m_runner;
+    }
+
+    /* before start(), replaces the plain { cmdname: 1 } */
+    void set_command(BSONObj const &cmd) { m_cmd = cmd; }
+
+    /* runs the command on a runner forked from parent, a cached reply is only extracted */
+    void start(CommandRunner &parent, BSONObj const *cached)
+    {
+	m_fetched = !cached;
+	m_reply = cached ? *cached : BSONObj();
+	m_vals.clear();
+	m_times.clear();
+	m_failed = false;
+	m_error.clear();
+
+	m_thread.reset( new boost::thread( boost::bind( &ParallelCommand::work, this, &parent ) ) );
+    }
+
+    /* not run in this poll, adds nothing */
+    void skip()
+    {
+	m_fetched = false;
+	m_reply = BSONObj();
+	m_vals.clear();
+	m_times.clear();
+	m_failed = false;
+    }
+
+    void join()
+    {
+	if( !m_thread )
+	    return;
+	m_thread->join();
+	m_thread.reset();
+    }
+
+    /* after join(), reports what failed in the thread */
+    void finish(PollTimes &times, OidValueBuffer &out_vals)
+    {
+	times.merge(m_times);
+	if( !m_error.empty() )
+	    cerr << m_error << endl;
+	if( !m_failed )
+	    out_vals.append( m_vals, Oid() );
+    }
+
+    /* run in this poll rather than taken from the cache */
+    bool fetched() const { return m_fetched; }
+    /* started, but neither a reply nor values came of it */
+    bool failed() const { return m_failed; }
+    BSONObj const & reply() const { return m_reply; }
+
+protected:
+    BSONObj m_cmd;
+    PollPhase const m_phase;
+    PollExtractors &m_extractors;
+    Extract const m_extract;
+    PollLatch *m_after;
+    CommandRunner *m_runner;
+    scoped_ptr<boost::thread> m_thread;
+
+    bool m_fetched;
+    BSONObj m_reply;
+    OidValueBuffer m_vals;
+    PollTimes m_times;
+    bool m_failed;
+    string m_error;
+
+    void work(CommandRunner *parent)
+    {
+	try
+	{
+	    if( m_fetched )
+	    {
+		if( !m_runner )
+		    m_runner = parent->fork();
+
+		bool ok;
+		{
+		    PhaseTimer timer(m_times, m_phase, true);
+		    ok = m_runner->run(DBNAME, m_cmd, m_reply);
+		}
+		if( m_runner->failed() )
+		{
+		    // reconnect on next poll
+		    delete m_runner;
+		    m_runner = 0;
+		}
+		// an error reply (e.g. replSetGetStatus without replica set) counts as failed
+		if( !ok || m_reply.isEmpty() )
+		{
+		    m_failed = true;
+		    return;
+		}
+	    }
+
+	    if( m_after )
+		m_after->wait();
+
+	    PhaseTimer timer(m_times, PHASE_EXTRACT);
+	    (m_extractors.*m_extract)(m_vals.pin(m_reply), m_vals);
+	}
+	catch( DBException &e )
+	{
+	    fail( string( m_cmd.firstElement().fieldName() ) + " failed: " + e.what() );
+	    // reconnect on next poll
+	    delete m_runner;
+	    m_runner = 0;
+	}
+	catch( std::exception &e )
+	{
+	    fail( string( m_cmd.firstElement().fieldName() ) + " failed: " + e.what() );
+	}
+    }
+
+    void fail(string const &error)
+    {
+	m_failed = true;
+	m_error = error;
+    }
+
+private:
+    ParallelCommand();
+    ParallelCommand(ParallelCommand const &);
+    ParallelCommand & operator = (ParallelCommand const &);
+};
+
+/*
+ * Statistics of the collections (.22) and their indexes (.23), sampled
+ * round robin: every poll runs listCollections and collStats commands,
+ * database by database, until the time budget is spent or each has run
+ * once, and picks up where the last poll stopped. Replies are kept
+ * between polls, a collection not sampled this poll keeps its values and
+ * their age (.22.1.8) grows. A mongod with thousands of collections so
+ * costs each poll about the budget rather than a command per collection.
+ * A command without reply (the poll deadline passed) ends the round, it
+ * is tried again next poll.
+ */
+class CollStatsSampler
+{
+public:
+    CollStatsSampler(unsigned budget_ms)
+	: m_budget( boost::posix_time::milliseconds(budget_ms) )
+	, m_databases()
+	, m_samples()
+	, m_collection_rows()
+	, m_index_rows()
+	, m_cursor_db()
+	, m_cursor_pos(0)
+	, m_now()
+	, m_run(0)
+	, m_listed(0)
+	, m_interrupted(false)
+	, m_oldest(0)
+    {}
+
+    void run(CommandRunner &runner, PollDeadline const &deadline, vector<string> const &database_names,
+	     vector<unsigned> const &database_rows, PollExtractors &extractors, PollTimes &times, OidValueBuffer &out_vals)
+    {
+	m_now = boost::get_system_time();
+	m_run = m_listed = 0;
+	m_interrupted = false;
+	retain(database_names);
+	if( !database_names.empty() )
+	    sample(runner, deadline.within(m_budget), database_names, times);
+
+	PhaseTimer timer(times, PHASE_EXTRACT);
+	report(database_names, database_rows, extractors, out_vals);
+    }
+
+    /* whether a command of the last run got no reply */
+    bool interrupted() const { return m_interrupted; }
+    /* seconds, of the collection sampled longest ago */
+    unsigned oldest_age() const { return m_oldest; }
+
+protected:
+    struct Sample
+    {
+	Sample() : dbname(), reply(), fetched() {}
+
+	string dbname;
+	BSONObj reply;
+	boost::system_time fetched;
+    };
+
+    boost::posix_time::time_duration const m_budget;
+    boost::unordered_map< string, vector<string> > m_databases;    // collections per database
+    boost::unordered_map<string, Sample> m_samples;                 // by namespace
+    TableRowIndex m_collection_rows;
+    TableRowIndex m_index_rows;
+    string m_cursor_db;
+    size_t m_cursor_pos;        // 0: listCollections, k + 1: collStats of collection k
+    boost::system_time m_now;
+    unsigned m_run;
+    unsigned m_listed;
+    bool m_interrupted;
+    unsigned m_oldest;
+
+    /* commands from the cursor on until the deadline, at least one, at most a round */
+    void sample(CommandRunner &runner, boost::system_time const &deadline, vector<string> const &database_names, PollTimes &times)
+    {
+	size_t db = std::find( database_names.begin(), database_names.end(), m_cursor_db ) - database_names.begin();
+	if( db == database_names.size() )
+	{
+	    db = 0;
+	    m_cursor_pos = 0;
+	}
+	else if( m_cursor_pos > m_databases[database_names[db]].size() )
+	{
+	    db = ( db + 1 ) % database_names.size();
+	    m_cursor_pos = 0;
+	}
+
+	size_t const first_db = db, first_pos = m_cursor_pos;
+	for(;;)
+	{
+	    string const &dbname = database_names[db];
+	    vector<string> &collections = m_databases[dbname];
+	    bool const answered = 0 == m_cursor_pos ? list_collections(runner, dbname, collections, times)
+						    : coll_stats(runner, dbname, collections[m_cursor_pos - 1], times);
+	    if( !answered )
+	    {
+		m_interrupted = true;
+		break;
+	    }
+
+	    if( ++m_cursor_pos > collections.size() )
+	    {
+		db = ( db + 1 ) % database_names.size();
+		m_cursor_pos = 0;
+	    }
+
+	    if( ( ( db == first_db ) && ( m_cursor_pos == first_pos ) ) || ( boost::get_system_time() >= deadline ) )
+		break;
+	}
+
+	m_cursor_db = database_names[db];
+    }
+
+    /* collections only, views can't be asked for collStats; false keeps the last list */
+    bool list_collections(CommandRunner &runner, string const &dbname, vector<string> &collections, PollTimes &times)
+    {
+	BSONObj reply;
+	{
+	    PhaseTimer timer(times, PHASE_COLL_STATS, true);
+	    runner.run( dbname, BSONObjBuilder().append("listCollections", 1).append("nameOnly", true).obj(), reply );
+	}
+
+	vector<string> listed;
+	for(;;)
+	{
+	    if( reply.isEmpty() )
+		return false;
+
+	    BSONElement cursor = reply["cursor"];
+	    if( Object != cursor.type() )
+		break;
+
+	    BSONObj const batches = cursor.Obj();
+	    BSONElement batch = batches.hasField("firstBatch") ? batches["firstBatch"] : batches["nextBatch"];
+	    if( Array == batch.type() )
+	    {
+		BSONObjIterator iter( batch.Obj() );
+		while( iter.more() )
+		{
+		    BSONElement coll = iter.next();
+		    if( Object != coll.type() )
+			continue;
+		    BSONElement name = coll.Obj()["name"], type = coll.Obj()["type"];
+		    if( ( String == name.type() ) && ( type.eoo() || ( ( String == type.type() ) && ( "collection" == type.String() ) ) ) )
+			listed.push_back( name.String() );
+		}
+	    }
+
+	    long long const id = batches["id"].numberLong();
+	    if( 0 == id )
+		break;
+
+	    PhaseTimer timer(times, PHASE_COLL_STATS, true);
+	    runner.run( dbname, BSONObjBuilder().append("getMore", id).append("collection", "$cmd.listCollections").obj(), reply );
+	}
+
+	// samples of dropped collections go
+	std::sort( listed.begin(), listed.end() );
+	for( vector<string>::const_iterator ci = collections.begin(); ci != collections.end(); ++ci )
+	{
+	    if( !std::binary_search( listed.begin(), listed.end(), *ci ) )
+		m_samples.erase( dbname + "." + *ci );
+	}
+	collections.swap(listed);
+	++m_listed;
+	return true;
+    }
+
+    /* false keeps the last sample */
+    bool coll_stats(CommandRunner &runner, string const &dbname, string const &collection, PollTimes &times)
+    {
+	BSONObj reply;
+	bool ok;
+	{
+	    PhaseTimer timer(times, PHASE_COLL_STATS, true);
+	    ok = runner.run( dbname, BSONObjBuilder().append("collStats", collection).obj(), reply );
+	}
+	if( reply.isEmpty() )
+	    return false;
+	++m_run;
+
+	// dropped since it was listed
+	string const ns = dbname + "." + collection;
+	if( !ok )
+	{
+	    m_samples.erase(ns);
+	    return true;
+	}
+
+	Sample &sample = m_samples[ns];
+	sample.dbname = dbname;
+	sample.reply = reply.getOwned();
+	sample.fetched = boost::get_system_time();
+	return true;
+    }
+
+    /* forgets the databases not listed any more */
+    void retain(vector<string> const &database_names)
+    {
+	std::set<string> const listed( database_names.begin(), database_names.end() );
+	for( boost::unordered_map< string, vector<string> >::iterator i = m_databases.begin(); i != m_databases.end(); )
+	{
+	    if( listed.count(i->first) )
+	    {
+		++i;
+		continue;
+	    }
+
+	    for( vector<string>::const_iterator ci = i->second.begin(); ci != i->second.end(); ++ci )
+		m_samples.erase( i->first + "." + *ci );
+	    i = m_databases.erase(i);
+	}
+    }
+
+    unsigned age(Sample const &sample) const
+    {
+	return m_now > sample.fetched ? static_cast<unsigned>( ( m_now - sample.fetched ).total_seconds() ) : 0;
+    }
+
+    void report(vector<string> const &database_names, vector<unsigned> const &database_rows,
+		PollExtractors &extractors, OidValueBuffer &out_vals)
+    {
+	boost::unordered_map<string, unsigned> db_rows;
+	for( size_t i = 0; i < database_names.size(); ++i )
+	    db_rows[database_names[i]] = database_rows[i];
+
+	Oid const collections(".22.1"), indexes(".23.1");
+	unsigned oldest = 0;
+	size_t listed = 0;
+	for( boost::unordered_map< string, vector<string> >::const_iterator ci = m_databases.begin(); ci != m_databases.end(); ++ci )
+	    listed += ci->second.size();
+
+	// every sample kept is reported, rows of collections and indexes not reported go
+	m_collection_rows.start_poll();
+	m_index_rows.start_poll();
+	for( boost::unordered_map<string, Sample>::const_iterator ci = m_samples.begin(); ci != m_samples.end(); ++ci )
+	{
+	    Sample const &sample = ci->second;
+	    BSONObj const &reply = out_vals.pin(sample.reply);
+	    unsigned const row = m_collection_rows.row(ci->first);
+	    extractors.coll_stats(reply, row, out_vals);
+	    out_vals.append( OidValueTuple( collections + 2 + row, SMI_UINTEGER ).set_uint( db_rows[sample.dbname] ) );
+	    out_vals.append( OidValueTuple( collections + 8 + row, SMI_UINTEGER ).set_uint( age(sample) ) );
+	    oldest = std::max( oldest, age(sample) );
+
+	    BSONElement sizes = reply["indexSizes"];
+	    if( Object != sizes.type() )
+		continue;
+
+	    BSONObjIterator iter( sizes.Obj() );
+	    while( iter.more() )
+	    {
+		BSONElement size = iter.next();
+		string key( ci->first );
+		key += '\0';
+		key += size.fieldName();
+		unsigned const index_row = m_index_rows.row(key);
+		out_vals.append( OidValueTuple( indexes + 1 + index_row, ASN_OCTET_STR ).set_string_ref( size.fieldName(), strlen( size.fieldName() ) ) );
+		out_vals.append( OidValueTuple( indexes + 2 + index_row, SMI_UINTEGER ).set_uint(row) );
+		out_vals.append( OidValueTuple( indexes + 3 + index_row, SMI_COUNTER64 ).set_uint64( size.numberLong() ) );
+	    }
+	}
+
+	m_collection_rows.retain_seen();
+	m_index_rows.retain_seen();
+
+	out_vals.append( OidValueTuple( ".99.9.1", SMI_UINTEGER ).set_uint(m_run) );
+	out_vals.append( OidValueTuple( ".99.9.2", SMI_UINTEGER ).set_uint(m_listed) );
+	out_vals.append( OidValueTuple( ".99.9.3", SMI_UINTEGER ).set_uint(listed) );
+	out_vals.append( OidValueTuple( ".99.9.4", SMI_UINTEGER ).set_uint( listed > m_samples.size() ? listed - m_samples.size() : 0 ) );
+	out_vals.append( OidValueTuple( ".99.9.5", SMI_UINTEGER ).set_uint(oldest) );
+	m_oldest = oldest;
+    }
+
+private:
+    CollStatsSampler();
+    CollStatsSampler(CollStatsSampler const &);
+    CollStatsSampler & operator = (CollStatsSampler const &);
+};
+
+/* how hard a poll may work a mongod */
+struct PollSettings
+{
+    PollSettings(unsigned a_dbstats_concurrency = 1, unsigned a_collstats_budget_ms = 0, unsigned a_timeout_ms = 0)
+	: dbstats_concurrency(a_dbstats_concurrency)
+	, collstats_budget_ms(a_collstats_budget_ms)
+	, timeout_ms(a_timeout_ms)
+    {}
+
+    unsigned dbstats_concurrency;       // dbstats in flight
+    unsigned collstats_budget_ms;       // spent on collStats per poll, 0 for none
+    unsigned timeout_ms;                // deadline of a poll, 0 for none
+};
+
+/* what a poll could send of a section, .99.11.1.2 */
+enum Freshness
+{
+    FRESHNESS_CURRENT = 1,      // run in this poll, or cached as --refresh allows
+    FRESHNESS_STALE,            // failed, the last good values of an earlier poll are sent
+    FRESHNESS_MISSING           // failed, nothing to send
+};
+
+/*
+ * Polls of one instance, running the commands of a command set only.
+ * serverStatus and replSetGetStatus are sent on connections of their own
+ * while listDatabases and the dbstats run, and each is extracted as soon
+ * as its reply is there; serverStatus waits for the database rows of
+ * listDatabases for its locks. With a cache (daemon mode) sections which
+ * are not due are taken from it, only the databases whose dbstats are
+ * due get a dbstats command. With a collStats budget the collection
+ * round robin follows the dbstats on the runner of the poll.
+ *
+ * A command failing or not answering by the deadline costs its section
+ * only: the poll goes on and sends the last good reply of the section
+ * instead, if the poller has one. How current each section is goes to
+ * .99.11.
+ */
+class Poller
+{
+public:
+    Poller(PollSettings const &settings, RefreshIntervals const *refresh)
+	: m_fanout(settings.dbstats_concurrency)
+	, m_extractors()
+	, m_cache( refresh ? new ReplyCache(*refresh) : 0 )
+	, m_databases_known()
+	, m_server_status_cmd()
+	, m_server_status( "serverStatus", PHASE_SERVER_STATUS, m_extractors, &PollExtractors::server_status, &m_databases_known )
+	, m_repl_set_status( "replSetGetStatus", PHASE_REPL_SET_STATUS, m_extractors, &PollExtractors::repl_set_status, 0 )
+	, m_database_names()
+	, m_database_rows()
+	, m_coll_stats( settings.collstats_budget_ms ? new CollStatsSampler(settings.collstats_budget_ms) : 0 )
+	, m_databases_reply()
+	, m_databases_fetched()
+    {
+	std::fill( m_failures, m_failures + COMMAND_COUNT, 0ULL );
+    }
+
+    void collect(CommandRunner &runner, unsigned commands, PollDeadline const &deadline, PollTimes &times, OidValueBuffer &out_vals)
+    {
+	if( m_cache )
+	    m_cache->start_poll();
+	std::fill( m_freshness, m_freshness + COMMAND_COUNT, FRESHNESS_CURRENT );
+	std::fill( m_age, m_age + COMMAND_COUNT, 0U );
+
+	m_extractors.start_poll();
+	m_databases_known.reset();
+	m_server_status.set_command( m_server_status_cmd.command() );
+	start( m_server_status, runner, runs(commands, COMMAND_SERVER_STATUS), SECTION_SERVER_STATUS );
+	start( m_repl_set_status, runner, runs(commands, COMMAND_REPL_SET_STATUS), SECTION_REPL_SET_STATUS );
+
+	try
+	{
+	    collect_databases(runner, commands, deadline, times, out_vals);
+	    if( m_coll_stats && runs(commands, COMMAND_COLL_STATS) )
+		collect_coll_stats(runner, deadline, times, out_vals);
+	}
+	catch(...)
+	{
+	    m_databases_known.open();
+	    m_server_status.join();
+	    m_repl_set_status.join();
+	    throw;
+	}
+
+	m_server_status.join();
+	m_repl_set_status.join();
+	m_server_status.finish(times, out_vals);
+	m_repl_set_status.finish(times, out_vals);
+	settle( m_server_status, COMMAND_SERVER_STATUS, SECTION_SERVER_STATUS, &PollExtractors::server_status, times, out_vals );
+	settle( m_repl_set_status, COMMAND_REPL_SET_STATUS, SECTION_REPL_SET_STATUS, &PollExtractors::repl_set_status, times, out_vals );
+	if( m_server_status.fetched() && !m_server_status.failed() )
+	    m_server_status_cmd.learn( m_server_status.reply() );
+
+	// rows go only with a full picture of the databases or members
+	if( runs(commands, COMMAND_LIST_DATABASES) && ( FRESHNESS_MISSING != m_freshness[COMMAND_LIST_DATABASES] ) )
+	    m_extractors.retain_databases();
+	if( runs(commands, COMMAND_SERVER_STATUS) && ( FRESHNESS_MISSING != m_freshness[COMMAND_SERVER_STATUS] ) &&
+	    runs(commands, COMMAND_REPL_SET_STATUS) && ( FRESHNESS_MISSING != m_freshness[COMMAND_REPL_SET_STATUS] ) )
+	    m_extractors.retain_members();
+
+	if( m_cache )
+	{
+	    if( m_server_status.fetched() && !m_server_status.failed() )
+		m_cache->store( SECTION_SERVER_STATUS, m_server_status.reply() );
+	    if( m_repl_set_status.fetched() && !m_repl_set_status.failed() )
+		m_cache->store( SECTION_REPL_SET_STATUS, m_repl_set_status.reply() );
+
+	    if( runs(commands, COMMAND_DBSTATS) )
+	    {
+		Oid const age_column(".21.1.18");
+		for( size_t i = 0; i < m_database_names.size(); ++i )
+		{
+		    unsigned const age = m_cache->dbstats_age( m_database_names[i] );
+		    out_vals.append( OidValueTuple( age_column + m_database_rows[i], SMI_UINTEGER ).set_uint(age) );
+		    m_age[COMMAND_DBSTATS] = std::max( m_age[COMMAND_DBSTATS], age );
+		}
+	    }
+	    // without listDatabases nothing is known about the databases
+	    if( runs(commands, COMMAND_LIST_DATABASES) && ( FRESHNESS_MISSING != m_freshness[COMMAND_LIST_DATABASES] ) )
+		m_cache->retain_databases(m_database_names);
+	    m_cache->report(out_vals);
+	}
+
+	report_sections(commands, deadline, out_vals);
+	out_vals.index();
+    }
+
+    /* a poll which threw: each section it ran is stale, as of the last good poll age seconds ago, or missing */
+    void fail(unsigned commands, unsigned stale, unsigned age, PollDeadline const &deadline, OidValueBuffer &out_vals)
+    {
+	for( unsigned c = 0; c < COMMAND_COUNT; ++c )
+	{
+	    bool const last = runs( stale, static_cast<PollCommand>(c) );
+	    m_freshness[c] = last ? FRESHNESS_STALE : FRESHNESS_MISSING;
+	    m_age[c] = last ? age : 0;
+	}
+	report_sections(commands, deadline, out_vals);
+    }
+
+protected:
+    DbStatsFanout m_fanout;
+    PollExtractors m_extractors;
+    scoped_ptr<ReplyCache> m_cache;
+    PollLatch m_databases_known;
+    ServerStatusCommand m_server_status_cmd;
+    ParallelCommand m_server_status;
+    ParallelCommand m_repl_set_status;
+    vector<string> m_database_names;
+    vector<unsigned> m_database_rows;
+    scoped_ptr<CollStatsSampler> m_coll_stats;
+    BSONObj m_databases_reply;          // last good listDatabases, daemon mode
+    boost::system_time m_databases_fetched;
+    Freshness m_freshness[COMMAND_COUNT];
+    unsigned m_age[COMMAND_COUNT];
+    unsigned long long m_failures[COMMAND_COUNT];
+
+    /* a section is as current as its oldest part */
+    void degrade(PollCommand command, Freshness freshness, unsigned age)
+    {
+	m_freshness[command] = std::max( m_freshness[command], freshness );
+	m_age[command] = std::max( m_age[command], age );
+    }
+
+    /* the values of a command which failed come from its last good reply, if there is one */
+    void settle(ParallelCommand const &command, PollCommand which, CachedSection section, ParallelCommand::Extract extract,
+		PollTimes &times, OidValueBuffer &out_vals)
+    {
+	if( !command.failed() )
+	{
+	    if( m_cache && !command.fetched() )
+		m_age[which] = m_cache->section_age(section);
+	    return;
+	}
+
+	BSONObj const *last = m_cache ? m_cache->last(section) : 0;
+	if( !last )
+	{
+	    degrade( which, FRESHNESS_MISSING, 0 );
+	    return;
+	}
+
+	degrade( which, FRESHNESS_STALE, m_cache->section_age(section) );
+	PhaseTimer timer(times, PHASE_EXTRACT);
+	(m_extractors.*extract)(out_vals.pin(*last), out_vals);
+    }
+
+    /* the deadline (.99.10) and how current each section of the poll is (.99.11) */
+    void report_sections(unsigned commands, PollDeadline const &deadline, OidValueBuffer &out_vals)
+    {
+	out_vals.append( OidValueTuple( ".99.10.1", SMI_UINTEGER ).set_uint( deadline.timeout_ms() ) );
+	out_vals.append( OidValueTuple( ".99.10.2", ASN_INTEGER ).set_int( deadline.passed() ? 1 : 0 ) );
+
+	Oid const entry(".99.11.1");
+	for( unsigned c = 0; c < COMMAND_COUNT; ++c )
+	{
+	    if( !runs( commands, static_cast<PollCommand>(c) ) || ( ( COMMAND_COLL_STATS == c ) && !m_coll_stats ) )
+		continue;
+
+	    if( FRESHNESS_CURRENT != m_freshness[c] )
+		++m_failures[c];
+
+	    unsigned const row = c + 1;
+	    out_vals.append( OidValueTuple( entry + 1 + row, ASN_OCTET_STR ).set_string_ref( poll_command_names[c], strlen(poll_command_names[c]) ) );
+	    out_vals.append( OidValueTuple( entry + 2 + row, ASN_INTEGER ).set_int( m_freshness[c] ) );
+	    out_vals.append( OidValueTuple( entry + 3 + row, SMI_UINTEGER ).set_uint( m_age[c] ) );
+	    out_vals.append( OidValueTuple( entry + 4 + row, SMI_COUNTER64 ).set_uint64( m_failures[c] ) );
+	}
+    }
+
+    /* the round robin works on the databases listDatabases gave, now or last time */
+    void collect_coll_stats(CommandRunner &runner, PollDeadline const &deadline, PollTimes &times, OidValueBuffer &out_vals)
+    {
+	if( FRESHNESS_MISSING == m_freshness[COMMAND_LIST_DATABASES] )
+	{
+	    degrade( COMMAND_COLL_STATS, FRESHNESS_MISSING, 0 );
+	    return;
+	}
+
+	m_coll_stats->run(runner, deadline, m_database_names, m_database_rows, m_extractors, times, out_vals);
+	degrade( COMMAND_COLL_STATS, m_coll_stats->interrupted() ? FRESHNESS_STALE : FRESHNESS_CURRENT, m_coll_stats->oldest_age() );
+    }
+
+    void start(ParallelCommand &command, CommandRunner &runner, bool wanted, CachedSection section)
+    {
+	if( wanted )
+	    command.start( runner, m_cache ? m_cache->lookup(section) : 0 );
+	else
+	    command.skip();
+    }
+
+    /* listDatabases and the dbstats, on the runner of the poll */
+    void collect_databases(CommandRunner &runner, unsigned commands, PollDeadline const &deadline, PollTimes &times, OidValueBuffer &out_vals)
+    {
+	m_database_names.clear();
+	m_database_rows.clear();
+	if( !runs(commands, COMMAND_LIST_DATABASES) )
+	{
+	    m_databases_known.open();
+	    return;
+	}
+
+	BSONObj dbases, cmd = BSONObjBuilder().append("listDatabases", 1).obj();
+	{
+	    PhaseTimer timer(times, PHASE_LIST_DATABASES, true);
+	    if( !runner.run(DBNAME, cmd, dbases) )
+		dbases = BSONObj();
+	}
+
+	boost::system_time const now = boost::get_system_time();
+	if( !dbases.isEmpty() )
+	{
+	    if( m_cache )
+	    {
+		m_databases_reply = dbases.getOwned();
+		m_databases_fetched = now;
+	    }
+	}
+	else if( !m_databases_reply.isEmpty() )
+	{
+	    degrade( COMMAND_LIST_DATABASES, FRESHNESS_STALE, static_cast<unsigned>( ( now - m_databases_fetched ).total_seconds() ) );
+	    dbases = m_databases_reply;
+	}
+	else
+	{
+	    degrade( COMMAND_LIST_DATABASES, FRESHNESS_MISSING, 0 );
+	    degrade( COMMAND_DBSTATS, FRESHNESS_MISSING, 0 );
+	    m_databases_known.open();
+	    return;
+	}
+
+	{
+	    PhaseTimer timer(times, PHASE_EXTRACT);
+	    m_extractors.databases(out_vals.pin(dbases), out_vals);
+	    find_databases(out_vals, m_database_names, m_database_rows);
+	}
+	m_databases_known.open();
+	if( !runs(commands, COMMAND_DBSTATS) )
+	    return;
+
+	// dbstats of every database, those due are run
+	vector<BSONObj> dbinfos( m_database_names.size() );
+	vector<string> sizes_on_disk( m_database_names.size() );
+	vector<string> due_names;
+	vector<size_t> due_index;
+	Oid const size_column(".21.1.2");
+	for( size_t i = 0; i < m_database_names.size(); ++i )
+	{
+	    BSONObj const *cached = 0;
+	    if( m_cache )
+	    {
+		OidValueBuffer::const_iterator size_iter = out_vals.lower_bound( size_column + m_database_rows[i] );
+		if( ( size_iter != out_vals.end() ) && ( size_iter->oid == size_column + m_database_rows[i] ) )
+		    sizes_on_disk[i] = size_iter->str();
+		cached = m_cache->lookup_dbstats( m_database_names[i], sizes_on_disk[i] );
+	    }
+
+	    if( cached )
+		dbinfos[i] = *cached;
+	    else
+	    {
+		due_names.push_back( m_database_names[i] );
+		due_index.push_back(i);
+	    }
+	}
+
+	vector<BSONObj> due_infos;
+	{
+	    PhaseTimer timer(times, PHASE_DBSTATS);
+	    m_fanout.run(runner, deadline, due_names, due_infos);
+	}
+	m_fanout.report(out_vals);
+	times.add_latencies(PHASE_DBSTATS, m_fanout.latencies());
+
+	for( size_t k = 0; k < due_index.size(); ++k )
+	{
+	    dbinfos[due_index[k]] = due_infos[k];
+	    if( !due_infos[k].isEmpty() )
+	    {
+		if( m_cache )
+		    m_cache->store_dbstats( due_names[k], sizes_on_disk[due_index[k]], due_infos[k] );
+		continue;
+	    }
+
+	    BSONObj const *last = m_cache ? m_cache->last_dbstats( due_names[k] ) : 0;
+	    degrade( COMMAND_DBSTATS, last ? FRESHNESS_STALE : FRESHNESS_MISSING, 0 );
+	    if( last )
+		dbinfos[due_index[k]] = *last;
+	}
+
+	PhaseTimer timer(times, PHASE_EXTRACT);
+	for( size_t i = 0; i < dbinfos.size(); ++i )
+	    m_extractors.dbstats(out_vals.pin(dbinfos[i]), m_database_rows[i], out_vals);
+    }
+
+private:
+    Poller();
+    Poller(Poller const &);
+    Poller & operator = (Poller const &);
+};
+
+void
+add_query_times(boost::timer::cpu_timer const &db_dur, OidValueBuffer &out_vals)
+{
+    OidValueTuple val( ".99.1", SMI_COUNTER64 );
+    val.set_uint64( db_dur.elapsed().user );
+    out_vals.append( val );
+
+    val.oid = ".99.2";
+    val.set_uint64( db_dur.elapsed().system );
+    out_vals.append( val );
+
+    val.oid = ".99.3";
+    val.set_uint64( db_dur.elapsed().wall );
+    out_vals.append( val );
+}
+
+/*
+ * Per second rates of the counters, exported at .98 followed by the OID
+ * of the counter (e.g. .98.16.2 for opcounters.query). The samples of
+ * two polls are kept as parallel arrays, so the rates come out of one
+ * pass over contiguous memory. mongod restarts are told by its uptime
+ * (.5) going backwards, such a poll only becomes the new base sample.
+ */
+class CounterRates
+{
+public:
+    CounterRates()
+	: m_sources()
+	, m_oids()
+	, m_prev()
+	, m_prev_uptime(0)
+	, m_cur_oids()
+	, m_cur()
+	, m_base()
+	, m_valid()
+	, m_rates()
+	, m_emitted()
+    {
+	static char const * const sources[] = {
+	    ".13.1", ".13.2",   // backgroundFlushing flushes, total_ms
+	    ".15", ".16", ".17", ".19",
+	    ".21.1.14", ".21.1.15", ".21.1.16", ".21.1.17"
+	};
+	m_sources.assign( sources, sources + sizeof(sources) / sizeof(sources[0]) );
+    }
+
+    void update(OidValueBuffer &out_vals)
+    {
+	unsigned long long uptime;
+	if( !get_uptime(out_vals, uptime) )
+	    return;
+
+	// the same sample again (serverStatus from the reply cache) keeps its rates
+	if( !m_oids.empty() && ( uptime == m_prev_uptime ) )
+	{
+	    for( vector<OidValueTuple>::const_iterator ci = m_emitted.begin(); ci != m_emitted.end(); ++ci )
+		out_vals.append(*ci);
+	    return;
+	}
+
+	m_cur_oids.clear();
+	m_cur.clear();
+	for( vector<Oid>::const_iterator src = m_sources.begin(); src != m_sources.end(); ++src )
+	{
+	    std::pair<OidValueBuffer::const_iterator, OidValueBuffer::const_iterator> range = out_vals.prefix_range(*src);
+	    for( OidValueBuffer::const_iterator iter = range.first; iter != range.second; ++iter )
+	    {
+		if( ( SMI_COUNTER64 != iter->type ) || ( OidValueTuple::VAL_UINT64 != iter->kind ) )
+		    continue;
+		m_cur_oids.push_back(iter->oid);
+		m_cur.push_back(iter->v.u64);
+	    }
+	}
+
+	m_emitted.clear();
+	if( !m_oids.empty() && ( uptime > m_prev_uptime ) )
+	{
+	    align();
+	    compute( 1000.0 / ( uptime - m_prev_uptime ) );
+
+	    Oid const rate_root(".98");
+	    for( size_t i = 0; i < m_cur_oids.size(); ++i )
+	    {
+		if( !m_valid[i] )
+		    continue;
+		m_emitted.push_back( OidValueTuple( rate_root + m_cur_oids[i], ASN_OCTET_STR ).set_double( m_rates[i] ) );
+		out_vals.append( m_emitted.back() );
+	    }
+	}
+
+	m_oids.swap(m_cur_oids);
+	m_prev.swap(m_cur);
+	m_prev_uptime = uptime;
+    }
+
+protected:
+    vector<Oid> m_sources;
+
+    vector<Oid> m_oids;                 // previous sample
+    vector<unsigned long long> m_prev;
+    unsigned long long m_prev_uptime;
+
+    vector<Oid> m_cur_oids;             // current sample
+    vector<unsigned long long> m_cur;
+    vector<unsigned long long> m_base;  // previous values in the order of the current sample
+    vector<unsigned char> m_valid;
+    vector<double> m_rates;
+    vector<OidValueTuple> m_emitted;    // rates of the last sample
+
+    static bool get_uptime(OidValueBuffer const &out_vals, unsigned long long &uptime)
+    {
+	Oid const uptime_oid(".5");
+	OidValueBuffer::const_iterator iter = out_vals.lower_bound(uptime_oid);
+	if( ( iter == out_vals.end() ) || !( iter->oid == uptime_oid ) || ( OidValueTuple::VAL_UINT64 != iter->kind ) )
+	    return false;
+
+	uptime = iter->v.u64;
+	return true;
+    }
+
+    /* both samples are sorted, usually they have the same OIDs and nothing is to be done */
+    void align()
+    {
+	size_t const n = m_cur_oids.size();
+	m_valid.assign(n, 1);
+
+	if( m_cur_oids == m_oids )
+	{
+	    m_base = m_prev;
+	    return;
+	}
+
+	m_base.assign(n, 0);
+	size_t p = 0;
+	for( size_t i = 0; i < n; ++i )
+	{
+	    while( ( p < m_oids.size() ) && ( m_oids[p] < m_cur_oids[i] ) )
+		++p;
+	    if( ( p < m_oids.size() ) && ( m_oids[p] == m_cur_oids[i] ) )
+		m_base[i] = m_prev[p];
+	    else
+		m_valid[i] = 0;
+	}
+    }
+
+    void compute(double per_ms_to_sec)
+    {
+	size_t const n = m_cur.size();
+	m_rates.resize(n);
+
+	unsigned long long const *cur = n ? &m_cur[0] : 0;
+	unsigned long long const *base = n ? &m_base[0] : 0;
+	double *rates = n ? &m_rates[0] : 0;
+
+	// branch free, so the compiler can vectorise it; a counter gone backwards yields 0
+	for( size_t i = 0; i < n; ++i )
+	    rates[i] = static_cast<double>( cur[i] - base[i] ) * per_ms_to_sec * ( cur[i] >= base[i] );
+    }
+};
+
+/*
+ * One completed poll. Snapshots are immutable once published, readers
+ * keep the one they got alive until they are done with it.
+ */
+struct Snapshot
+{
+    Snapshot(unsigned long long gen = 0, unsigned a_commands = ALL_COMMANDS)
+	: generation(gen)
+	, commands(a_commands)
+	, out_vals()
+    {}
+
+    unsigned long long generation;
+    unsigned commands;                  // run by the poll
+    OidValueBuffer out_vals;
+};
+
+typedef boost::shared_ptr<Snapshot const> SnapshotPtr;
+
+/* told about every snapshot a collector published */
+struct SnapshotListener
+{
+    virtual ~SnapshotListener() {}
+
+    virtual void published() = 0;
+};
+
+/*
+ * Background collector for daemon mode: keeps one connection to mongod
+ * open, polls every interval seconds and swaps each finished snapshot in
+ * atomically, so a reader never waits for mongod nor sees a half built
+ * result. Only the commands of the --subtree option are run, and those
+ * requests asked for during the last WANTED_POLLS intervals; a command
+ * asked for anew gets a poll right away.
+ */
+class Collector
+{
+public:
+    enum { WANTED_POLLS = 3 };
+
+    Collector(string const &dsn, PollSource const &source, RefreshIntervals const &refresh, unsigned interval,
+	      PollSettings const &settings, unsigned commands)
+	: m_dsn(dsn)
+	, m_source(source)
+	, m_interval(interval)
+	, m_commands(commands)
+	, m_deadline(settings.timeout_ms)
+	, m_runner()
+	, m_poller(settings, &refresh)
+	, m_rates()
+	, m_times()
+	, m_latencies()
+	, m_current()
+	, m_good()
+	, m_good_time()
+	, m_generation(0)
+	, m_listener(0)
+	, m_polled(0)
+    {}
+
+    /* before run() */
+    void set_listener(SnapshotListener *listener) { m_listener = listener; }
+
+    void run()
+    {
+	for(;;)
+	{
+	    boost::system_time next_poll = boost::get_system_time() + boost::posix_time::seconds(m_interval);
+
+	    SnapshotPtr snap;
+	    try
+	    {
+		snap = poll();
+	    }
+	    catch( DBException &e )
+	    {
+		cerr << "collecting from " << m_dsn << " failed: " << e.what() << endl;
+	    }
+	    catch( std::exception &e )
+	    {
+		cerr << "collecting from " << m_dsn << " failed: " << e.what() << endl;
+	    }
+	    if( !snap )
+	    {
+		m_runner.reset(); // reconnect on next poll
+		snap = failed_poll();
+	    }
+	    publish(snap);
+
+	    boost::unique_lock<boost::mutex> lock(m_wanted_mtx);
+	    while( !( wanted() & ~m_polled ) )
+	    {
+		if( !m_wanted_cond.timed_wait(lock, next_poll) )
+		    break;
+	    }
+	}
+    }
+
+    /* a request needs commands, those not in the last poll are run right away */
+    void want(unsigned commands)
+    {
+	boost::lock_guard<boost::mutex> lock(m_wanted_mtx);
+	boost::system_time const now = boost::get_system_time();
+	for( unsigned c = 0; c < COMMAND_COUNT; ++c )
+	{
+	    if( runs( commands, static_cast<PollCommand>(c) ) )
+		m_requested[c] = now;
+	}
+
+	if( commands & ~m_polled )
+	    m_wanted_cond.notify_all();
+    }
+
+    SnapshotPtr current() const
+    {
+	return boost::atomic_load(&m_current);
+    }
+
+    /* waits for a snapshot running commands, but gives up at until and returns what is there, maybe no snapshot */
+    SnapshotPtr wait_current(unsigned commands, boost::system_time const &until)
+    {
+	SnapshotPtr snap = current();
+	if( covers(snap, commands) )
+	    return snap;
+
+	boost::unique_lock<boost::mutex> lock(m_first_mtx);
+	while( !covers( snap = current(), commands ) )
+	{
+	    if( !m_first_cond.timed_wait(lock, until) )
+		return current();
+	}
+
+	return snap;
+    }
+
+protected:
+    string const m_dsn;
+    PollSource const m_source;
+    unsigned const m_interval;
+    unsigned const m_commands;
+    PollDeadline m_deadline;
+    scoped_ptr<CommandRunner> m_runner;
+    Poller m_poller;
+    CounterRates m_rates;
+    PollTimes m_times;
+    LatencyHistogram m_latencies[PHASE_COUNT];
+    SnapshotPtr m_current;
+    SnapshotPtr m_good;                 // of the last poll which did not throw
+    boost::system_time m_good_time;
+    unsigned long long m_generation;
+    SnapshotListener *m_listener;
+
+    boost::mutex m_first_mtx;
+    boost::condition_variable m_first_cond;
+
+    boost::mutex m_wanted_mtx;
+    boost::condition_variable m_wanted_cond;
+    boost::system_time m_requested[COMMAND_COUNT];
+    unsigned m_polled;
+
+    static bool covers(SnapshotPtr const &snap, unsigned commands)
+    {
+	return snap && ( commands == ( snap->commands & commands ) );
+    }
+
+    /* with m_wanted_mtx held */
+    unsigned wanted() const
+    {
+	boost::system_time const since = boost::get_system_time() - boost::posix_time::seconds( WANTED_POLLS * m_interval );
+	unsigned commands = m_commands;
+	for( unsigned c = 0; c < COMMAND_COUNT; ++c )
+	{
+	    if( !m_requested[c].is_not_a_date_time() && ( m_requested[c] > since ) )
+		commands |= 1U << c;
+	}
+	return commands;
+    }
+
+    SnapshotPtr poll()
+    {
+	unsigned commands;
+	{
+	    boost::lock_guard<boost::mutex> lock(m_wanted_mtx);
+	    m_polled = commands = wanted();
+	}
+	boost::shared_ptr<Snapshot> snap( new Snapshot( ++m_generation, commands ) );
+
+	m_times.clear();
+	boost::timer::cpu_timer db_dur;
+	db_dur.start();
+	m_deadline.start();
+	if( !m_runner )
+	    m_runner.reset( open_runner(m_dsn, m_source, m_deadline, m_times) );
+	m_poller.collect(*m_runner, commands, m_deadline, m_times, snap->out_vals);
+	if( m_runner->failed() )
+	    m_runner.reset(); // reconnect on next poll
+	db_dur.stop();
+
+	add_query_times(db_dur, snap->out_vals);
+	m_times.report(snap->out_vals);
+	report_latencies(snap->out_vals);
+	m_rates.update(snap->out_vals);
+	// readers share the snapshot, nothing may be left to sort for them
+	snap->out_vals.index();
+
+	m_good = snap;
+	m_good_time = boost::get_system_time();
+	return snap;
+    }
+
+    /*
+     * A poll which threw still gives a snapshot, so nobody waits for one
+     * forever: the values of the last good poll, with each section of
+     * the poll reported stale at .99.11, or missing without such a poll.
+     */
+    SnapshotPtr failed_poll()
+    {
+	unsigned commands;
+	{
+	    boost::lock_guard<boost::mutex> lock(m_wanted_mtx);
+	    commands = m_polled;
+	}
+	boost::shared_ptr<Snapshot> snap( new Snapshot( ++m_generation, commands ) );
+
+	unsigned stale = 0, age = 0;
+	if( m_good )
+	{
+	    snap->out_vals.append( m_good->out_vals, Oid() );
+	    stale = m_good->commands;
+	    age = static_cast<unsigned>( ( boost::get_system_time() - m_good_time ).total_seconds() );
+	}
+	m_poller.fail( commands, stale, age, m_deadline, snap->out_vals );
+	snap->out_vals.index();
+
+	return snap;
+    }
+
+    /* adds the commands of the last poll to the histograms and exports them at .99.6 */
+    void report_latencies(OidValueBuffer &out_vals)
+    {
+	Oid const entry(".99.6.1");
+
+	for( unsigned p = 0; p < PHASE_COUNT; ++p )
+	{
+	    LatencyHistogram &histogram = m_latencies[p];
+	    vector<boost::timer::nanosecond_type> const &walls = m_times.latencies( static_cast<PollPhase>(p) );
+	    for( vector<boost::timer::nanosecond_type>::const_iterator ci = walls.begin(); ci != walls.end(); ++ci )
+		histogram.add(*ci);
+
+	    if( !histogram.count() )
+		continue;
+
+	    unsigned const row = p + 1;
+	    out_vals.append( OidValueTuple( entry + 1 + row, ASN_OCTET_STR ).set_string_ref( poll_phase_names[p], strlen(poll_phase_names[p]) ) );
+	    out_vals.append( OidValueTuple( entry + 2 + row, SMI_COUNTER64 ).set_uint64( histogram.count() ) );
+	    out_vals.append( OidValueTuple( entry + 3 + row, SMI_COUNTER64 ).set_uint64( histogram.quantile(0.5) ) );
+	    out_vals.append( OidValueTuple( entry + 4 + row, SMI_COUNTER64 ).set_uint64( histogram.quantile(0.99) ) );
+	    out_vals.append( OidValueTuple( entry + 5 + row, SMI_COUNTER64 ).set_uint64( histogram.max() ) );
+	}
+    }
+
+    void publish(SnapshotPtr snap)
+    {
+	boost::atomic_store(&m_current, snap);
+	if( m_listener )
+	    m_listener->published();
+
+	boost::lock_guard<boost::mutex> lock(m_first_mtx);
+	m_first_cond.notify_all();
+    }
+
+private:
+    Collector();
+    Collector(Collector const &);
+    Collector & operator = (Collector const &);
+};
+
+/*
+ * A mongod to monitor, given as [.SUBROOT=]DSN. All values of the
+ * instance are put below SUBROOT, so several instances can share one
+ * result.
+ */
+struct Instance
+{
+    Instance(string const &arg)
+	: subroot()
+	, dsn(arg)
+    {
+	string::size_type eq = arg.find('=');
+	if( ( 0 == arg.find('.') ) && ( string::npos != eq ) )
+	{
+	    subroot = Oid( arg.substr(0, eq) );
+	    dsn = arg.substr(eq + 1);
+	}
+    }
+
+    Oid subroot;
+    string dsn;
+};
+
+/* out_vals gets the values in subtrees only */
+void
+poll_instance(Instance const &instance, PollSource const &source, PollSettings const &settings, Subtrees const &subtrees,
+	      OidValueBuffer &out_vals)
+{
+    Poller poller( settings, 0 );
+    PollDeadline deadline( settings.timeout_ms );
+    PollTimes times;
+    OidValueBuffer polled_vals;
+
+    boost::timer::cpu_timer db_dur;
+    db_dur.start();
+    deadline.start();
+    scoped_ptr<CommandRunner> runner( open_runner(instance.dsn, source, deadline, times) );
+    poller.collect(*runner, subtrees.commands(), deadline, times, polled_vals);
+    db_dur.stop();
+
+    add_query_times(db_dur, polled_vals);
+    times.report(polled_vals);
+    out_vals.append( polled_vals, Oid(), subtrees.roots() );
+}
+
+/*
+ * One-shot poll of several instances with at most concurrency of them in
+ * flight, each on its own connection. An instance failing is reported
+ * and left out, the others make up the result.
+ */
+class InstancePolls
+{
+public:
+    InstancePolls(vector<Instance> const &instances, PollSource const &source, unsigned concurrency, PollSettings const &settings,
+		  Subtrees const &subtrees)
+	: m_instances(instances)
+	, m_source(source)
+	, m_concurrency(concurrency ? concurrency : 1)
+	, m_settings(settings)
+	, m_subtrees(subtrees)
+	, m_results(instances.size())
+	, m_next(0)
+    {}
+
+    void run(OidValueBuffer &out_vals)
+    {
+	m_next = 0;
+
+	boost::thread_group workers;
+	size_t n_workers = std::min<size_t>(m_concurrency, m_instances.size());
+	for( size_t i = 0; i < n_workers; ++i )
+	    workers.create_thread( boost::bind( &InstancePolls::work, this ) );
+	workers.join_all();
+
+	for( size_t i = 0; i < m_instances.size(); ++i )
+	    out_vals.append( m_results[i], m_instances[i].subroot );
+    }
+
+protected:
+    vector<Instance> const &m_instances;
+    PollSource const m_source;
+    unsigned const m_concurrency;
+    PollSettings const m_settings;
+    Subtrees const &m_subtrees;
+    vector<OidValueBuffer> m_results;
+
+    boost::mutex m_mtx;
+    size_t m_next;
+
+    bool next_job(size_t &job)
+    {
+	boost::lock_guard<boost::mutex> lock(m_mtx);
+	if( m_next >= m_instances.size() )
+	    return false;
+	job = m_next++;
+	return true;
+    }
+
+    void work()
+    {
+	size_t job;
+	while( next_job(job) )
+	{
+	    try
+	    {
+		poll_instance( m_instances[job], m_source, m_settings, m_subtrees, m_results[job] );
+	    }
+	    catch( std::exception &e )
+	    {
+		// DBException as well as extraction errors, e.g. a number out of range
+		cerr << "collecting from " << m_instances[job].dsn << " failed: " << e.what() << endl;
+		m_results[job].clear();
+	    }
+	}
+    }
+
+private:
+    InstancePolls();
+    InstancePolls(InstancePolls const &);
+    InstancePolls & operator = (InstancePolls const &);
+};
+
+/*
+ * What the consumer got last: the OIDs with a hash of type and value,
+ * ordered like the result. This is enough to tell added, changed and
+ * removed OIDs apart and small enough for a state file between runs.
+ */
+class DeltaState
+{
+public:
+    DeltaState()
+	: m_generation(0)
+	, m_entries()
+    {}
+
+    unsigned long long generation() const { return m_generation; }
+
+    /*
+     * Appends the values of cur which the consumer does not have yet and
+     * the removed OIDs (as noSuchInstance) to out_vals, which refers to
+     * the strings of cur. The state is cur afterwards.
+     */
+    void diff(OidValueBuffer const &cur, unsigned long long generation, bool full, OidValueBuffer &out_vals)
+    {
+	unsigned long long const base = ( full || !m_generation ) ? 0 : m_generation;
+	vector<Entry> entries;
+	entries.reserve(cur.size());
+
+	vector<Entry>::const_iterator prev = m_entries.begin();
+	for( OidValueBuffer::const_iterator iter = cur.begin(); iter != cur.end(); ++iter )
+	{
+	    Entry e = { iter->oid, value_hash(*iter) };
+	    entries.push_back(e);
+
+	    for( ; prev != m_entries.end() && prev->oid < iter->oid; ++prev )
+	    {
+		if( base )
+		    out_vals.append( OidValueTuple( prev->oid, SNMP_NOSUCHINSTANCE ) );
+	    }
+
+	    bool const known = ( prev != m_entries.end() ) && ( prev->oid == iter->oid );
+	    if( !base || !known || ( prev->hash != e.hash ) )
+		out_vals.append( *iter );
+	    if( known )
+		++prev;
+	}
+	for( ; base && prev != m_entries.end(); ++prev )
+	    out_vals.append( OidValueTuple( prev->oid, SNMP_NOSUCHINSTANCE ) );
+
+	out_vals.append( OidValueTuple( ".99.7.1", SMI_COUNTER64 ).set_uint64( generation ) );
+	out_vals.append( OidValueTuple( ".99.7.2", SMI_COUNTER64 ).set_uint64( base ) );
+
+	m_entries.swap(entries);
+	m_generation = generation;
+    }
+
+    /* a missing or unreadable state file leaves an empty state, the next diff is a full one */
+    bool load(string const &path)
+    {
+	m_generation = 0;
+	m_entries.clear();
+
+	ifstream in( path.c_str() );
+	string magic;
+	unsigned long long generation;
+	if( !( in >> magic >> generation ) || ( magic != "mongodb-stats-delta-1" ) )
+	    return false;
+
+	vector<Entry> entries;
+	string oid;
+	unsigned long long hash;
+	try
+	{
+	    while( in >> oid >> hex >> hash >> dec )
+	    {
+		Entry e = { Oid(oid), hash };
+		entries.push_back(e);
+	    }
+	}
+	catch( std::exception & )
+	{
+	    return false; // malformed oid
+	}
+	if( !in.eof() )
+	    return false;
+
+	m_entries.swap(entries);
+	m_generation = generation;
+	return true;
+    }
+
+    void save(string const &path) const
+    {
+	string const tmp_path = path + ".tmp";
+	ofstream out( tmp_path.c_str(), ios::out | ios::trunc );
+
+	out << "mongodb-stats-delta-1 " << m_generation << "\n";
+	for( vector<Entry>::const_iterator ci = m_entries.begin(); ci != m_entries.end(); ++ci )
+	    out << ci->oid << " " << hex << ci->hash << dec << "\n";
+	out.close();
+
+	if( !out || ( 0 != rename( tmp_path.c_str(), path.c_str() ) ) )
+	    cerr << "saving delta state to " << path << " failed: " << strerror(errno) << endl;
+    }
+
+protected:
+    struct Entry
+    {
+	Oid oid;
+	unsigned long long hash;
+    };
+
+    unsigned long long m_generation;
+    vector<Entry> m_entries;
+
+    /* FNV-1a 64 over type, kind and the native value */
+    static unsigned long long value_hash(OidValueTuple const &val)
+    {
+	unsigned long long h = 14695981039346656037ULL;
+	unsigned char const head[2] = { static_cast<unsigned char>(val.type), val.kind };
+	h = fnv_1a64( h, head, sizeof(head) );
+
+	switch( val.kind )
+	{
+	    case OidValueTuple::VAL_INT:
+		return fnv_1a64( h, &val.v.i, sizeof(val.v.i) );
+	    case OidValueTuple::VAL_UINT:
+		return fnv_1a64( h, &val.v.u, sizeof(val.v.u) );
+	    case OidValueTuple::VAL_UINT64:
+		return fnv_1a64( h, &val.v.u64, sizeof(val.v.u64) );
+	    case OidValueTuple::VAL_DOUBLE:
+		return fnv_1a64( h, &val.v.d, sizeof(val.v.d) );
+	    case OidValueTuple::VAL_STRREF:
+	    case OidValueTuple::VAL_STRING:
+		return fnv_1a64( h, val.str_data(), val.str_size() );
+	}
+
+	return h;
+    }
+
+    static unsigned long long fnv_1a64(unsigned long long h, void const *data, size_t len)
+    {
+	unsigned char const *p = static_cast<unsigned char const *>(data);
+	while( len-- )
+	{
+	    h ^= *p++;
+	    h *= 1099511628211ULL;
+	}
+
+	return h;
+    }
+};
+
+/*
+ * Writes a result for smart-snmpd. The result is formatted straight into
+ * one buffer, which keeps its capacity for the next dump and goes out
+ * with a single write(2).
+ */
+class DumpWriter
+{
+public:
+    DumpWriter(int fd)
+	: m_fd(fd)
+	, m_buf()
+	, m_dumped(false)
+	, m_dump_dur()
+    {}
+
+    virtual ~DumpWriter() {}
+
+    void dump(OidValueBuffer const &out_vals)
+    {
+	boost::timer::cpu_timer dump_dur;
+	dump_dur.start();
+
+	m_buf.clear();
+	format(out_vals);
+	flush();
+
+	dump_dur.stop();
+	m_dump_dur = dump_dur.elapsed();
+	m_dumped = true;
+    }
+
+    /* serialisation phase (.99.5) of the previous dump, if any */
+    void report(OidValueBuffer &out_vals) const
+    {
+	if( m_dumped )
+	    report_phase(PHASE_SERIALIZE, m_dump_dur, out_vals);
+    }
+
+protected:
+    int const m_fd;
+    string m_buf;
+    bool m_dumped;
+    boost::timer::cpu_times m_dump_dur;
+
+    virtual void format(OidValueBuffer const &out_vals) = 0;
+
+    void flush()
+    {
+	if( !write_all( m_fd, m_buf.data(), m_buf.size() ) )
+	    cerr << "writing result failed: " << strerror(errno) << endl;
+    }
+
+private:
+    DumpWriter();
+    DumpWriter(DumpWriter const &);
+    DumpWriter & operator = (DumpWriter const &);
+};
+
+/*
+ * JSON array of [ oid, type, value ] rows. Octet strings are passed
+ * through utf_to_utf only when they are not plain ASCII.
+ */
+class JsonDumpWriter
+    : public DumpWriter
+{
+public:
+    JsonDumpWriter(int fd = STDOUT_FILENO)
+	: DumpWriter(fd)
+    {}
+
+protected:
+    virtual void format(OidValueBuffer const &out_vals)
+    {
+	m_buf.reserve(out_vals.size() * 48 + 8);
+
+	m_buf += "[\n";
+	for( OidValueBuffer::const_iterator iter = out_vals.begin();
+	     iter != out_vals.end();
+	     ++iter )
+	{
+	    if( iter != out_vals.begin() )
+		m_buf += ",\n";
+	    put_row(*iter);
+	}
+	m_buf += "\n]\n";
+    }
+
+    void put_row(OidValueTuple const &val)
+    {
+	char tmp[OID_MAX_ARCS * 11];
+
+	m_buf += "  [ \"";
+	m_buf.append( tmp, val.oid.format(tmp) );
+	m_buf += "\", ";
+	m_buf.append( tmp, snprintf( tmp, sizeof(tmp), "%u", val.type ) );
+	m_buf += ", ";
+	if( ( ASN_NULL == val.type ) || ( OidValueTuple::VAL_NONE == val.kind ) )
+	    m_buf += "null";
+	else if( ASN_OCTET_STR == val.type )
+	{
+	    m_buf += "\"";
+	    if( val.is_string() )
+		put_utf8( val.str_data(), val.str_size() );
+	    else
+		m_buf.append( tmp, val.format_number(tmp) );
+	    m_buf += "\"";
+	}
+	else if( val.is_string() )
+	    m_buf.append( val.str_data(), val.str_size() );
+	else
+	    m_buf.append( tmp, val.format_number(tmp) );
+	m_buf += " ]";
+    }
+
+    static bool is_ascii(char const *s, size_t n)
+    {
+	char const *end = s + n;
+
+	// eight bytes per step, any set high bit is non-ASCII
+	for( ; s + sizeof(unsigned long long) <= end; s += sizeof(unsigned long long) )
+	{
+	    unsigned long long word;
+	    memcpy( &word, s, sizeof(word) );
+	    if( word & 0x8080808080808080ULL )
+		return false;
+	}
+
+	for( ; s < end; ++s )
+	{
+	    if( *s & 0x80 )
+		return false;
+	}
+
+	return true;
+    }
+
+    void put_utf8(char const *s, size_t n)
+    {
+	if( is_ascii(s, n) )
+	    m_buf.append(s, n);
+	else
+	    m_buf += boost::locale::conv::utf_to_utf<char>( s, s + n );
+    }
+};
+
+/*
+ * Stream of BER encoded VarBinds, each preceded by its length as 32 bit
+ * big endian integer:
+ *
+ *   SEQUENCE { RELATIVE-OID (below the MIB root), value }
+ *
+ * The value is encoded with the ASN.1/SMI type of the OID, numbers which
+ * go out as octet string (doubles) in their text form.
+ */
+class BerDumpWriter
+    : public DumpWriter
+{
+public:
+    BerDumpWriter(int fd = STDOUT_FILENO)
+	: DumpWriter(fd)
+    {}
+
+protected:
+    virtual void format(OidValueBuffer const &out_vals)
+    {
+	m_buf.reserve(out_vals.size() * 24);
+
+	for( OidValueBuffer::const_iterator iter = out_vals.begin();
+	     iter != out_vals.end();
+	     ++iter )
+	{
+	    put_varbind(*iter);
+	}
+    }
+
+    void put_varbind(OidValueTuple const &val)
+    {
+	unsigned char oid[OID_MAX_ARCS * 5], num[OID_VALUE_FORMAT_SIZE];
+	size_t oid_len = encode_oid(val.oid, oid), val_len;
+	unsigned char const *val_data;
+
+	if( ( ASN_NULL == val.type ) || ( OidValueTuple::VAL_NONE == val.kind ) )
+	{
+	    val_data = num;
+	    val_len = 0;
+	}
+	else if( val.is_string() )
+	{
+	    val_data = reinterpret_cast<unsigned char const *>(val.str_data());
+	    val_len = val.str_size();
+	}
+	else if( ASN_OCTET_STR == val.type )
+	{
+	    val_data = num;
+	    val_len = val.format_number( reinterpret_cast<char *>(num) );
+	}
+	else
+	{
+	    val_data = num;
+	    val_len = encode_integer(val, num);
+	}
+
+	size_t seq_len = 1 + length_size(oid_len) + oid_len + 1 + length_size(val_len) + val_len;
+	size_t vb_len = 1 + length_size(seq_len) + seq_len;
+
+	m_buf += static_cast<char>( ( vb_len >> 24 ) & 0xFF );
+	m_buf += static_cast<char>( ( vb_len >> 16 ) & 0xFF );
+	m_buf += static_cast<char>( ( vb_len >> 8 ) & 0xFF );
+	m_buf += static_cast<char>( vb_len & 0xFF );
+
+	m_buf += static_cast<char>( ASN_SEQ_CON );
+	put_length(seq_len);
+	m_buf += static_cast<char>( ASN_RELATIVE_OID );
+	put_length(oid_len);
+	m_buf.append( reinterpret_cast<char const *>(oid), oid_len );
+	m_buf += static_cast<char>( val.type );
+	put_length(val_len);
+	m_buf.append( reinterpret_cast<char const *>(val_data), val_len );
+    }
+
+    /* base 128 arcs, high bit set on all but the last byte of an arc */
+    static size_t encode_oid(Oid const &oid, unsigned char *out)
+    {
+	size_t n = 0;
+	for( unsigned i = 0; i < oid.size(); ++i )
+	{
+	    unsigned arc = oid[i];
+	    unsigned shift = 28;
+	    while( shift && !( arc >> shift ) )
+		shift -= 7;
+	    for( ; shift; shift -= 7 )
+		out[n++] = 0x80 | ( ( arc >> shift ) & 0x7F );
+	    out[n++] = arc & 0x7F;
+	}
+
+	return n;
+    }
+
+    /* shortest two's complement (INTEGER) or unsigned (SMI types) content octets */
+    static size_t encode_integer(OidValueTuple const &val, unsigned char *out)
+    {
+	unsigned long long u;
+	bool negative = false;
+
+	switch( val.kind )
+	{
+	    case OidValueTuple::VAL_INT:
+		negative = val.v.i < 0;
+		u = static_cast<unsigned long long>( static_cast<long long>(val.v.i) );
+		break;
+	    case OidValueTuple::VAL_UINT:
+		u = val.v.u;
+		break;
+	    case OidValueTuple::VAL_UINT64:
+		u = val.v.u64;
+		break;
+	    case OidValueTuple::VAL_DOUBLE:
+		negative = val.v.d < 0;
+		u = static_cast<unsigned long long>( static_cast<long long>(val.v.d) );
+		break;
+	    default:
+		u = 0;
+		break;
+	}
+
+	unsigned char be[9];
+	size_t n = 0;
+	be[n++] = negative ? 0xFF : 0x00; // sign octet, dropped below when redundant
+	for( int shift = 56; shift >= 0; shift -= 8 )
+	    be[n++] = ( u >> shift ) & 0xFF;
+
+	size_t first = 0;
+	while( first < n - 1 )
+	{
+	    unsigned char sign = ( be[first + 1] & 0x80 ) ? 0xFF : 0x00;
+	    if( be[first] != sign )
+		break;
+	    ++first;
+	}
+
+	memcpy( out, be + first, n - first );
+	return n - first;
+    }
+
+    static size_t length_size(size_t len)
+    {
+	size_t n = 1;
+	if( len >= ASN_LONG_LEN )
+	{
+	    for( ; len; len >>= 8 )
+		++n;
+	}
+
+	return n;
+    }
+
+    void put_length(size_t len)
+    {
+	if( len < ASN_LONG_LEN )
+	{
+	    m_buf += static_cast<char>(len);
+	    return;
+	}
+
+	size_t n = length_size(len) - 1;
+	m_buf += static_cast<char>( ASN_LONG_LEN | n );
+	while( n-- )
+	    m_buf += static_cast<char>( ( len >> ( n * 8 ) ) & 0xFF );
+    }
+};
+
+/*
+ * Publishes snapshots into the file ShmSnapshotReader reads (see
+ * shm_snapshot.h). The file is set up under a temporary name and renamed
+ * into place, readers of an earlier run tell by replaced(). A snapshot
+ * outgrowing its slot moves the slot to the end of the grown file.
+ */
+class ShmExport
+{
+public:
+    ShmExport(string const &path)
+	: m_path(path)
+	, m_fd(-1)
+	, m_map(0)
+	, m_size(0)
+	, m_entries()
+	, m_arcs()
+	, m_strings()
+    {
+	string const tmp_path = path + ".tmp";
+	m_fd = open( tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	if( m_fd < 0 )
+	    throw runtime_error( "can't create snapshot '" + tmp_path + "': " + strerror(errno) );
+
+	// both slots start empty, the file is zero filled: generation 0 without entries
+	size_t const first = align( sizeof(ShmSnapshotHeader) ), slot_size = align( sizeof(ShmSlotHeader) );
+	resize( first + 2 * slot_size );
+
+	ShmSnapshotHeader *hdr = header();
+	memcpy( hdr->magic, SHM_SNAPSHOT_MAGIC, sizeof(hdr->magic) );
+	hdr->version = SHM_SNAPSHOT_VERSION;
+	hdr->current = 0;
+	for( unsigned s = 0; s < 2; ++s )
+	{
+	    hdr->slots[s].offset = first + s * slot_size;
+	    hdr->slots[s].size = slot_size;
+	}
+
+	if( 0 != rename( tmp_path.c_str(), path.c_str() ) )
+	{
+	    munmap( m_map, m_size );
+	    close(m_fd);
+	    throw runtime_error( "can't rename snapshot to '" + path + "': " + strerror(errno) );
+	}
+    }
+
+    ~ShmExport()
+    {
+	munmap( m_map, m_size );
+	close(m_fd);
+    }
+
+    void publish(OidValueBuffer const &vals, unsigned long long generation)
+    {
+	m_entries.clear();
+	m_arcs.clear();
+	m_strings.clear();
+	m_entries.reserve( vals.size() );
+	for( OidValueBuffer::const_iterator iter = vals.begin(); iter != vals.end(); ++iter )
+	    add_entry(*iter);
+
+	size_t const need = sizeof(ShmSlotHeader) + m_entries.size() * sizeof(ShmEntry) +
+	    m_arcs.size() * sizeof(uint32_t) + m_strings.size();
+
+	// the slot readers are not sent to, under its sequence lock
+	unsigned const slot = 1 - ( header()->current & 1 );
+	ShmSlotRef volatile *ref = &header()->slots[slot];
+	ref->seq = ref->seq + 1;
+	shm_barrier();
+
+	if( need > ref->size )
+	{
+	    size_t const offset = align(m_size), size = align( need + need / 2 );
+	    try
+	    {
+		resize( offset + size );
+	    }
+	    catch(...)
+	    {
+		// the slot stays as it was, the next publish must find its lock released
+		shm_barrier();
+		ref->seq = ref->seq + 1;
+		throw;
+	    }
+	    ref = &header()->slots[slot];
+	    ref->offset = offset;
+	    ref->size = size;
+	}
+
+	char *p = m_map + ref->offset;
+	ShmSlotHeader *sh = reinterpret_cast<ShmSlotHeader *>(p);
+	sh->generation = generation;
+	sh->n_entries = m_entries.size();
+	sh->n_arcs = m_arcs.size();
+	sh->data_size = m_strings.size();
+	p += sizeof(ShmSlotHeader);
+	if( !m_entries.empty() )
+	    memcpy( p, &m_entries[0], m_entries.size() * sizeof(ShmEntry) );
+	p += m_entries.size() * sizeof(ShmEntry);
+	if( !m_arcs.empty() )
+	    memcpy( p, &m_arcs[0], m_arcs.size() * sizeof(uint32_t) );
+	p += m_arcs.size() * sizeof(uint32_t);
+	m_strings.copy( p, m_strings.size() );
+
+	shm_barrier();
+	ref->seq = ref->seq + 1;
+	shm_barrier();
+	static_cast<ShmSnapshotHeader volatile *>( header() )->current = slot;
+	shm_barrier();
+    }
+
+protected:
+    string const m_path;
+    int m_fd;
+    char *m_map;
+    size_t m_size;
+    vector<ShmEntry> m_entries;
+    vector<uint32_t> m_arcs;
+    string m_strings;
+
+    static size_t align(size_t n)
+    {
+	return ( n + SHM_ALIGN - 1 ) / SHM_ALIGN * SHM_ALIGN;
+    }
+
+    ShmSnapshotHeader * header() const
+    {
+	return reinterpret_cast<ShmSnapshotHeader *>(m_map);
+    }
+
+    void resize(size_t size)
+    {
+	if( 0 != ftruncate( m_fd, size ) )
+	    throw runtime_error( "can't grow snapshot '" + m_path + "': " + strerror(errno) );
+
+	void *map = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0 );
+	if( MAP_FAILED == map )
+	    throw runtime_error( "can't map snapshot '" + m_path + "': " + strerror(errno) );
+
+	if( m_map )
+	    munmap( m_map, m_size );
+	m_map = static_cast<char *>(map);
+	m_size = size;
+    }
+
+    void add_entry(OidValueTuple const &val)
+    {
+	ShmEntry e;
+	memset( &e, 0, sizeof(e) );
+	e.first_arc = m_arcs.size();
+	e.n_arcs = val.oid.size();
+	e.type = val.type;
+	m_arcs.insert( m_arcs.end(), val.oid.arcs, val.oid.arcs + val.oid.size() );
+
+	switch( val.kind )
+	{
+	    case OidValueTuple::VAL_INT:
+		e.kind = SHM_VAL_INT;
+		e.value = static_cast<int64_t>(val.v.i);
+		break;
+	    case OidValueTuple::VAL_UINT:
+		e.kind = SHM_VAL_UINT;
+		e.value = val.v.u;
+		break;
+	    case OidValueTuple::VAL_UINT64:
+		e.kind = SHM_VAL_UINT64;
+		e.value = val.v.u64;
+		break;
+	    case OidValueTuple::VAL_DOUBLE:
+		e.kind = SHM_VAL_DOUBLE;
+		memcpy( &e.value, &val.v.d, sizeof(e.value) );
+		break;
+	    case OidValueTuple::VAL_STRREF:
+	    case OidValueTuple::VAL_STRING:
+		e.kind = SHM_VAL_STRING;
+		e.value = m_strings.size();
+		e.len = val.str_size();
+		m_strings.append( val.str_data(), val.str_size() );
+		break;
+	    default:
+		e.kind = SHM_VAL_NONE;
+		break;
+	}
+
+	m_entries.push_back(e);
+    }
+
+private:
+    ShmExport();
+    ShmExport(ShmExport const &);
+    ShmExport & operator = (ShmExport const &);
+};
+
+/*
+ * Daemon mode: merges the latest snapshots of all collectors into one
+ * whenever one of them published one, for the readers not going through
+ * stdin requests: the shared memory snapshot and the AgentX subagent.
+ */
+class SnapshotMerger
+    : public SnapshotListener
+{
+public:
+    SnapshotMerger(vector< boost::shared_ptr<Collector> > const &collectors, vector<Instance> const &instances,
+		   Subtrees const &subtrees, ShmExport *shm /* 0: no shared memory snapshot */)
+	: SnapshotListener()
+	, m_collectors(collectors)
+	, m_instances(instances)
+	, m_subtrees(subtrees)
+	, m_export(shm)
+	, m_dirty(false)
+	, m_current()
+    {}
+
+    virtual void published()
+    {
+	boost::lock_guard<boost::mutex> lock(m_mtx);
+	m_dirty = true;
+	m_cond.notify_all();
+    }
+
+    void run()
+    {
+	for(;;)
+	{
+	    {
+		boost::unique_lock<boost::mutex> lock(m_mtx);
+		while( !m_dirty )
+		    m_cond.wait(lock);
+		m_dirty = false;
+	    }
+
+	    unsigned long long generation = 0;
+	    boost::shared_ptr<Snapshot> merged( new Snapshot() );
+	    for( size_t i = 0; i < m_collectors.size(); ++i )
+	    {
+		SnapshotPtr snap = m_collectors[i]->current();
+		if( !snap )
+		    continue;
+		generation += snap->generation;
+		merged->out_vals.append( snap->out_vals, m_instances[i].subroot, m_subtrees.roots() );
+	    }
+	    merged->generation = generation;
+	    merged->out_vals.index();
+
+	    try
+	    {
+		if( m_export )
+		    m_export->publish(merged->out_vals, generation);
+	    }
+	    catch( std::exception &e )
+	    {
+		// e.g. no space left to grow the file, readers keep the last snapshot
+		cerr << e.what() << ", snapshot not published" << endl;
+	    }
+
+	    boost::atomic_store( &m_current, SnapshotPtr(merged) );
+	    boost::lock_guard<boost::mutex> lock(m_mtx);
+	    m_cond.notify_all();
+	}
+    }
+
+    SnapshotPtr current() const
+    {
+	return boost::atomic_load(&m_current);
+    }
+
+    SnapshotPtr wait_current()
+    {
+	boost::unique_lock<boost::mutex> lock(m_mtx);
+	SnapshotPtr snap;
+	while( !( snap = current() ) )
+	    m_cond.wait(lock);
+	return snap;
+    }
+
+protected:
+    vector< boost::shared_ptr<Collector> > const &m_collectors;
+    vector<Instance> const &m_instances;
+    Subtrees const &m_subtrees;
+    ShmExport *m_export;
+
+    boost::mutex m_mtx;
+    boost::condition_variable m_cond;
+    bool m_dirty;
+    SnapshotPtr m_current;
+
+private:
+    SnapshotMerger();
+    SnapshotMerger(SnapshotMerger const &);
+    SnapshotMerger & operator = (SnapshotMerger const &);
+};
+
+/*
+ * Daemon mode: AgentX (RFC 2741) subagent registered at the master agent
+ * (smart-snmpd, net-snmp, ...) for the MIB below root. GET, GETNEXT and
+ * GETBULK are answered by binary searches in the sorted merged snapshot,
+ * so a walk costs O(log n) per varbind and no process start. Registered
+ * once the first snapshot is there, a lost master is connected again
+ * every RECONNECT_SECONDS.
+ */
+class AgentXSubagent
+{
+public:
+    enum { RECONNECT_SECONDS = 5 };
+
+    AgentXSubagent(string const &socket_path, AgentXOid const &root, SnapshotMerger &snapshots)
+	: m_socket_path(socket_path)
+	, m_root(root)
+	, m_snapshots(snapshots)
+	, m_started( boost::get_system_time() )
+	, m_packet_id(0)
+	, m_session_id(0)
+	, m_out()
+	, m_payload()
+	, m_ranges()
+    {}
+
+    void run()
+    {
+	m_snapshots.wait_current();
+
+	for(;;)
+	{
+	    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	    struct sockaddr_un addr;
+	    if( ( fd < 0 ) || !agentx_socket_address( m_socket_path, addr ) ||
+		( 0 != connect( fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr) ) ) )
+		cerr << "can't connect to agentx master " << m_socket_path << ": " << strerror(errno) << endl;
+	    else if( open_session(fd) )
+		serve(fd);
+
+	    if( fd >= 0 )
+		close(fd);
+	    boost::this_thread::sleep( boost::posix_time::seconds( static_cast<long>(RECONNECT_SECONDS) ) );
+	}
+    }
+
+protected:
+    string const m_socket_path;
+    AgentXOid const m_root;
+    SnapshotMerger &m_snapshots;
+    boost::system_time const m_started;
+    uint32_t m_packet_id;
+    uint32_t m_session_id;
+    AgentXPduWriter m_out;
+    string m_payload;
+    vector< std::pair<AgentXOid, AgentXOid> > m_ranges;
+
+    /* sysUpTime of the responses */
+    uint32_t uptime() const
+    {
+	return ( boost::get_system_time() - m_started ).total_milliseconds() / 10;
+    }
+
+    /* sends m_out and waits for its response, false unless that tells success */
+    bool request(int fd, char const *what)
+    {
+	uint32_t const packet_id = m_packet_id;
+	if( !agentx_write_pdu( fd, m_out.end() ) )
+	{
+	    cerr << "agentx " << what << " failed: " << strerror(errno) << endl;
+	    return false;
+	}
+
+	AgentXHeader h;
+	while( agentx_read_pdu( fd, h, m_payload ) )
+	{
+	    if( ( AGENTX_RESPONSE_PDU != h.type ) || ( packet_id != h.packet_id ) )
+		continue;
+
+	    AgentXPduReader in( m_payload.data(), m_payload.size(), h.flags );
+	    uint32_t sys_uptime;
+	    unsigned error, index;
+	    if( !in.get_u32(sys_uptime) || !in.get_u16(error) || !in.get_u16(index) )
+		break;
+	    if( AGENTX_NOERROR != error )
+	    {
+		cerr << "agentx " << what << " failed: error " << error << endl;
+		return false;
+	    }
+
+	    m_session_id = h.session_id;
+	    return true;
+	}
+
+	cerr << "agentx " << what << " failed: master hung up" << endl;
+	return false;
+    }
+
+    bool open_session(int fd)
+    {
+	static char const descr[] = "mongodb-stats";
+
+	m_out.begin( AGENTX_OPEN_PDU, 0, 0, 0, ++m_packet_id );
+	m_out.put_u8(0);                // timeout: the master's default
+	m_out.put_u8(0);
+	m_out.put_u16(0);
+	m_out.put_oid( AgentXOid() );
+	m_out.put_octets( descr, sizeof(descr) - 1 );
+	if( !request(fd, "open") )
+	    return false;
+
+	m_out.begin( AGENTX_REGISTER_PDU, 0, m_session_id, 0, ++m_packet_id );
+	m_out.put_u8(0);                // timeout
+	m_out.put_u8(127);              // default priority
+	m_out.put_u8(0);                // no range
+	m_out.put_u8(0);
+	m_out.put_oid(m_root);
+	return request(fd, "register");
+    }
+
+    /* answers the master until it closes the session or hangs up */
+    void serve(int fd)
+    {
+	AgentXHeader h;
+	while( agentx_read_pdu( fd, h, m_payload ) )
+	{
+	    switch( h.type )
+	    {
+		case AGENTX_GET_PDU:
+		case AGENTX_GETNEXT_PDU:
+		case AGENTX_GETBULK_PDU:
+		    answer(h);
+		    break;
+		case AGENTX_TESTSET_PDU:
+		    begin_response(h, AGENTX_NOTWRITABLE, 1);
+		    break;
+		case AGENTX_COMMITSET_PDU:
+		case AGENTX_UNDOSET_PDU:
+		    begin_response(h, AGENTX_NOERROR, 0);
+		    break;
+		case AGENTX_CLOSE_PDU:
+		    cerr << "agentx master closed the session" << endl;
+		    return;
+		default:
+		    // responses to nothing we sent, CleanupSet
+		    continue;
+	    }
+
+	    if( !agentx_write_pdu( fd, m_out.end() ) )
+		break;
+	}
+
+	cerr << "lost agentx master " << m_socket_path << endl;
+    }
+
+    void begin_response(AgentXHeader const &h, unsigned error, unsigned index)
+    {
+	m_out.begin( AGENTX_RESPONSE_PDU, 0, h.session_id, h.transaction_id, h.packet_id );
+	m_out.put_u32( uptime() );
+	m_out.put_u16(error);
+	m_out.put_u16(index);
+    }
+
+    void answer(AgentXHeader const &h)
+    {
+	AgentXPduReader in( m_payload.data(), m_payload.size(), h.flags );
+	string context;
+	unsigned non_repeaters = 0, max_repetitions = 0;
+	bool ok = ( !( h.flags & AGENTX_NON_DEFAULT_CONTEXT ) || in.get_octets(context) ) &&
+	    ( ( AGENTX_GETBULK_PDU != h.type ) || ( in.get_u16(non_repeaters) && in.get_u16(max_repetitions) ) );
+
+	m_ranges.clear();
+	while( ok && !in.at_end() )
+	{
+	    m_ranges.push_back( std::make_pair( AgentXOid(), AgentXOid() ) );
+	    ok = in.get_oid( m_ranges.back().first ) && in.get_oid( m_ranges.back().second );
+	}
+	if( !ok )
+	{
+	    begin_response(h, AGENTX_PARSEERROR, 0);
+	    return;
+	}
+
+	begin_response(h, AGENTX_NOERROR, 0);
+	SnapshotPtr snap = m_snapshots.current();
+	OidValueBuffer const &vals = snap->out_vals;
+
+	if( AGENTX_GET_PDU == h.type )
+	{
+	    for( size_t i = 0; i < m_ranges.size(); ++i )
+		put_exact( vals, m_ranges[i].first );
+	    return;
+	}
+
+	size_t const repeaters_from = AGENTX_GETBULK_PDU == h.type ? std::min<size_t>( non_repeaters, m_ranges.size() ) : m_ranges.size();
+	for( size_t i = 0; i < repeaters_from; ++i )
+	    put_next( vals, m_ranges[i].first, m_ranges[i].second );
+
+	// every repetition goes on after the varbind of the previous one until all repeaters ended
+	for( unsigned r = 0; r < max_repetitions; ++r )
+	{
+	    bool more = false;
+	    for( size_t i = repeaters_from; i < m_ranges.size(); ++i )
+		more = put_next( vals, m_ranges[i].first, m_ranges[i].second ) || more;
+	    if( !more )
+		break;
+	}
+    }
+
+    /* the OID relative to m_root, false if it is not below it */
+    bool relative(AgentXOid const &oid, Oid &rel, bool &truncated) const
+    {
+	if( ( oid.n_subid < m_root.n_subid ) || !std::equal( m_root.subids, m_root.subids + m_root.n_subid, oid.subids ) )
+	    return false;
+
+	// no value is longer than OID_MAX_ARCS, those following a longer OID follow its truncation
+	truncated = oid.n_subid - m_root.n_subid > OID_MAX_ARCS;
+	rel = Oid( oid.subids + m_root.n_subid, oid.subids + std::min<unsigned>( oid.n_subid, m_root.n_subid + OID_MAX_ARCS ) );
+	return true;
+    }
+
+    void full_name(OidValueTuple const &val, AgentXOid &name) const
+    {
+	std::copy( m_root.subids, m_root.subids + m_root.n_subid, name.subids );
+	std::copy( val.oid.arcs, val.oid.arcs + val.oid.size(), name.subids + m_root.n_subid );
+	name.n_subid = m_root.n_subid + val.oid.size();
+	name.include = false;
+    }
+
+    void put_exact(OidValueBuffer const &vals, AgentXOid &name)
+    {
+	name.include = false;
+	Oid rel;
+	bool truncated;
+	if( !relative(name, rel, truncated) || truncated || rel.empty() )
+	{
+	    m_out.put_varbind_header(AGENTX_NOSUCHOBJECT, name);
+	    return;
+	}
+
+	OidValueBuffer::const_iterator iter = vals.lower_bound(rel);
+	if( ( iter == vals.end() ) || !( iter->oid == rel ) )
+	{
+	    // the object (table column or item) exists if a value shares the arcs before the instance
+	    Oid const object( rel.arcs, rel.arcs + rel.size() - 1 );
+	    bool const exists = !object.empty() &&
+		( ( ( iter != vals.end() ) && object.is_prefix_of(iter->oid) ) ||
+		  ( ( iter != vals.begin() ) && object.is_prefix_of( ( iter - 1 )->oid ) ) );
+	    m_out.put_varbind_header( exists ? AGENTX_NOSUCHINSTANCE : AGENTX_NOSUCHOBJECT, name );
+	    return;
+	}
+
+	put_value(name, *iter);
+    }
+
+    /* puts the varbind after start and moves start to it, false at endOfMibView */
+    bool put_next(OidValueBuffer const &vals, AgentXOid &start, AgentXOid const &end)
+    {
+	OidValueBuffer::const_iterator iter = vals.end();
+	Oid rel;
+	bool truncated;
+	if( relative(start, rel, truncated) )
+	{
+	    iter = vals.lower_bound(rel);
+	    if( ( iter != vals.end() ) && ( iter->oid == rel ) && ( !start.include || truncated ) )
+		++iter;
+	}
+	else if( agentx_compare(start, m_root) < 0 )
+	    iter = vals.begin();
+
+	AgentXOid name;
+	if( iter != vals.end() )
+	    full_name(*iter, name);
+	if( ( iter == vals.end() ) || ( end.n_subid && ( agentx_compare(name, end) >= 0 ) ) )
+	{
+	    start.include = false;
+	    m_out.put_varbind_header(AGENTX_ENDOFMIBVIEW, start);
+	    return false;
+	}
+
+	put_value(name, *iter);
+	start = name;
+	return true;
+    }
+
+    void put_value(AgentXOid const &name, OidValueTuple const &val)
+    {
+	switch( val.type )
+	{
+	    case ASN_INTEGER:
+		m_out.put_varbind_header(AGENTX_INTEGER, name);
+		m_out.put_u32( static_cast<uint32_t>( number(val) ) );
+		break;
+	    case SMI_COUNTER:
+		m_out.put_varbind_header(AGENTX_COUNTER32, name);
+		m_out.put_u32( static_cast<uint32_t>( number(val) ) );
+		break;
+	    case SMI_GAUGE:
+	    case SMI_UINTEGER:
+		m_out.put_varbind_header(AGENTX_GAUGE32, name);
+		m_out.put_u32( static_cast<uint32_t>( number(val) ) );
+		break;
+	    case SMI_TIMETICKS:
+		m_out.put_varbind_header(AGENTX_TIMETICKS, name);
+		m_out.put_u32( static_cast<uint32_t>( number(val) ) );
+		break;
+	    case SMI_COUNTER64:
+		m_out.put_varbind_header(AGENTX_COUNTER64, name);
+		m_out.put_u64( number(val) );
+		break;
+	    case ASN_OCTET_STR:
+		m_out.put_varbind_header(AGENTX_OCTET_STRING, name);
+		if( val.is_string() )
+		    m_out.put_octets( val.str_data(), val.str_size() );
+		else
+		{
+		    char buf[OID_VALUE_FORMAT_SIZE];
+		    m_out.put_octets( buf, val.format_number(buf) );
+		}
+		break;
+	    default:
+		m_out.put_varbind_header(AGENTX_NULL, name);
+		break;
+	}
+    }
+
+    static uint64_t number(OidValueTuple const &val)
+    {
+	switch( val.kind )
+	{
+	    case OidValueTuple::VAL_INT:
+		return static_cast<int64_t>(val.v.i);
+	    case OidValueTuple::VAL_UINT:
+		return val.v.u;
+	    case OidValueTuple::VAL_UINT64:
+		return val.v.u64;
+	    case OidValueTuple::VAL_DOUBLE:
+		return static_cast<int64_t>(val.v.d);
+	}
+
+	return 0;
+    }
+
+private:
+    AgentXSubagent();
+    AgentXSubagent(AgentXSubagent const &);
+    AgentXSubagent & operator = (AgentXSubagent const &);
+};
+
+DumpWriter *
+make_dump_writer(string const &output)
+{
+    if( "json" == output )
+	return new JsonDumpWriter();
+    if( "ber" == output )
+	return new BerDumpWriter();
+
+    return 0;
+}
+
+#ifndef WATCH_MONGODB_NO_MAIN
+int
+main(int argc, char *argv[])
+{
+    try
+    {
+	options_description desc("Allowed options");
+	desc.add_options()
+	    ("help", "produce help message")
+	    ("dsn", value< vector<string> >()->composing(),
+	     "set mongodb dsn as [.SUBROOT=]DSN, repeat for several instances (each below its own SUBROOT)")
+	    ("daemon", "keep running and collect in background, dump the latest result for each line read from stdin")
+	    ("interval", value<unsigned>()->default_value(60), "seconds between two polls in daemon mode")
+	    ("dbstats-concurrency", value<unsigned>()->default_value(4), "maximum number of dbstats commands running at once")
+	    ("poll-timeout", value<unsigned>()->default_value(0),
+	     "milliseconds a poll may take: commands still running then give up (socket timeout) and are not started any "
+	     "more, their sections are sent from the last good poll if there is one (daemon mode), see .99.11; 0 for none")
+	    ("collstats-budget", value<unsigned>()->default_value(0),
+	     "milliseconds each poll may spend on listCollections and collStats for the collection tables (.22, .23), "
+	     "picking up where the last poll stopped in daemon mode; 0 leaves them out")
+	    ("instance-concurrency", value<unsigned>()->default_value(8), "maximum number of instances polled at once")
+	    ("output", value<string>()->default_value("json"), "output format: json or ber (length prefixed BER VarBinds)")
+	    ("delta", "output only values changed since the previous dump, removed ones as noSuchInstance")
+	    ("state-file", value<string>(), "file keeping the previous dump for --delta without --daemon")
+	    ("full", "with --state-file: output all values against base 0, resyncing the consumer")
+	    ("record", value<string>(), "append the raw reply of every command to a capture file")
+	    ("replay", value<string>(), "poll from a capture file made by --record instead of mongod (no --dsn needed)")
+	    ("refresh", value< vector<string> >()->composing(),
+	     "daemon mode: refresh a section only every SECONDS as SECTION=SECONDS, SECTION is serverStatus, replSetGetStatus or dbstats")
+	    ("subtree", value< vector<string> >()->composing(),
+	     "output only these OID subtrees (e.g. .12,.20) and run only the commands feeding them, "
+	     "daemon requests may name their own as a line with the OIDs")
+	    ("shm", value<string>(),
+	     "daemon mode: publish every snapshot into this file for readers mapping it (see shm_snapshot.h), "
+	     "keeps running when stdin is closed")
+	    ("agentx", value<string>()->implicit_value(AGENTX_DEFAULT_SOCKET),
+	     "daemon mode: register as AgentX subagent at the master agent listening on this Unix socket, "
+	     "keeps running when stdin is closed")
+	    ("agentx-root", value<string>(), "full OID the MIB is registered under with --agentx, e.g. .1.3.6.1.4.1.99999.1")
+	    ;
+	variables_map vm;
+	store( parse_command_line( argc, argv, desc ), vm );
+	notify(vm);
+
+	if( vm.count("help") )
+	{
+	    cout << desc << endl;
+	    return 1;
+	}
+
+	if( ( vm.count("dsn") == 0 ) && ( vm.count("replay") == 0 ) )
+	{
+	    cerr << desc << endl;
+	    return 255;
+	}
+
+	vector<Instance> instances;
+	if( vm.count("dsn") )
+	{
+	    vector<string> const &dsns = vm["dsn"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = dsns.begin(); ci != dsns.end(); ++ci )
+	    {
+		instances.push_back( Instance(*ci) );
+		if( ( dsns.size() > 1 ) && instances.back().subroot.empty() )
+		{
+		    cerr << "every instance needs its own SUBROOT: " << *ci << endl;
+		    return 255;
+		}
+	    }
+	}
+	else
+	    instances.push_back( Instance( vm["replay"].as<string>() ) );
 
-	dump(out_vals);
+	// a capture holds the replies of one instance
+	scoped_ptr<CaptureWriter> record;
+	scoped_ptr<CaptureReplay> replay;
+	if( vm.count("record") || vm.count("replay") )
+	{
+	    if( ( instances.size() > 1 ) || ( vm.count("record") && vm.count("replay") ) )
+	    {
+		cerr << "--record and --replay take a single instance and exclude each other" << endl;
+		return 255;
+	    }
+
+	    if( vm.count("record") )
+		record.reset( new CaptureWriter( vm["record"].as<string>() ) );
+	    else
+		replay.reset( new CaptureReplay( vm["replay"].as<string>() ) );
+	}
+	PollSource const source( record.get(), replay.get() );
+
+	RefreshIntervals refresh;
+	if( vm.count("refresh") )
+	{
+	    vector<string> const &specs = vm["refresh"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = specs.begin(); ci != specs.end(); ++ci )
+	    {
+		if( !refresh.parse(*ci) )
+		{
+		    cerr << "unknown refresh section: " << *ci << endl;
+		    return 255;
+		}
+	    }
+	}
+
+	Subtrees subtrees;
+	if( vm.count("subtree") )
+	{
+	    vector<string> const &lists = vm["subtree"].as< vector<string> >();
+	    for( vector<string>::const_iterator ci = lists.begin(); ci != lists.end(); ++ci )
+		subtrees.add(*ci);
+	}
+
+	AgentXOid agentx_root;
+	if( vm.count("agentx-root") )
+	{
+	    // the names of the varbinds are the root followed by up to OID_MAX_ARCS arcs
+	    agentx_root = agentx_parse_oid( vm["agentx-root"].as<string>() );
+	    if( agentx_root.n_subid > AGENTX_MAX_SUBIDS - OID_MAX_ARCS )
+	    {
+		cerr << "agentx root longer than " << AGENTX_MAX_SUBIDS - OID_MAX_ARCS << " sub-ids: " << vm["agentx-root"].as<string>() << endl;
+		return 255;
+	    }
+	}
+
+	PollSettings const settings( vm["dbstats-concurrency"].as<unsigned>(), vm["collstats-budget"].as<unsigned>(),
+				     vm["poll-timeout"].as<unsigned>() );
+	scoped_ptr<DumpWriter> writer( make_dump_writer( vm["output"].as<string>() ) );
+	bool const delta = vm.count("delta") > 0;
+	bool const background = vm.count("shm") || vm.count("agentx");
+	if( !writer || ( delta && !vm.count("daemon") && !vm.count("state-file") ) || ( vm.count("state-file") && !delta ) ||
+	    ( vm.count("full") && !vm.count("state-file") ) || ( background && !vm.count("daemon") ) ||
+	    ( vm.count("agentx") != vm.count("agentx-root") ) )
+	{
+	    cerr << desc << endl;
+	    return 255;
+	}
+
+	if( vm.count("daemon") )
+	{
+	    vector< boost::shared_ptr<Collector> > collectors;
+	    boost::thread_group collector_threads;
+	    for( vector<Instance>::const_iterator ci = instances.begin(); ci != instances.end(); ++ci )
+	    {
+		collectors.push_back( boost::shared_ptr<Collector>( new Collector( ci->dsn, source, refresh, vm["interval"].as<unsigned>(),
+										   settings, subtrees.commands() ) ) );
+	    }
+
+	    scoped_ptr<ShmExport> shm;
+	    scoped_ptr<SnapshotMerger> merger;
+	    scoped_ptr<AgentXSubagent> subagent;
+	    if( background )
+	    {
+		if( vm.count("shm") )
+		    shm.reset( new ShmExport( vm["shm"].as<string>() ) );
+		merger.reset( new SnapshotMerger( collectors, instances, subtrees, shm.get() ) );
+		for( size_t i = 0; i < collectors.size(); ++i )
+		    collectors[i]->set_listener( merger.get() );
+		collector_threads.create_thread( boost::bind( &SnapshotMerger::run, merger.get() ) );
+	    }
+	    if( vm.count("agentx") )
+	    {
+		subagent.reset( new AgentXSubagent( vm["agentx"].as<string>(), agentx_root, *merger ) );
+		collector_threads.create_thread( boost::bind( &AgentXSubagent::run, subagent.get() ) );
+	    }
+
+	    for( size_t i = 0; i < collectors.size(); ++i )
+		collector_threads.create_thread( boost::bind( &Collector::run, collectors[i].get() ) );
+
+	    /*
+	     * every line read is a request for the most recent snapshot, "full" resyncs a delta consumer,
+	     * OIDs (.12,.20) replace the subtrees of --subtree for this request; a delta consumer gets
+	     * the changes since it last asked for the same subtrees
+	     */
+	    std::map< string, boost::shared_ptr<DeltaState> > sent;
+	    OidValueBuffer merged_vals, delta_vals;
+	    string request;
+	    while( getline(cin, request) )
+	    {
+		bool full = false;
+		Subtrees request_subtrees;
+		istringstream words(request);
+		string word;
+		try
+		{
+		    while( words >> word )
+		    {
+			if( "full" == word )
+			    full = true;
+			else if( '.' == word[0] )
+			    request_subtrees.add(word);
+		    }
+		}
+		catch( invalid_argument &e )
+		{
+		    cerr << e.what() << endl;
+		    writer->dump( OidValueBuffer() );
+		    continue;
+		}
+		Subtrees const &wanted = request_subtrees.empty() ? subtrees : request_subtrees;
+		unsigned const commands = wanted.commands();
+
+		for( size_t i = 0; i < collectors.size(); ++i )
+		    collectors[i]->want(commands);
+
+		// an instance not answering yet must not hold back a request for longer than a poll
+		boost::system_time const first_until = boost::get_system_time() + boost::posix_time::seconds( vm["interval"].as<unsigned>() );
+		unsigned long long generation = 0;
+
+		merged_vals.clear();
+		for( size_t i = 0; i < collectors.size(); ++i )
+		{
+		    SnapshotPtr snap = collectors[i]->wait_current(commands, first_until);
+		    if( !snap )
+			continue;
+		    generation += snap->generation;
+		    merged_vals.append( snap->out_vals, instances[i].subroot, wanted.roots() );
+		}
+		if( wanted.overlaps( Oid(".99.5") ) )
+		    writer->report(merged_vals);
+
+		if( !delta )
+		{
+		    writer->dump(merged_vals);
+		    continue;
+		}
+
+		boost::shared_ptr<DeltaState> &state = sent[wanted.key()];
+		if( !state )
+		    state.reset( new DeltaState() );
+		delta_vals.clear();
+		state->diff( merged_vals, generation, full, delta_vals );
+		writer->dump(delta_vals);
+	    }
+
+	    // readers of the shared memory snapshot and the master agent need no stdin
+	    if( !background )
+		collector_threads.interrupt_all();
+	    collector_threads.join_all();
+
+	    return 0;
+	}
+
+	OidValueBuffer out_vals;
+	if( ( 1 == instances.size() ) && instances[0].subroot.empty() )
+	    poll_instance( instances[0], source, settings, subtrees, out_vals );
+	else
+	    InstancePolls( instances, source, vm["instance-concurrency"].as<unsigned>(), settings, subtrees ).run(out_vals);
+
+	if( delta )
+	{
+	    string const &state_file = vm["state-file"].as<string>();
+	    DeltaState sent;
+	    OidValueBuffer delta_vals;
+
+	    sent.load(state_file);
+	    sent.diff( out_vals, sent.generation() + 1, vm.count("full") > 0, delta_vals );
+	    writer->dump(delta_vals);
+	    sent.save(state_file);
+	}
+	else
+	    writer->dump(out_vals);
     }
     catch( DBException &e )
     {
 	cout << "caught " << e.what() << endl;
     }
+    catch( std::exception &e )
+    {
+	cerr << e.what() << endl;
+	return 255;
+    }
 
     return 0;
 }
+#endif /* !WATCH_MONGODB_NO_MAIN */